@@ -4,7 +4,7 @@ def main():
 	pysmq.init()
 
 	pysmq.advertise_hash('MARC');
-	pysmq.wait_for(10000)
+	pysmq.wait_for_subscribers_hash('MARC', 1, 10000)
 	pysmq.publish_hash('MARC', '{"cmd": "$815"}')
 	pysmq.wait_for(100)
 
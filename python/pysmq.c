@@ -31,6 +31,38 @@ static PyObject* py_wait_for(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject* py_wait_for_subscribers(PyObject *self, PyObject *args)
+{
+    int r;
+    const char* topic;
+    int min_count;
+    long int millis;
+    if (!PyArg_ParseTuple(args, "sil", &topic, &min_count, &millis))
+    {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = smq_wait_for_subscribers(topic, min_count, millis);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(r);
+}
+
+static PyObject* py_wait_for_subscribers_hash(PyObject *self, PyObject *args)
+{
+    int r;
+    const char* topic;
+    int min_count;
+    long int millis;
+    if (!PyArg_ParseTuple(args, "sil", &topic, &min_count, &millis))
+    {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    r = smq_wait_for_subscribers_hash(topic, min_count, millis);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(r);
+}
+
 static PyObject* py_spin_once(PyObject *self, PyObject *args)
 {
     Py_BEGIN_ALLOW_THREADS
@@ -75,6 +107,98 @@ static void py_message_callback(const char* topic, const uint8_t* msg, size_t le
     PyGILState_Release(state);
 }
 
+// SMQ_ENCODING_TLV payloads as dicts, buffers as bytes. Items are read before
+// their objects are made, so a truncated payload longjmps without leaking
+static PyObject* py_tlv_value(smsg_t* smsg)
+{
+    size_t len;
+    const char* str;
+    const uint8_t* buf;
+    char name[16];
+    switch (smsg_peek_type(smsg))
+    {
+        case 0x00:
+            str = smsg_read_string(smsg, &len);
+            return PyUnicode_DecodeUTF8(str, len, "replace");
+        case 0x01:
+            sprintf(name, "$crc%04X", smsg_read_hash(smsg));
+            return PyUnicode_FromString(name);
+        case 0x02:
+        case 0x03:
+        case 0x04:
+            return PyLong_FromLong(smsg_read_int32(smsg));
+        case 0x05:
+        case 0x06:
+        case 0x07:
+            return PyLong_FromUnsignedLong(smsg_read_uint32(smsg));
+        case 0x08:
+        case 0x09:
+            return PyFloat_FromDouble(smsg_read_double(smsg));
+        case 0x0A:
+        case 0x0B:
+            return PyBool_FromLong(smsg_read_boolean(smsg));
+        case 0x0C:
+            smsg_skip(smsg);
+            Py_RETURN_NONE;
+        case 0x0D:
+            buf = smsg_read_buffer(smsg, &len);
+            return PyBytes_FromStringAndSize((const char*)buf, len);
+    }
+    smsg_failed(smsg);
+    return NULL;
+}
+
+static PyObject* py_tlv_to_dict(const uint8_t* msg, size_t len)
+{
+    PyObject* dict = PyDict_New();
+    smsg_t smsg;
+    smsg_init(&smsg, msg, len);
+    if (setjmp(smsg.jmp) != 0)
+    {
+        // Truncated, the complete items are kept
+        return dict;
+    }
+    while (smsg_peek_type(&smsg) == 0x00 || smsg_peek_type(&smsg) == 0x01)
+    {
+        char name[16];
+        const char* key = name;
+        size_t key_len;
+        if (smsg_peek_type(&smsg) == 0x00)
+            key = smsg_read_string(&smsg, &key_len);
+        else
+            key_len = sprintf(name, "$crc%04X", smsg_read_hash(&smsg));
+        PyObject* val = py_tlv_value(&smsg);
+        PyObject* pykey = PyUnicode_DecodeUTF8(key, key_len, "replace");
+        if (pykey != NULL && val != NULL)
+            PyDict_SetItem(dict, pykey, val);
+        Py_XDECREF(pykey);
+        Py_XDECREF(val);
+    }
+    return dict;
+}
+
+// Binary subscribers get a dict for SMQ_ENCODING_TLV payloads and the JSON text otherwise
+static void py_binary_callback(const char* topic, const uint8_t* msg, size_t len, void* arg)
+{
+    PyGILState_STATE state = PyGILState_Ensure();
+    Py_ssize_t msglen = len;
+    PyObject* callback = (PyObject*)arg;
+    PyObject* arglist;
+    if (smq_message_encoding() == SMQ_ENCODING_TLV)
+    {
+        PyObject* dict = py_tlv_to_dict(msg, len);
+        arglist = Py_BuildValue("(sN)", topic, dict);
+    }
+    else
+    {
+        arglist = Py_BuildValue("(ss#)", topic, (char*)msg, msglen);
+    }
+    PyObject* result = PyEval_CallObject(callback, arglist);
+    Py_XDECREF(result);
+    Py_DECREF(arglist);
+    PyGILState_Release(state);
+}
+
 static PyObject* py_subscribe(PyObject *self, PyObject *args)
 {
     const char* topic;
@@ -115,6 +239,36 @@ static PyObject* py_subscribe_hash(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject* py_subscribe_binary_with(PyObject *args, int (*subscribe)(const char*, smq_msg_callback_t*, void*))
+{
+    const char* topic;
+    PyObject* pycallback;
+    if (!PyArg_ParseTuple(args, "sO", &topic, &pycallback))
+    {
+        return NULL;
+    }
+    if (!PyCallable_Check(pycallback))
+    {
+        PyErr_SetString(PyExc_TypeError, "Must specify a message handler function!");
+    }
+    else
+    {
+        Py_INCREF(pycallback);
+        subscribe(topic, py_binary_callback, pycallback);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_subscribe_binary(PyObject *self, PyObject *args)
+{
+    return py_subscribe_binary_with(args, smq_subscribe_binary);
+}
+
+static PyObject* py_subscribe_hash_binary(PyObject *self, PyObject *args)
+{
+    return py_subscribe_binary_with(args, smq_subscribe_hash_binary);
+}
+
 static PyObject* py_publish(PyObject *self, PyObject *args)
 {
     const char* topic;
@@ -139,6 +293,149 @@ static PyObject* py_publish_hash(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+// Encode a dict as an SMQ_ENCODING_TLV payload, bytes and bytearray values become buffers
+static size_t py_dict_to_tlv(PyObject* dict, uint8_t* buf, size_t size)
+{
+    smsg_writer_t writer;
+    PyObject* key;
+    PyObject* val;
+    Py_ssize_t pos = 0;
+    smsg_writer_init(&writer, buf, size);
+    if (setjmp(writer.jmp) != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Message too large");
+        return 0;
+    }
+    while (PyDict_Next(dict, &pos, &key, &val))
+    {
+        const char* name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+        if (name == NULL)
+        {
+            PyErr_SetString(PyExc_TypeError, "Message keys must be strings");
+            return 0;
+        }
+        smsg_write_string(&writer, name);
+        if (val == Py_None)
+        {
+            smsg_write_null(&writer);
+        }
+        else if (PyBool_Check(val))
+        {
+            smsg_write_boolean(&writer, val == Py_True);
+        }
+        else if (PyLong_Check(val))
+        {
+            long long v = PyLong_AsLongLong(val);
+            if (v >= -2147483647LL - 1 && v <= 2147483647LL)
+                smsg_write_int32(&writer, (int32_t)v);
+            else if (v > 0 && v <= 0xFFFFFFFFLL)
+                smsg_write_uint32(&writer, (uint32_t)v);
+            else
+            {
+                PyErr_Clear();
+                PyErr_Format(PyExc_OverflowError, "Value of '%s' does not fit 32 bits", name);
+                return 0;
+            }
+        }
+        else if (PyFloat_Check(val))
+        {
+            smsg_write_double(&writer, PyFloat_AsDouble(val));
+        }
+        else if (PyUnicode_Check(val))
+        {
+            Py_ssize_t len;
+            const char* str = PyUnicode_AsUTF8AndSize(val, &len);
+            if (str == NULL)
+                return 0;
+            if (len > 0xFFFF)
+            {
+                PyErr_Format(PyExc_ValueError, "String '%s' is longer than 65535 bytes", name);
+                return 0;
+            }
+            smsg_write_string_len(&writer, str, (uint16_t)len);
+        }
+        else if (PyBytes_Check(val) || PyByteArray_Check(val))
+        {
+            Py_ssize_t len = PyBytes_Check(val) ? PyBytes_GET_SIZE(val) : PyByteArray_GET_SIZE(val);
+            const char* data = PyBytes_Check(val) ? PyBytes_AS_STRING(val) : PyByteArray_AS_STRING(val);
+            if (len > 0xFFFF)
+            {
+                PyErr_Format(PyExc_ValueError, "Buffer '%s' is larger than 65535 bytes", name);
+                return 0;
+            }
+            smsg_write_buffer(&writer, data, (uint16_t)len);
+        }
+        else
+        {
+            PyErr_Format(PyExc_TypeError, "Unsupported value type for '%s'", name);
+            return 0;
+        }
+    }
+    return smsg_writer_len(&writer);
+}
+
+static PyObject* py_publish_binary_with(PyObject *args, int (*publish)(const char*, const uint8_t*, size_t))
+{
+    static uint8_t buf[65536];
+    const char* topic;
+    PyObject* dict;
+    if (!PyArg_ParseTuple(args, "sO!", &topic, &PyDict_Type, &dict))
+    {
+        return NULL;
+    }
+    size_t len = py_dict_to_tlv(dict, buf, sizeof(buf));
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    publish(topic, buf, len);
+    Py_RETURN_NONE;
+}
+
+static PyObject* py_publish_binary(PyObject *self, PyObject *args)
+{
+    return py_publish_binary_with(args, smq_publish_binary);
+}
+
+static PyObject* py_publish_hash_binary(PyObject *self, PyObject *args)
+{
+    return py_publish_binary_with(args, smq_publish_hash_binary);
+}
+
+static PyObject* py_set_compression(PyObject *self, PyObject *args)
+{
+    const char* topic;
+    const char* name;
+    int compression;
+    if (!PyArg_ParseTuple(args, "ss", &topic, &name))
+    {
+        return NULL;
+    }
+    if (strcmp(name, "lz4") == 0)
+        compression = SMQ_COMPRESSION_LZ4;
+    else if (strcmp(name, "zstd") == 0)
+        compression = SMQ_COMPRESSION_ZSTD;
+    else if (strcmp(name, "none") == 0)
+        compression = SMQ_COMPRESSION_NONE;
+    else
+    {
+        PyErr_SetString(PyExc_ValueError, "Compression must be 'lz4', 'zstd' or 'none'");
+        return NULL;
+    }
+    return PyBool_FromLong(smq_set_compression(topic, compression));
+}
+
+static PyObject* py_set_delta(PyObject *self, PyObject *args)
+{
+    const char* topic;
+    unsigned keyframe_interval;
+    if (!PyArg_ParseTuple(args, "sI", &topic, &keyframe_interval))
+    {
+        return NULL;
+    }
+    return PyBool_FromLong(smq_set_delta(topic, keyframe_interval));
+}
+
 // Method definition object for this extension, these argumens mean:
 // ml_name: The name of the method
 // ml_meth: Function pointer to the method implementation
@@ -160,6 +457,14 @@ static PyMethodDef pysmq_methods[] =
         "wait_for", py_wait_for, METH_VARARGS,
         "Wait for network events."
     },
+    {
+        "wait_for_subscribers", py_wait_for_subscribers, METH_VARARGS,
+        "Wait until the topic has at least the given number of subscribers."
+    },
+    {
+        "wait_for_subscribers_hash", py_wait_for_subscribers_hash, METH_VARARGS,
+        "Wait until the topic hash has at least the given number of subscribers."
+    },
     {
         "spin_once", py_spin_once, METH_NOARGS,
         "Check for network events."
@@ -180,6 +485,14 @@ static PyMethodDef pysmq_methods[] =
         "subscribe_hash", py_subscribe_hash, METH_VARARGS,
         "Subscribe to the specified topic hash on the network."
     },
+    {
+        "subscribe_binary", py_subscribe_binary, METH_VARARGS,
+        "Subscribe to the specified topic, binary messages are passed as a dict with bytes buffers."
+    },
+    {
+        "subscribe_hash_binary", py_subscribe_hash_binary, METH_VARARGS,
+        "Subscribe to the specified topic hash, binary messages are passed as a dict with bytes buffers."
+    },
     {
         "publish", py_publish, METH_VARARGS,
         "Publish the a message for the specified topic."
@@ -188,6 +501,22 @@ static PyMethodDef pysmq_methods[] =
         "publish_hash", py_publish_hash, METH_VARARGS,
         "Publish the a message for the specified topic hash."
     },
+    {
+        "publish_binary", py_publish_binary, METH_VARARGS,
+        "Publish a dict as a binary message for the specified topic, bytes values are sent as buffers."
+    },
+    {
+        "publish_hash_binary", py_publish_hash_binary, METH_VARARGS,
+        "Publish a dict as a binary message for the specified topic hash, bytes values are sent as buffers."
+    },
+    {
+        "set_compression", py_set_compression, METH_VARARGS,
+        "Compress messages of an advertised topic with 'lz4' or 'zstd', or 'none'."
+    },
+    {
+        "set_delta", py_set_delta, METH_VARARGS,
+        "Send only the changed fields of an advertised topic, with a whole message every keyframe_interval messages. 0 turns it off."
+    },
     { NULL, NULL, 0, NULL }
 };
 
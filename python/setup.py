@@ -1,11 +1,21 @@
 #!/usr/bin/env python3
 # encoding: utf-8
 
+import os
 from distutils.core import setup, Extension
 
+# Optional compression codecs, as in the Makefile: SMQ_WITH_ZSTD=0 python3 setup.py build
+define_macros = []
+libraries = ['zmq', 'uuid', 'json-c']
+for macro, library in (('SMQ_WITH_LZ4', 'lz4'), ('SMQ_WITH_ZSTD', 'zstd')):
+    if os.environ.get(macro, '1') == '1':
+        define_macros.append((macro, None))
+        libraries.append(library)
+
 pysmq_module = Extension('pysmq',
                          include_dirs=['../src'],
-                         libraries=['zmq', 'uuid', 'json-c'],
+                         define_macros=define_macros,
+                         libraries=libraries,
                          library_dirs=['../lib'],
                          sources = ['pysmq.c','../src/smq.c'])
 
@@ -14,11 +14,29 @@
 
 #include <ifaddrs.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/serial.h>
+#endif
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
 
 #include <zmq.h>
 #include "smq.h"
+#include "smq_private.h"
 
 #include <json-c/json.h>
+#ifdef SMQ_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef SMQ_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #include <uuid/uuid.h>
 #ifdef __MACH__
@@ -35,45 +53,55 @@
 /* Defaults and overrides */
 #define SMQ_DISC_PORT 11312
 #define SMQ_INPROC_ADDR "inproc://topics"
+#define SMQ_IPC_DIR "/tmp"
 
 /* Constants */
-#define SMQ_OP_ADV 0x01
-#define SMQ_OP_SUB 0x02
-#define SMQ_OP_PUB 0x03
-
-#define SMQ_UDP_MAX_SIZE 512
 #define SMQ_ADV_REPEAT_PERIOD 1.0
-#define SMQ_MAX_TOPIC_LENGTH 193 + 1
-#define SMQ_MAX_ADDR_LENGTH 267 + 1
-#define SMQ_FLAGS_LENGTH 16
-#define SMQ_MAX_POLL_ITEMS 1024
+#define SMQ_ADV_REPLY_WINDOW_MS 250
+#define SMQ_CACHE_TTL_SEC 3600
+#define SMQ_CACHE_VERIFY_MS 30000
+#define SMQ_STABLE_PORT_BASE 20000
+#define SMQ_STABLE_PORT_RANGE 8192
+
+/* Payload compression, see smq_set_compression */
+#define SMQ_COMPRESS_MIN_SIZE 256
+#define SMQ_COMPRESS_BACKOFF 16     /* messages sent as they are after compression did not pay */
+#define SMQ_MAX_RAW_LENGTH (64 * 1024 * 1024)
+
+/* Delta encoding of JSON state topics, see smq_set_delta */
+#define SMQ_DELTA_NONE 0
+#define SMQ_DELTA_KEYFRAME 1        /* the whole message */
+#define SMQ_DELTA_UPDATE 2          /* only the fields changed since the previous message */
+#define SMQ_DELTA_KEYFRAME_MS 1000  /* longest time between keyframes */
+
+/* Topic lists also index topics by hash */
+#define SMQ_TOPIC_BUCKETS 64
+
+/* Header versions, SMQ_VERSION_HASH32 nodes use 32-bit topic hashes */
+#define SMQ_VERSION 0x01
+#define SMQ_VERSION_HASH32 0x02
+/* Or'ed in: plain-name copy of an aliased PUB for peers that predate aliasing */
+#define SMQ_VERSION_PLAIN_COPY 0x0100
+
+/* Fixed poll item slots */
+#define SMQ_POLL_BCAST 0
+#define SMQ_POLL_ZMQ 1
+#define SMQ_POLL_UCAST 2
+#define SMQ_POLL_XPUB 3
+#define SMQ_POLL_NETLINK 4
+#define SMQ_POLL_SERIAL 5
 
 // ---------------------------------------
 
-#define GUID_LEN sizeof(uuid_t)
 #define GUID_STR_LEN (sizeof(uuid_t) * 2) + 4 + 1
 
 // ---------------------------------------
 
-typedef struct
-{
-    uint16_t version;
-    uuid_t guid;
-    char topic[SMQ_MAX_TOPIC_LENGTH];
-    uint8_t type;
-    uint8_t flags[SMQ_FLAGS_LENGTH];
-} smq_msg_header_t;
-
-typedef struct
-{
-    smq_msg_header_t header;
-    char addr[SMQ_MAX_ADDR_LENGTH];
-} smq_adv_msg_t;
-
 typedef struct smq_connection_t
 {
     int fd;
     char addr[SMQ_MAX_ADDR_LENGTH];
+    uint64_t expires;
     struct smq_connection_t* next;
     struct smq_connection_t* prev;
 } smq_connection_t;
@@ -88,10 +116,33 @@ typedef struct smq_topic_t
 {
     char name[SMQ_MAX_TOPIC_LENGTH];
     char altname[SMQ_MAX_TOPIC_LENGTH];
+    /* Hash shared by the plain and $crcXXXX forms of the topic */
+    uint32_t hash;
+    /* 2 for $crcXXXX, 4 for $crc32_XXXXXXXX */
+    uint8_t hash_size;
+    /* name is the $crc form */
+    char hashed;
+    /* 32-bit mode: 16-bit $crc name of the plain name, for serial boards and 16-bit peers */
+    char name16[12];
+    /* 16-bit twin of a 32-bit hashed subscription, see smq_subscribe_twin */
+    char twin;
     smq_msg_callback_t* callback;
     smq_msg_callback_t* scallback;
+    /* callback takes SMQ_ENCODING_TLV payloads as they arrive */
+    char binary;
+    /* Serial encoding cache of the topic, see smsg_callback */
+    struct smq_encode_plan_t* plan;
+    /* SMQ_COMPRESSION_* of published messages, the compressor state is kept between them */
+    uint8_t compression;
+    uint8_t compress_backoff;
+    void* compress_ctx;
+    /* Delta encoding state, one stream per publisher on subscribed topics */
+    struct smq_delta_t* delta;
+    int subscribers;
+    smq_adv_reply_t adv_replies[SMQ_ADV_REPLY_SLOTS];
     struct smq_topic_t* next;
     struct smq_topic_t* prev;
+    struct smq_topic_t* hash_next;
     void* arg;
 } smq_topic_t;
 
@@ -99,21 +150,48 @@ typedef struct
 {
     struct smq_topic_t* first;
     struct smq_topic_t* last;
+    struct smq_topic_t* buckets[SMQ_TOPIC_BUCKETS];
 } smq_topic_list_t;
 
+/* Message being delivered, decoded at most once for all of its callbacks */
+typedef struct
+{
+    const uint8_t* data;
+    size_t len;
+    int encoding;
+    /* JSON text, made on first use for SMQ_ENCODING_TLV payloads */
+    const char* json;
+    size_t json_len;
+    json_object* jobj;
+    char jobj_owned;
+    char indexed;
+    char valid;
+    smq_json_field_t* fields;
+    size_t field_count;
+    size_t field_cap;
+} smq_message_t;
+
 // ---------------------------------------
 
 static uuid_t GUID;
 
 static int init_called;
 
-static int bcast_fd;
+static int bcast_fd = -1;
+static int ucast_fd = -1;
+static int netlink_fd = -1;
+static int network_ready;
+static struct timespec last_addr_check;
+static uint16_t ucast_port;
+static int discd_fd = -1;
 static struct sockaddr_in dst_addr, rcv_addr;
 static struct ip_mreq mreq;
 
 static char ip_address[INET_ADDRSTRLEN];
 static char bcast_address[INET_ADDRSTRLEN];
 static char tcp_address[SMQ_MAX_ADDR_LENGTH];
+static char ipc_address[SMQ_MAX_ADDR_LENGTH];
+static char host_id[SMQ_HOST_ID_LENGTH];
 
 static void* zmq_context;
 static void* zmq_publish_sock;
@@ -124,8 +202,27 @@ static size_t poll_items_count;
 
 static smq_topic_list_t published_topics;
 static smq_topic_list_t subscribed_topics;
+static smq_topic_list_t remote_subscriptions;
+/* Every plain topic name seen locally or in discovery, for collision checks */
+static smq_topic_list_t known_topics;
+static unsigned topic_collisions;
+/* Bytes of hash in the $crc names this node creates, see SMQ_TOPIC_HASH_BITS */
+static uint8_t topic_hash_size = 2;
+/* 32-bit mode: 16-bit hashes some peer or serial board uses, see smq_hash16_use */
+static uint8_t hash16_used[65536 / 8];
+/* Smallest payload worth compressing, see SMQ_COMPRESS_MIN */
+static size_t compress_min_size = SMQ_COMPRESS_MIN_SIZE;
 static smq_connection_list_t connections;
 
+static smq_peer_list_t cache_peers;
+static const char* cache_path;
+static uint64_t cache_ttl_ms;
+static size_t cache_pending;
+/* Endpoints that outlive a restart, see smq_cache_bind_stable */
+static char stable_tried;
+static uint16_t stable_port;
+static char stable_ipc_address[SMQ_MAX_ADDR_LENGTH];
+
 static smq_timer_callback_t* timer_callback;
 static void* timer_arg;
 static long timer_period;
@@ -133,6 +230,13 @@ static struct timespec last_timer;
 
 static smq_msg_callback_t* global_callback;
 static void* global_callback_arg;
+/* Encoding of the payload handed to the running callback */
+static int message_encoding = SMQ_ENCODING_JSON;
+/* Hash of the topic handed to the running callback */
+static uint16_t message_topic_hash;
+/* Message being delivered, see smq_message_json */
+static smq_message_t current_message;
+static char message_active;
 
 // Needs updating can only monitor one socket and file descriptor
 
@@ -152,7 +256,7 @@ static int register_file_descriptor(int fd)
 
 static int unregister_file_descriptor(int fd)
 {
-    if (poll_items_count > 1 && poll_items[poll_items_count-1].fd == fd)
+    if (poll_items_count > SMQ_POLL_SERIAL && poll_items[poll_items_count-1].fd == fd)
     {
         poll_items_count -= 1;
         poll_items[poll_items_count].socket = 0;
@@ -188,6 +292,7 @@ static int smq_connection_list_append(smq_connection_list_t* list, int fd, const
     }
     new_connection->next = 0;
     new_connection->fd = fd;
+    new_connection->expires = 0;
     strncpy(new_connection->addr, addr, SMQ_MAX_ADDR_LENGTH);
     if (0 == list->last && 0 == list->first)
     {
@@ -204,16 +309,24 @@ static int smq_connection_list_append(smq_connection_list_t* list, int fd, const
     return 1;
 }
 
-static int smq_connection_list_remove(smq_connection_t* connection)
+static int smq_connection_list_remove(smq_connection_list_t* list, smq_connection_t* connection)
 {
     if (connection->next)
     {
         connection->next->prev = connection->prev;
     }
+    else
+    {
+        list->last = connection->prev;
+    }
     if (connection->prev)
     {
         connection->prev->next = connection->next;
     }
+    else
+    {
+        list->first = connection->next;
+    }
     free(connection);
     return 1;
 }
@@ -276,7 +389,7 @@ static void smq_guid_to_str(uuid_t guid, char* guid_str, int guid_str_len)
     }
 }
 
-static int smq_guid_compare(uuid_t guid, uuid_t other)
+int smq_guid_compare(uuid_t guid, uuid_t other)
 {
     for (size_t i = 0; i < sizeof(uuid_t); i ++)
     {
@@ -290,6 +403,61 @@ static int smq_guid_compare(uuid_t guid, uuid_t other)
 
 // ---------------------------------------
 
+smq_peer_t* smq_peer_list_append(smq_peer_list_t* list, uint8_t type, int fd, uuid_t guid, const char* topic, const char* addr)
+{
+    smq_peer_t* peer = (struct smq_peer_t*) calloc(1, sizeof(struct smq_peer_t));
+    if (0 == peer)
+    {
+        fprintf(stderr, "Error appending peer to list\n");
+        return 0;
+    }
+    peer->type = type;
+    peer->fd = fd;
+    memcpy(peer->guid, guid, GUID_LEN);
+    snprintf(peer->topic, SMQ_MAX_TOPIC_LENGTH, "%s", topic);
+    snprintf(peer->addr, SMQ_MAX_ADDR_LENGTH, "%s", addr);
+    peer->prev = list->last;
+    if (list->last)
+    {
+        list->last->next = peer;
+    }
+    else
+    {
+        list->first = peer;
+    }
+    list->last = peer;
+    return peer;
+}
+
+void smq_peer_list_remove(smq_peer_list_t* list, smq_peer_t* peer)
+{
+    if (peer->next)
+        peer->next->prev = peer->prev;
+    else
+        list->last = peer->prev;
+    if (peer->prev)
+        peer->prev->next = peer->next;
+    else
+        list->first = peer->next;
+    free(peer);
+}
+
+smq_peer_t* smq_peer_in_list(smq_peer_list_t* list, uint8_t type, uuid_t guid, const char* topic)
+{
+    smq_peer_t* peer = list->first;
+    while (peer != 0)
+    {
+        if (peer->type == type && smq_guid_compare(peer->guid, guid) && 0 == strcmp(peer->topic, topic))
+        {
+            break;
+        }
+        peer = peer->next;
+    }
+    return peer;
+}
+
+// ---------------------------------------
+
 static int smq_broadcast_ip_from_address_ip(char* ip_addr, char* bcast_addr)
 {
     char temp_ip_addr[INET_ADDRSTRLEN];
@@ -312,12 +480,15 @@ static int smq_broadcast_ip_from_address_ip(char* ip_addr, char* bcast_addr)
 
 static int smq_get_interface_ipv4(const char* name, char* address)
 {
-    int retryCount = 0;
     struct ifaddrs* ifAddrStruct = NULL;
     struct ifaddrs* ifa = NULL;
     void* tmpAddrPtr = NULL;
 
-    getifaddrs(&ifAddrStruct);
+    if (0 != getifaddrs(&ifAddrStruct))
+    {
+        address[0] = 0;
+        return 0;
+    }
     int address_found = 0;
 
     char ifname[256];
@@ -340,46 +511,25 @@ static int smq_get_interface_ipv4(const char* name, char* address)
             next += strlen(name);
         }
 
-        printf("NAME : \"%s\"\n", name);
         for (ifa = ifAddrStruct; NULL != ifa; ifa = ifa->ifa_next)
         {
             /* If IPv4 */
-            if (strcmp(ifa->ifa_name, ifname) == 0)
+            if (strcmp(ifa->ifa_name, ifname) == 0 && ifa->ifa_addr != NULL && AF_INET == ifa->ifa_addr->sa_family)
             {
-                printf("CHECK %s == %s\n", ifa->ifa_name, ifname);
-                if (AF_INET == ifa->ifa_addr->sa_family)
-                {
-                    tmpAddrPtr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
-                    inet_ntop(AF_INET, tmpAddrPtr, address, INET_ADDRSTRLEN);
-                }
-                else
-                {
-                    continue;
-                }
-                /* stop at the first non 127.0.0.1 address that is not self-assigned */
-                if (address[0] && strncmp(address, "127.0.0.1", 9))
-                {
-                    if (strncmp(address, "169.", 4) == 0)
-                    {
-                        // wait 10 seconds and try interface again
-                        if (retryCount < 4)
-                        {
-                            printf("Retrying interface: %s [%s]\n", ifa->ifa_name, address);
-                            *address = '\0';
-                            retryCount += 1;
-                            sleep(10);
-                            getifaddrs(&ifAddrStruct);
-                            next = name;
-                            break;
-                        }
-                    }
-                    else
-                    {
-                        printf("Using interface: %s [%s]\n", ifa->ifa_name, address);
-                        address_found = 1;
-                        break;
-                    }
-                }
+                tmpAddrPtr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+                inet_ntop(AF_INET, tmpAddrPtr, address, INET_ADDRSTRLEN);
+            }
+            else
+            {
+                continue;
+            }
+            /* stop at the first non 127.0.0.1 address that is not self-assigned, a usable
+               address showing up later is picked up by the address watcher */
+            if (address[0] && strncmp(address, "127.0.0.1", 9) && strncmp(address, "169.", 4))
+            {
+                printf("Using interface: %s [%s]\n", ifa->ifa_name, address);
+                address_found = 1;
+                break;
             }
         }
         name = next;
@@ -483,52 +633,286 @@ static long smq_time_till(struct timespec* last_time, long timer_period)
 
 // ---------------------------------------
 
-int smq_init()
+/* Discovery cache: remembers topic endpoints across restarts so subscribers can connect immediately.
+   Publishers advertise the endpoint of smq_cache_bind_stable when they could bind it, entries
+   that no ADV confirms are dropped by smq_cache_expire */
+
+static void smq_cache_load()
 {
-    if (init_called)
+    cache_path = getenv("SMQ_DISCOVERY_CACHE");
+    if (cache_path == NULL || *cache_path == '\0')
     {
-        fprintf(stderr, "smq_init called more than once\n");
-        return 0;
+        cache_path = NULL;
+        return;
     }
-    init_called = 1;
-    /* Generate uuid */
-    uuid_generate(GUID);
-    int retryCount = 0;
+    const char* ttl = getenv("SMQ_DISCOVERY_CACHE_TTL");
+    cache_ttl_ms = (uint64_t)((ttl != NULL) ? strtoul(ttl, NULL, 10) : SMQ_CACHE_TTL_SEC) * 1000;
+    FILE* f = fopen(cache_path, "r");
+    if (f == NULL)
+    {
+        return;
+    }
+    uint64_t now = smq_current_time();
+    size_t count = 0;
+    char line[SMQ_MAX_TOPIC_LENGTH + SMQ_MAX_ADDR_LENGTH + 64];
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        unsigned long long seen;
+        char guid_str[GUID_STR_LEN];
+        char topic[SMQ_MAX_TOPIC_LENGTH];
+        char addr[SMQ_MAX_ADDR_LENGTH];
+        uuid_t guid;
+        if (4 != sscanf(line, "%llu %36s %193s %267s", &seen, guid_str, topic, addr) ||
+            0 != uuid_parse(guid_str, guid) || now - seen > cache_ttl_ms)
+        {
+            continue;
+        }
+        smq_peer_t* peer = smq_peer_list_append(&cache_peers, SMQ_OP_ADV, -1, guid, topic, addr);
+        if (peer != 0)
+        {
+            peer->seen_time = seen;
+            count++;
+        }
+    }
+    fclose(f);
+    printf("Discovery cache: %s [%u entries]\n", cache_path, (unsigned)count);
+}
 
-    const char* smq_ifname = getenv("SMQ_INTERFACE");
-    if (smq_ifname != NULL)
+static void smq_cache_save()
+{
+    if (cache_path == NULL)
     {
-        /* Get the IPv4 address */
-        while (0 >= smq_get_interface_ipv4(smq_ifname, ip_address))
+        return;
+    }
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache_path);
+    FILE* f = fopen(tmp_path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error writing discovery cache '%s'\n", tmp_path);
+        return;
+    }
+    uint64_t now = smq_current_time();
+    smq_peer_t* peer = cache_peers.first;
+    while (peer != 0)
+    {
+        smq_peer_t* next = peer->next;
+        if (now - peer->seen_time > cache_ttl_ms)
         {
-            if (retryCount++ > 2)
-            {
-                fprintf(stderr, "Error getting IPv4 address.\n");
-                return 0;
-            }
-            printf("Waiting for IPv4 address.\n");
-            sleep(10); // Wait 10 seconds and try again
+            smq_peer_list_remove(&cache_peers, peer);
+        }
+        else
+        {
+            char guid_str[GUID_STR_LEN];
+            smq_guid_to_str(peer->guid, guid_str, GUID_STR_LEN);
+            fprintf(f, "%llu %s %s %s\n", (unsigned long long)peer->seen_time, guid_str, peer->topic, peer->addr);
         }
+        peer = next;
     }
-    else
+    fclose(f);
+    rename(tmp_path, cache_path);
+}
+
+static void smq_cache_update(uuid_t guid, const char* topic_name, const char* addr)
+{
+    if (cache_path == NULL)
+    {
+        return;
+    }
+    uint64_t now = smq_current_time();
+    smq_peer_t* peer = smq_peer_in_list(&cache_peers, SMQ_OP_ADV, guid, topic_name);
+    if (peer == 0)
+    {
+        /* A publisher restarted on its stable endpoint replaces its previous entry */
+        smq_peer_t* old = cache_peers.first;
+        while (old != 0)
+        {
+            smq_peer_t* next = old->next;
+            if (0 == strcmp(old->topic, topic_name) && 0 == strcmp(old->addr, addr))
+                smq_peer_list_remove(&cache_peers, old);
+            old = next;
+        }
+        peer = smq_peer_list_append(&cache_peers, SMQ_OP_ADV, -1, guid, topic_name, addr);
+        if (peer == 0)
+            return;
+    }
+    else if (0 == strcmp(peer->addr, addr) && now - peer->seen_time < cache_ttl_ms / 2)
+    {
+        /* Still fresh, avoid rewriting the file for every repeated ADV */
+        return;
+    }
+    snprintf(peer->addr, SMQ_MAX_ADDR_LENGTH, "%s", addr);
+    peer->seen_time = now;
+    smq_cache_save();
+}
+
+static void smq_cache_connect(const char* topic_name)
+{
+    if (cache_path == NULL)
+    {
+        return;
+    }
+    for (smq_peer_t* peer = cache_peers.first; peer != 0; peer = peer->next)
+    {
+        if (0 != strcmp(peer->topic, topic_name) || 0 != smq_addr_in_list(&connections, peer->addr))
+        {
+            continue;
+        }
+        printf("Connecting to cached address '%s' for topic '%s'\n", peer->addr, topic_name);
+        if (0 != zmq_connect(zmq_subscribe_sock, peer->addr) ||
+            !smq_connection_list_append(&connections, -1, peer->addr))
+        {
+            continue;
+        }
+        /* Unverified until a fresh ADV confirms the endpoint */
+        connections.last->expires = smq_current_time() + SMQ_CACHE_VERIFY_MS;
+        cache_pending++;
+    }
+}
+
+static void smq_cache_expire()
+{
+    if (cache_pending == 0)
+    {
+        return;
+    }
+    uint64_t now = smq_current_time();
+    int dirty = 0;
+    smq_connection_t* connection = connections.first;
+    while (connection != 0)
     {
-        while (0 >= smq_get_address_ipv4(ip_address))
+        smq_connection_t* next = connection->next;
+        if (connection->expires != 0 && now > connection->expires)
         {
-            if (retryCount++ > 2)
+            printf("Dropping stale cached address '%s'\n", connection->addr);
+            zmq_disconnect(zmq_subscribe_sock, connection->addr);
+            smq_peer_t* peer = cache_peers.first;
+            while (peer != 0)
             {
-                fprintf(stderr, "Error getting IPv4 address.\n");
-                return 0;
+                smq_peer_t* next_peer = peer->next;
+                if (0 == strcmp(peer->addr, connection->addr))
+                    smq_peer_list_remove(&cache_peers, peer);
+                peer = next_peer;
             }
-            printf("Waiting for IPv4 address.\n");
-            sleep(10); // Wait 10 seconds and try again
+            smq_connection_list_remove(&connections, connection);
+            cache_pending--;
+            dirty = 1;
         }
+        connection = next;
     }
-    /* Get the broadcast address from the IPv4 address */
-    if (0 >= smq_broadcast_ip_from_address_ip(ip_address, bcast_address))
+    if (dirty)
     {
-        fprintf(stderr, "Error computing broadcast ip address\n");
-        return 0;
+        smq_cache_save();
+    }
+}
+
+/* Bind an endpoint derived from the first advertised topic, so a restarted publisher comes
+   back where the cache entries of its subscribers point */
+static void smq_cache_bind_stable(const char* topic_name)
+{
+    if (cache_path == NULL || stable_tried || zmq_publish_sock == NULL)
+    {
+        return;
+    }
+    stable_tried = 1;
+    uint16_t port = SMQ_STABLE_PORT_BASE + smq_string_hash(topic_name) % SMQ_STABLE_PORT_RANGE;
+    char addr[SMQ_MAX_ADDR_LENGTH];
+    snprintf(addr, sizeof(addr), "tcp://*:%u", port);
+    if (0 > zmq_bind(zmq_publish_sock, addr))
+    {
+        fprintf(stderr, "Stable port %u is in use, cached entries for this node will not survive its restart\n", port);
+        return;
+    }
+    stable_port = port;
+    /* Holding the port makes this the only node of the host using the ipc path */
+    if (ipc_address[0] != '\0')
+    {
+        const char* ipc_dir = getenv("SMQ_IPC_DIR");
+        snprintf(stable_ipc_address, sizeof(stable_ipc_address), "ipc://%s/smq-%u.ipc",
+            (ipc_dir != NULL) ? ipc_dir : SMQ_IPC_DIR, port);
+        if (0 > zmq_bind(zmq_publish_sock, stable_ipc_address))
+        {
+            stable_ipc_address[0] = '\0';
+        }
+    }
+    printf("Stable Port:   %u %s\n", port, stable_ipc_address);
+}
+
+// ---------------------------------------
+
+static void smq_init_host_id()
+{
+    /* Prefer the machine id, hostnames are often left at their defaults across a fleet */
+    FILE* f = fopen("/etc/machine-id", "r");
+    if (f != NULL)
+    {
+        if (1 != fscanf(f, "%64s", host_id))
+            host_id[0] = '\0';
+        fclose(f);
+    }
+    if (host_id[0] == '\0')
+    {
+        gethostname(host_id, sizeof(host_id));
+        host_id[sizeof(host_id) - 1] = '\0';
+    }
+}
+
+static int smq_find_address(char* address)
+{
+    const char* smq_ifname = getenv("SMQ_INTERFACE");
+    if (smq_ifname != NULL)
+    {
+        return smq_get_interface_ipv4(smq_ifname, address);
+    }
+    return smq_get_address_ipv4(address);
+}
+
+static int smq_open_netlink()
+{
+#ifdef __linux__
+    /* Watch for IPv4 addresses being added or removed */
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (0 > fd)
+    {
+        return -1;
     }
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR;
+    if (0 > bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* Drain pending netlink messages, returns 1 if any IPv4 address was added or removed */
+int smq_netlink_changed()
+{
+    int changed = 0;
+#ifdef __linux__
+    char buffer[4096];
+    int len;
+    while (0 < (len = recv(netlink_fd, buffer, sizeof(buffer), 0)))
+    {
+        for (struct nlmsghdr* nh = (struct nlmsghdr *) buffer; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_type == RTM_NEWADDR || nh->nlmsg_type == RTM_DELADDR)
+                changed = 1;
+        }
+    }
+#endif
+    return changed;
+}
+
+static int smq_open_discovery_sockets()
+{
     /* Setup broadcast socket */
     bcast_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (0 >= bcast_fd)
@@ -576,26 +960,120 @@ int smq_init()
         fprintf(stderr, "Error binding broadcast socket\n");
         return 0;
     }
+    /* Setup unicast socket on an ephemeral port for directed ADV replies */
+    ucast_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (0 >= ucast_fd)
+    {
+        fprintf(stderr, "Error opening unicast socket\n");
+        return 0;
+    }
+    if (fcntl(ucast_fd, F_SETFL, O_NONBLOCK, 1) < 0)
+    {
+        fprintf(stderr, "Error setting unicast socket to non-blocking\n");
+        return 0;
+    }
+    struct sockaddr_in ucast_addr;
+    socklen_t ucast_addr_len = sizeof(ucast_addr);
+    memset(&ucast_addr, 0, sizeof(ucast_addr));
+    ucast_addr.sin_family = AF_INET;
+    ucast_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    ucast_addr.sin_port = 0;
+    if (bind(ucast_fd, (struct sockaddr *) &ucast_addr, sizeof(ucast_addr)) < 0 ||
+        getsockname(ucast_fd, (struct sockaddr *) &ucast_addr, &ucast_addr_len) < 0)
+    {
+        fprintf(stderr, "Error binding unicast socket\n");
+        return 0;
+    }
+    ucast_port = ucast_addr.sin_port;
+    return 1;
+}
+
+const char* smq_discoveryd_path()
+{
+    const char* path = getenv("SMQ_DISCOVERYD");
+    return (path != NULL && *path != '\0') ? path : SMQ_DISCOVERYD_PATH;
+}
+
+static int smq_connect_discoveryd()
+{
+    const char* path = smq_discoveryd_path();
+    if (0 == strcmp(path, "off"))
+    {
+        return 0;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (0 > fd)
+    {
+        return 0;
+    }
+    if (0 > connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+    {
+        /* No daemon running, do discovery ourselves */
+        close(fd);
+        return 0;
+    }
+    printf("Discovery:     %s\n", path);
+    discd_fd = fd;
+    return 1;
+}
+
+static int smq_bind_network();
+static json_object* smq_tlv_to_json(const uint8_t* data, size_t len);
+static void smq_compression_shutdown();
+static void smq_delta_shutdown();
+
+int smq_init()
+{
+    if (init_called)
+    {
+        fprintf(stderr, "smq_init called more than once\n");
+        return 0;
+    }
+    init_called = 1;
+    /* Wider topic hashes for deployments with many topics, all nodes must agree */
+    const char* hash_bits = getenv("SMQ_TOPIC_HASH_BITS");
+    topic_hash_size = (hash_bits != NULL && atoi(hash_bits) == 32) ? 4 : 2;
+    const char* compress_min = getenv("SMQ_COMPRESS_MIN");
+    if (compress_min != NULL)
+        compress_min_size = strtoul(compress_min, NULL, 10);
+    /* Generate uuid */
+    uuid_generate(GUID);
+    smq_init_host_id();
+    smq_cache_load();
+    netlink_fd = smq_open_netlink();
+    /* Hand discovery to the local daemon when one is running */
+    if (smq_connect_discoveryd())
+    {
+        bcast_fd = discd_fd;
+    }
     /* Add the bcast socket to the zmq poller */
     register_file_descriptor(bcast_fd);
     /* Setup zmq context */
     zmq_context = zmq_ctx_new();
     /* Setup publisher zmq socket */
-    zmq_publish_sock = zmq_socket(zmq_context, ZMQ_PUB);
-    /* Bind publisher to tcp transport */
-    char publish_addr[SMQ_MAX_ADDR_LENGTH];
-    sprintf(publish_addr, "tcp://%s:*", ip_address);
-    if (0 > zmq_bind(zmq_publish_sock, publish_addr))
-    {
-        fprintf(stderr, "Error binding zmq socket to tcp\n");
-        return 0;
-    }
-    size_t size_of_tcp_address = sizeof(tcp_address);
-    memset(tcp_address, 0, size_of_tcp_address);
-    if (0 > zmq_getsockopt(zmq_publish_sock, ZMQ_LAST_ENDPOINT, tcp_address, &size_of_tcp_address))
+    zmq_publish_sock = zmq_socket(zmq_context, ZMQ_XPUB);
+    /* Report every subscription so remote subscribers can be counted */
+    int verbose = 1;
+    zmq_setsockopt(zmq_publish_sock, ZMQ_XPUB_VERBOSE, &verbose, sizeof(verbose));
+#ifdef ZMQ_XPUB_VERBOSER
+    zmq_setsockopt(zmq_publish_sock, ZMQ_XPUB_VERBOSER, &verbose, sizeof(verbose));
+#endif
+    /* Bind publisher to ipc transport for subscribers on the same host */
+    const char* ipc_dir = getenv("SMQ_IPC_DIR");
+    if (ipc_dir == NULL || 0 != strcmp(ipc_dir, "off"))
     {
-        fprintf(stderr, "Error getting endpoint address of publisher socket\n");
-        return 0;
+        char guid_str[GUID_STR_LEN];
+        smq_guid_to_str(GUID, guid_str, GUID_STR_LEN);
+        snprintf(ipc_address, sizeof(ipc_address), "ipc://%s/smq-%s.ipc", (ipc_dir != NULL) ? ipc_dir : SMQ_IPC_DIR, guid_str);
+        if (0 > zmq_bind(zmq_publish_sock, ipc_address))
+        {
+            fprintf(stderr, "Error binding zmq socket to ipc, same-host peers will use tcp\n");
+            ipc_address[0] = '\0';
+        }
     }
     /* Bind publisher to inproc transport */
     if (0 > zmq_bind(zmq_publish_sock, SMQ_INPROC_ADDR))
@@ -607,34 +1085,57 @@ int smq_init()
     zmq_subscribe_sock = zmq_socket(zmq_context, ZMQ_SUB);
     zmq_connect(zmq_subscribe_sock, SMQ_INPROC_ADDR);
     register_socket(zmq_subscribe_sock);
+    register_file_descriptor(ucast_fd);
+    register_socket(zmq_publish_sock);
+    register_file_descriptor(netlink_fd);
+    /* Bind tcp and start discovery now if we have an address, otherwise once one shows up */
+    smq_get_time_now(&last_addr_check);
+    if (!smq_bind_network())
+    {
+        printf("Waiting for IPv4 address, continuing with ipc and inproc only.\n");
+    }
     /* Report the state of the node */
     char guid_str[GUID_STR_LEN];
     smq_guid_to_str(GUID, guid_str, GUID_STR_LEN);
     printf("GUID:          %s\n", guid_str);
-    printf("IPv4 Address:  %s\n", ip_address);
-    printf("Bcast Address: %s\n", bcast_address);
-    printf("TCP Endpoint:  %s\n", tcp_address);
+    printf("IPC Endpoint:  %s\n", ipc_address);
     /* Return the handle */
     return 1;
 }
 
 int smq_shutdown()
 {
+    free(current_message.fields);
+    current_message.fields = NULL;
+    current_message.field_cap = 0;
+    smq_compression_shutdown();
+    smq_delta_shutdown();
     if (zmq_publish_sock != NULL)
         zmq_close(zmq_publish_sock);
+    if (ipc_address[0] != '\0')
+        unlink(ipc_address + strlen("ipc://"));
+    if (stable_ipc_address[0] != '\0')
+        unlink(stable_ipc_address + strlen("ipc://"));
     if (zmq_subscribe_sock != NULL)
         zmq_close(zmq_subscribe_sock);
     if (zmq_context != NULL)
         zmq_ctx_destroy(zmq_context);
+    if (ucast_fd > 0)
+        close(ucast_fd);
     return 1;
 }
 
-static int sendto_bcast(unsigned char* buffer, size_t buffer_len)
+int smq_sendto_bcast(unsigned char* buffer, size_t buffer_len)
 {
+    if (discd_fd != -1)
+    {
+        /* The discovery daemon broadcasts on our behalf */
+        return send(discd_fd, buffer, buffer_len, MSG_NOSIGNAL);
+    }
     return sendto(bcast_fd, buffer, buffer_len, 0, (struct sockaddr *) &dst_addr, sizeof(dst_addr));
 }
 
-static size_t serialize_msg_header(uint8_t* buffer, smq_msg_header_t* header)
+size_t smq_serialize_msg_header(uint8_t* buffer, const smq_msg_header_t* header)
 {
     size_t index = 0;
     memcpy(buffer, &header->version, 2);
@@ -653,34 +1154,29 @@ static size_t serialize_msg_header(uint8_t* buffer, smq_msg_header_t* header)
     return index;
 }
 
-static size_t deserialize_msg_header(smq_msg_header_t* header, uint8_t* buffer, size_t len)
+size_t smq_deserialize_msg_header(smq_msg_header_t* header, uint8_t* buffer, size_t len)
 {
-    size_t header_length = 0, available_bytes = len;
-    assert (available_bytes > 2);
+    size_t header_length = 0;
+    uint8_t topic_len;
+    header->type = 0;
+    header->topic[0] = '\0';
+    if (len < 2 + GUID_LEN + 1)
+        return 0;
     memcpy(&header->version, buffer, 2);
     header_length += 2;
-    available_bytes -= 2;
-    assert (available_bytes > GUID_LEN);
     memcpy(&header->guid, buffer + header_length, GUID_LEN);
     header_length += GUID_LEN;
-    available_bytes -= GUID_LEN;
-    assert (available_bytes > 1);
-    uint8_t topic_len;
     memcpy(&topic_len, buffer + header_length, 1);
     header_length += 1;
-    available_bytes -= 1;
-    assert (available_bytes > topic_len);
+    if (topic_len >= SMQ_MAX_TOPIC_LENGTH || len < header_length + topic_len + 1 + SMQ_FLAGS_LENGTH)
+        return 0;
     memcpy(&header->topic, buffer + header_length, topic_len);
+    header->topic[topic_len] = '\0';
     header_length += topic_len;
-    available_bytes -= topic_len;
-    assert (available_bytes > 1);
     memcpy(&header->type, buffer + header_length, 1);
     header_length += 1;
-    available_bytes -= 1;
-    assert (available_bytes >= 16);
-    memcpy(&header->flags, buffer + header_length, 16);
-    header_length += 16;
-    header->topic[topic_len] = '\0';
+    memcpy(&header->flags, buffer + header_length, SMQ_FLAGS_LENGTH);
+    header_length += SMQ_FLAGS_LENGTH;
     return header_length;
 }
 
@@ -698,51 +1194,224 @@ static void smq_print_header(smq_msg_header_t* header)
 
 static size_t serialize_adv_msg(uint8_t* buffer, smq_adv_msg_t* adv_msg)
 {
-    size_t bytes_written = serialize_msg_header(buffer, &adv_msg->header);
+    size_t bytes_written = smq_serialize_msg_header(buffer, &adv_msg->header);
     uint16_t addr_len = strlen(adv_msg->addr);
     memcpy(buffer + bytes_written, &addr_len, sizeof(addr_len));
     bytes_written += sizeof(addr_len);
     memcpy(buffer + bytes_written, adv_msg->addr, addr_len);
     bytes_written += addr_len;
+    /* Append the ipc trailer if there is one and it fits */
+    uint8_t host_id_len = strlen(adv_msg->host_id);
+    uint16_t ipc_addr_len = strlen(adv_msg->ipc_addr);
+    if (ipc_addr_len != 0 &&
+        bytes_written + 1 + host_id_len + sizeof(ipc_addr_len) + ipc_addr_len <= SMQ_UDP_MAX_SIZE)
+    {
+        memcpy(buffer + bytes_written, &host_id_len, 1);
+        bytes_written += 1;
+        memcpy(buffer + bytes_written, adv_msg->host_id, host_id_len);
+        bytes_written += host_id_len;
+        memcpy(buffer + bytes_written, &ipc_addr_len, sizeof(ipc_addr_len));
+        bytes_written += sizeof(ipc_addr_len);
+        memcpy(buffer + bytes_written, adv_msg->ipc_addr, ipc_addr_len);
+        bytes_written += ipc_addr_len;
+    }
     return bytes_written;
 }
 
-static size_t deserialize_adv_msg(smq_adv_msg_t* adv_msg, uint8_t* buffer, size_t len)
+size_t smq_deserialize_adv_msg(smq_adv_msg_t* adv_msg, uint8_t* buffer, size_t len)
 {
     size_t msg_len = 0, available_bytes = len;
     uint16_t addr_len;
-    assert (available_bytes > sizeof(addr_len));
+    adv_msg->addr[0] = 0;
+    adv_msg->host_id[0] = 0;
+    adv_msg->ipc_addr[0] = 0;
+    if (available_bytes < sizeof(addr_len))
+        return 0;
     memcpy(&addr_len, buffer, sizeof(addr_len));
     msg_len += sizeof(addr_len);
     available_bytes -= sizeof(addr_len);
-    assert (available_bytes >= addr_len);
+    if (addr_len >= SMQ_MAX_ADDR_LENGTH || available_bytes < addr_len)
+        return 0;
     memcpy(&adv_msg->addr, buffer + msg_len, addr_len);
     adv_msg->addr[addr_len] = 0;
     msg_len += addr_len;
+    available_bytes -= addr_len;
+    /* Older nodes do not send the ipc trailer */
+    uint8_t host_id_len;
+    uint16_t ipc_addr_len;
+    if (available_bytes < 1)
+        return msg_len;
+    memcpy(&host_id_len, buffer + msg_len, 1);
+    if (host_id_len >= SMQ_HOST_ID_LENGTH || available_bytes < 1 + host_id_len + sizeof(ipc_addr_len))
+        return msg_len;
+    memcpy(&ipc_addr_len, buffer + msg_len + 1 + host_id_len, sizeof(ipc_addr_len));
+    if (ipc_addr_len >= SMQ_MAX_ADDR_LENGTH || available_bytes < 1 + host_id_len + sizeof(ipc_addr_len) + ipc_addr_len)
+        return msg_len;
+    memcpy(adv_msg->host_id, buffer + msg_len + 1, host_id_len);
+    adv_msg->host_id[host_id_len] = 0;
+    msg_len += 1 + host_id_len + sizeof(ipc_addr_len);
+    memcpy(adv_msg->ipc_addr, buffer + msg_len, ipc_addr_len);
+    adv_msg->ipc_addr[ipc_addr_len] = 0;
+    msg_len += ipc_addr_len;
     return msg_len;
 }
 
-static int send_adv(const char* topic_name)
+static uint16_t smq_header_version()
+{
+    return (topic_hash_size == 4) ? SMQ_VERSION_HASH32 : SMQ_VERSION;
+}
+
+size_t smq_build_adv_msg(uint8_t* buffer, uuid_t guid, const char* topic_name, const char* addr, const char* ipc_addr)
 {
     /* Build an adv_msg.header */
     smq_adv_msg_t adv_msg;
-    adv_msg.header.version = 0x01;
-    memcpy(adv_msg.header.guid, GUID, GUID_LEN);
+    adv_msg.header.version = smq_header_version();
+    memcpy(adv_msg.header.guid, guid, GUID_LEN);
     strcpy(adv_msg.header.topic, topic_name);
     adv_msg.header.type = SMQ_OP_ADV;
     memset(adv_msg.header.flags, 0, SMQ_FLAGS_LENGTH);
     /* Copy in adv_msg.addr */
-    strcpy(adv_msg.addr, tcp_address);
+    strcpy(adv_msg.addr, addr);
+    strcpy(adv_msg.host_id, host_id);
+    strcpy(adv_msg.ipc_addr, ipc_addr);
+    return serialize_adv_msg(buffer, &adv_msg);
+}
+
+static int send_adv_to(const char* topic_name, const struct sockaddr_in* addr)
+{
     uint8_t buffer[SMQ_UDP_MAX_SIZE];
-    size_t adv_msg_len = serialize_adv_msg(buffer, &adv_msg);
-    if (0 >= sendto_bcast(buffer, adv_msg_len))
+    const char* endpoint = tcp_address;
+    char stable_addr[SMQ_MAX_ADDR_LENGTH];
+    if (stable_port != 0)
+    {
+        snprintf(stable_addr, sizeof(stable_addr), "tcp://%s:%u", ip_address, stable_port);
+        endpoint = stable_addr;
+    }
+    size_t adv_msg_len = smq_build_adv_msg(buffer, GUID, topic_name, endpoint,
+        (stable_ipc_address[0] != '\0') ? stable_ipc_address : ipc_address);
+    if (addr == &dst_addr)
+    {
+        if (0 >= smq_sendto_bcast(buffer, adv_msg_len))
+        {
+            fprintf(stderr, "Error sending ADV message to broadcast\n");
+            return 0;
+        }
+        return 1;
+    }
+    if (0 >= sendto(bcast_fd, buffer, adv_msg_len, 0, (const struct sockaddr *) addr, sizeof(*addr)))
     {
-        fprintf(stderr, "Error sending ADV message to broadcast\n");
+        fprintf(stderr, "Error sending ADV message to %s\n", inet_ntoa(addr->sin_addr));
         return 0;
     }
     return 1;
 }
 
+/* Work out where an ADV in response to a SUB should go. Returns 0 if the same reply was sent recently. */
+int smq_adv_reply_addr(smq_msg_header_t* header, const struct sockaddr_in* src_addr,
+    smq_adv_reply_t* replies, struct sockaddr_in* reply_addr)
+{
+    /* Reply directly to the requester if it told us where, otherwise fall back to broadcast */
+    uint16_t reply_port;
+    *reply_addr = dst_addr;
+    memcpy(&reply_port, header->flags + SMQ_FLAG_REPLY_PORT, sizeof(reply_port));
+    if (reply_port != 0)
+    {
+        *reply_addr = *src_addr;
+        reply_addr->sin_port = reply_port;
+    }
+    /* Suppress duplicate replies to the same destination within a short window, several
+       destinations are tracked so subscribers asking in turn do not defeat it */
+    uint64_t now = smq_current_time();
+    smq_adv_reply_t* slot = &replies[0];
+    for (int i = 0; i < SMQ_ADV_REPLY_SLOTS; i++)
+    {
+        if (replies[i].addr.sin_addr.s_addr == reply_addr->sin_addr.s_addr &&
+            replies[i].addr.sin_port == reply_addr->sin_port)
+        {
+            if (now - replies[i].time < SMQ_ADV_REPLY_WINDOW_MS)
+            {
+                return 0;
+            }
+            slot = &replies[i];
+            break;
+        }
+        if (replies[i].time < slot->time)
+        {
+            slot = &replies[i];
+        }
+    }
+    slot->time = now;
+    slot->addr = *reply_addr;
+    return 1;
+}
+
+static int send_adv(const char* topic_name)
+{
+    if (!network_ready)
+    {
+        /* Advertised once an address is available */
+        return 1;
+    }
+    return send_adv_to(topic_name, &dst_addr);
+}
+
+static int smq_is_hash_topic(const char* topic_name)
+{
+    return (strncmp(topic_name, "$crc", 4) == 0);
+}
+
+/* crc-32 poly 0x04C11DB7 (reflected 0xEDB88320) */
+static uint32_t smq_string_hash32(const char* str)
+{
+    static uint32_t crc32_table[256];
+    if (crc32_table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+            }
+            crc32_table[i] = crc;
+        }
+    }
+    uint32_t crc = ~0;
+    while (*str != '\0')
+    {
+        crc = (crc >> 8) ^ crc32_table[(crc ^ (uint8_t)*str++) & 0xFF];
+    }
+    return ~crc;
+}
+
+/* Bytes of hash behind a topic name, $crc names carry their own width.
+   32-bit names are $crc32_XXXXXXXX so that no 16-bit filter is a prefix of one. */
+static uint8_t smq_topic_hash_size(const char* topic_name)
+{
+    if (smq_is_hash_topic(topic_name))
+    {
+        return (strncmp(topic_name, "$crc32_", 7) == 0) ? 4 : 2;
+    }
+    return topic_hash_size;
+}
+
+static uint32_t smq_topic_hash(const char* topic_name)
+{
+    if (smq_is_hash_topic(topic_name))
+    {
+        return (uint32_t)strtoul(topic_name + ((smq_topic_hash_size(topic_name) == 4) ? 7 : 4), NULL, 16);
+    }
+    return (topic_hash_size == 4) ? smq_string_hash32(topic_name) : smq_string_hash(topic_name);
+}
+
+static void smq_hash_topic_name(char* buf, const char* topic_name)
+{
+    if (smq_topic_hash_size(topic_name) == 4)
+        sprintf(buf, "$crc32_%08X", smq_topic_hash(topic_name));
+    else
+        sprintf(buf, "$crc%04X", smq_topic_hash(topic_name));
+}
+
 static int smq_topic_list_append(smq_topic_list_t* topic_list, const char* topic, smq_msg_callback_t* callback, void* arg)
 {
     smq_topic_t* new_topic = (struct smq_topic_t*) malloc(sizeof(struct smq_topic_t));
@@ -754,9 +1423,26 @@ static int smq_topic_list_append(smq_topic_list_t* topic_list, const char* topic
     new_topic->next = 0;
     strncpy(new_topic->name, topic, SMQ_MAX_TOPIC_LENGTH);
     new_topic->altname[0] = '\0';
+    new_topic->hash = smq_topic_hash(topic);
+    new_topic->hash_size = smq_topic_hash_size(topic);
+    new_topic->hashed = smq_is_hash_topic(topic);
+    new_topic->name16[0] = '\0';
+    if (topic_hash_size == 4 && !new_topic->hashed)
+        sprintf(new_topic->name16, "$crc%04X", smq_string_hash(topic));
+    new_topic->twin = 0;
     new_topic->callback = callback;
     new_topic->scallback = NULL;
+    new_topic->binary = 0;
+    new_topic->plan = NULL;
+    new_topic->compression = SMQ_COMPRESSION_NONE;
+    new_topic->compress_backoff = 0;
+    new_topic->compress_ctx = NULL;
+    new_topic->delta = NULL;
+    new_topic->subscribers = 0;
+    memset(new_topic->adv_replies, 0, sizeof(new_topic->adv_replies));
     new_topic->arg = arg;
+    new_topic->hash_next = topic_list->buckets[new_topic->hash % SMQ_TOPIC_BUCKETS];
+    topic_list->buckets[new_topic->hash % SMQ_TOPIC_BUCKETS] = new_topic;
     if (0 == topic_list->last && 0 == topic_list->first)
     {
         new_topic->prev = 0;
@@ -772,16 +1458,50 @@ static int smq_topic_list_append(smq_topic_list_t* topic_list, const char* topic
     return 1;
 }
 
-static int smq_topic_list_remove(smq_topic_t* topic)
+static void smq_encode_plan_free(struct smq_encode_plan_t* plan);
+static void smq_compress_free(smq_topic_t* topic);
+static int smq_compression_available(int compression);
+static size_t smq_compress(smq_topic_t* topic, const uint8_t* msg, size_t len, const uint8_t** packed);
+static uint8_t* smq_decompress(int compression, const uint8_t* data, size_t len, uint32_t raw_len);
+static void smq_delta_free(smq_topic_t* topic);
+static const uint8_t* smq_delta_encode(smq_topic_t* topic, smq_msg_header_t* header, const uint8_t* msg, size_t* len);
+static uint8_t* smq_delta_decode(smq_topic_t* topic, const smq_msg_header_t* header, uint8_t* data, size_t* len);
+static void smq_delta_resync(const char* filter);
+static long smq_serial_check_resend();
+static void smq_hash16_use(uint16_t hash16);
+static int smq_subscribe_twin(smq_topic_t* topic);
+
+static int smq_topic_list_remove(smq_topic_list_t* topic_list, smq_topic_t* topic)
 {
+    /* Unlink from the hash bucket as well, lookups walk it */
+    smq_topic_t** link = &topic_list->buckets[topic->hash % SMQ_TOPIC_BUCKETS];
+    while (*link != NULL && *link != topic)
+    {
+        link = &(*link)->hash_next;
+    }
+    if (*link != NULL)
+    {
+        *link = topic->hash_next;
+    }
     if (topic->next)
     {
         topic->next->prev = topic->prev;
     }
+    else
+    {
+        topic_list->last = topic->prev;
+    }
     if (topic->prev)
     {
         topic->prev->next = topic->next;
     }
+    else
+    {
+        topic_list->first = topic->next;
+    }
+    smq_encode_plan_free(topic->plan);
+    smq_compress_free(topic);
+    smq_delta_free(topic);
     free(topic);
     return 1;
 }
@@ -800,17 +1520,108 @@ static smq_topic_t* smq_topic_in_list(smq_topic_list_t* topic_list, const char*
     return topic;
 }
 
+/* The $crc form of a topic */
+static smq_topic_t* smq_topic_hashed(smq_topic_list_t* topic_list, uint32_t hash, uint8_t hash_size)
+{
+    smq_topic_t* topic = topic_list->buckets[hash % SMQ_TOPIC_BUCKETS];
+    while (topic != NULL && (topic->hash != hash || !topic->hashed || topic->hash_size != hash_size))
+    {
+        topic = topic->hash_next;
+    }
+    return topic;
+}
+
+/* A plain-named topic with the given hash, or exactly topic_name if given */
+static smq_topic_t* smq_topic_plain(smq_topic_list_t* topic_list, uint32_t hash, const char* topic_name)
+{
+    smq_topic_t* topic = topic_list->buckets[hash % SMQ_TOPIC_BUCKETS];
+    while (topic != NULL && (topic->hash != hash || topic->hashed ||
+                             (topic_name != NULL && 0 != strcmp(topic->name, topic_name))))
+    {
+        topic = topic->hash_next;
+    }
+    return topic;
+}
+
+/* 32-bit mode: the topic whose 16-bit name this is, twins excluded */
+static smq_topic_t* smq_topic_by_name16(smq_topic_list_t* topic_list, const char* name16)
+{
+    smq_topic_t* topic = topic_list->first;
+    while (topic != NULL && (topic->twin || 0 != strcmp(topic->name16, name16)))
+    {
+        topic = topic->next;
+    }
+    return topic;
+}
+
+static int smq_hash16_used(uint16_t hash16)
+{
+    return (hash16_used[hash16 / 8] & (1 << (hash16 % 8))) != 0;
+}
+
+/* 32-bit mode: a $crcXXXX name, which boards and 16-bit peers use */
+static int smq_is_hash16_topic(const char* topic_name)
+{
+    return (topic_hash_size == 4 && smq_is_hash_topic(topic_name) && smq_topic_hash_size(topic_name) == 2);
+}
+
+/* More than one known plain name shares the hash */
+static int smq_topic_collides(uint32_t hash)
+{
+    int count = 0;
+    for (smq_topic_t* topic = known_topics.buckets[hash % SMQ_TOPIC_BUCKETS]; topic != NULL; topic = topic->hash_next)
+    {
+        if (topic->hash == hash)
+            count++;
+    }
+    return (count > 1);
+}
+
+/* Remember a plain topic name and report other names with the same hash */
+static void smq_topic_check_collision(const char* topic_name)
+{
+    if (smq_is_hash_topic(topic_name))
+    {
+        return;
+    }
+    uint32_t hash = smq_topic_hash(topic_name);
+    if (smq_topic_plain(&known_topics, hash, topic_name) != NULL)
+    {
+        return;
+    }
+    smq_topic_t* other = smq_topic_plain(&known_topics, hash, NULL);
+    if (other != NULL)
+    {
+        topic_collisions++;
+        fprintf(stderr, "Topic hash collision: '%s' and '%s' both hash to 0x%0*X, use SMQ_TOPIC_HASH_BITS=32\n",
+            topic_name, other->name, topic_hash_size * 2, hash);
+    }
+    smq_topic_list_append(&known_topics, topic_name, NULL, NULL);
+}
+
+unsigned smq_topic_collision_count()
+{
+    return topic_collisions;
+}
+
 static int smq_topic_list_destroy(smq_topic_list_t* topic_list)
 {
     smq_topic_t* topic = topic_list->first;
+    memset(topic_list->buckets, 0, sizeof(topic_list->buckets));
     while (1)
     {
         if (0 == topic->next)
         {
+            smq_encode_plan_free(topic->plan);
+            smq_compress_free(topic);
+            smq_delta_free(topic);
             free(topic);
             return 1;
         }
         topic = topic->next;
+        smq_encode_plan_free(topic->prev->plan);
+        smq_compress_free(topic->prev);
+        smq_delta_free(topic->prev);
         free(topic->prev);
     }
 }
@@ -827,9 +1638,12 @@ int smq_is_advertised(const char* topic_name)
 
 int smq_is_advertised_hash(const char* topic_name)
 {
-    char buf[32];
-    sprintf(buf, "$crc%04X", smq_string_hash(topic_name));
-    return smq_is_advertised(buf);
+    if (!init_called)
+    {
+        fprintf(stderr, "(smq_is_advertised_hash) smq_init must be called first\n");
+        return 0;
+    }
+    return (smq_topic_hashed(&published_topics, smq_topic_hash(topic_name), smq_topic_hash_size(topic_name)) != NULL);
 }
 
 int smq_advertise(const char* topic_name)
@@ -846,11 +1660,15 @@ int smq_advertise(const char* topic_name)
         return 0;
     }
     printf("Advertising topic '%s'\n", topic_name);
+    smq_topic_check_collision(topic_name);
     /* Add topic to publisher list */
     if (!smq_topic_list_append(&published_topics, topic_name, 0, NULL))
     {
         return 0;
     }
+    smq_cache_bind_stable(topic_name);
+    if (smq_is_hash16_topic(topic_name))
+        smq_hash16_use(smq_topic_hash(topic_name));
     rc = send_adv(topic_name);
     return rc;
 }
@@ -858,22 +1676,37 @@ int smq_advertise(const char* topic_name)
 int smq_advertise_hash(const char* topic_name)
 {
     char buf[32];
-    sprintf(buf, "$crc%04X", smq_string_hash(topic_name));
-    return smq_advertise(buf);
+    smq_topic_check_collision(topic_name);
+    smq_hash_topic_name(buf, topic_name);
+    if (!smq_advertise(buf))
+    {
+        return 0;
+    }
+    smq_topic_t* topic = smq_topic_in_list(&published_topics, buf);
+    if (topic != NULL && topic->hash_size == 4 && !smq_is_hash_topic(topic_name))
+        sprintf(topic->name16, "$crc%04X", smq_string_hash(topic_name));
+    return 1;
 }
 
 static int send_sub(const char* topic_name)
 {
+    if (!network_ready && discd_fd == -1)
+    {
+        /* Sent once an address is available */
+        return 1;
+    }
     /* Build a sub_msg */
     smq_msg_header_t header;
-    header.version = 0x01;
+    header.version = smq_header_version();
     memcpy(header.guid, GUID, GUID_LEN);
     strcpy(header.topic, topic_name);
     header.type = SMQ_OP_SUB;
     memset(header.flags, 0, SMQ_FLAGS_LENGTH);
+    /* Ask publishers to reply directly to our unicast socket */
+    memcpy(header.flags + SMQ_FLAG_REPLY_PORT, &ucast_port, sizeof(ucast_port));
     uint8_t buffer[SMQ_UDP_MAX_SIZE];
-    size_t header_len = serialize_msg_header(buffer, &header);
-    if (0 >= sendto_bcast(buffer, header_len))
+    size_t header_len = smq_serialize_msg_header(buffer, &header);
+    if (0 >= smq_sendto_bcast(buffer, header_len))
     {
         fprintf(stderr, "Error sending SUB message to broadcast\n");
         return 0;
@@ -891,17 +1724,6 @@ int smq_is_subscribed(const char* topic_name)
     return (smq_topic_in_list(&subscribed_topics, topic_name) != NULL);
 }
 
-static int smq_is_subscribed_serial(const char* topic_name)
-{
-    if (!init_called)
-    {
-        fprintf(stderr, "(smq_is_subscribed_serial) smq_init must be called first\n");
-        return 0;
-    }
-    smq_topic_t* topic = smq_topic_in_list(&subscribed_topics, topic_name);
-    return (topic != NULL)? (topic->scallback != NULL) : 0;
-}
-
 int smq_subscribe_all(smq_msg_callback_t* callback, void* arg)
 {
     global_callback = callback;
@@ -929,6 +1751,7 @@ int smq_subscribe(const char* topic_name, smq_msg_callback_t* callback, void* ar
         return 1;
     }
     printf("Subscribing to topic '%s'\n", topic_name);
+    smq_topic_check_collision(topic_name);
     /* Add topic to subscriber list */
     if (!smq_topic_list_append(&subscribed_topics, topic_name, callback, arg))
     {
@@ -939,9 +1762,48 @@ int smq_subscribe(const char* topic_name, smq_msg_callback_t* callback, void* ar
     {
         fprintf(stderr, "Error subscribing to topic '%s'\n", topic_name);
     }
+    if (!smq_is_hash_topic(topic_name))
+    {
+        /* Aliased topics travel under their hash name */
+        char hash_name[32];
+        smq_hash_topic_name(hash_name, topic_name);
+        if (0 != zmq_setsockopt(zmq_subscribe_sock, ZMQ_SUBSCRIBE, hash_name, strlen(hash_name)))
+        {
+            fprintf(stderr, "Error subscribing to topic '%s'\n", hash_name);
+        }
+        /* and under the 16-bit name once a 16-bit node or board takes part in it */
+        smq_topic_t* topic = smq_topic_in_list(&subscribed_topics, topic_name);
+        if (topic != NULL && topic->name16[0] != '\0' && smq_hash16_used(smq_topic_hash(topic->name16)) &&
+            0 != zmq_setsockopt(zmq_subscribe_sock, ZMQ_SUBSCRIBE, topic->name16, strlen(topic->name16)))
+        {
+            fprintf(stderr, "Error subscribing to topic '%s'\n", topic->name16);
+        }
+    }
+    else if (smq_is_hash16_topic(topic_name))
+    {
+        smq_hash16_use(smq_topic_hash(topic_name));
+    }
+    smq_cache_connect(topic_name);
     return send_sub(topic_name);
 }
 
+int smq_subscribe_binary(const char* topic_name, smq_msg_callback_t* callback, void* arg)
+{
+    if (!smq_subscribe(topic_name, callback, arg))
+    {
+        return 0;
+    }
+    smq_topic_t* topic = smq_topic_in_list(&subscribed_topics, topic_name);
+    if (topic != NULL)
+        topic->binary = 1;
+    return 1;
+}
+
+int smq_message_encoding()
+{
+    return message_encoding;
+}
+
 static int smq_subscribe_ser(const char* topic_name, smq_msg_callback_t* callback)
 {
     if (!init_called)
@@ -975,49 +1837,128 @@ static int smq_subscribe_ser(const char* topic_name, smq_msg_callback_t* callbac
     {
         fprintf(stderr, "Error subscribing to topic '%s'\n", topic_name);
     }
+    if (!smq_is_hash_topic(topic_name))
+    {
+        /* Aliased topics travel under their hash name */
+        char hash_name[32];
+        smq_hash_topic_name(hash_name, topic_name);
+        if (0 != zmq_setsockopt(zmq_subscribe_sock, ZMQ_SUBSCRIBE, hash_name, strlen(hash_name)))
+        {
+            fprintf(stderr, "Error subscribing to topic '%s'\n", hash_name);
+        }
+    }
+    else if (smq_is_hash16_topic(topic_name))
+    {
+        smq_hash16_use(smq_topic_hash(topic_name));
+    }
+    smq_cache_connect(topic_name);
     return send_sub(topic_name);
 }
 
 int smq_subscribe_hash(const char* topic_name, smq_msg_callback_t* callback, void* arg)
 {
     char topic_hash[32];
-    sprintf(topic_hash, "$crc%04X", smq_string_hash(topic_name));
-    if (smq_subscribe(topic_hash, callback, arg))
+    smq_topic_check_collision(topic_name);
+    smq_hash_topic_name(topic_hash, topic_name);
+    if (!smq_subscribe(topic_hash, callback, arg))
     {
-        smq_topic_t* topic = smq_topic_in_list(&subscribed_topics, topic_hash);
-        if (topic != NULL)
-            strncpy(topic->altname, topic_name, SMQ_MAX_TOPIC_LENGTH);
+        return 0;
+    }
+    smq_topic_t* topic = smq_topic_hashed(&subscribed_topics, smq_topic_hash(topic_hash), smq_topic_hash_size(topic_hash));
+    if (topic == NULL || smq_is_hash_topic(topic_name))
+    {
+        return 1;
+    }
+    strncpy(topic->altname, topic_name, SMQ_MAX_TOPIC_LENGTH);
+    if (topic->hash_size == 4)
+    {
+        sprintf(topic->name16, "$crc%04X", smq_string_hash(topic_name));
+        if (smq_hash16_used(smq_string_hash(topic_name)))
+            return smq_subscribe_twin(topic);
     }
+    return 1;
 }
 
-int smq_publish(const char* topic_name, const uint8_t* msg, size_t len)
+int smq_subscribe_hash_binary(const char* topic_name, smq_msg_callback_t* callback, void* arg)
 {
-    if (!init_called)
+    if (!smq_subscribe_hash(topic_name, callback, arg))
     {
-        fprintf(stderr, "(smq_publish) smq_init must be called first\n");
         return 0;
     }
-    if (!smq_topic_in_list(&published_topics, topic_name))
+    smq_topic_t* topic = smq_topic_hashed(&subscribed_topics, smq_topic_hash(topic_name), smq_topic_hash_size(topic_name));
+    if (topic != NULL)
+        topic->binary = 1;
+    if (topic_hash_size == 4 && !smq_is_hash_topic(topic_name))
+    {
+        topic = smq_topic_hashed(&subscribed_topics, smq_string_hash(topic_name), 2);
+        if (topic != NULL && topic->twin)
+            topic->binary = 1;
+    }
+    return 1;
+}
+
+/* 16-bit nodes and boards send a hashed topic under its 16-bit name, it gets a twin subscription */
+static int smq_subscribe_twin(smq_topic_t* topic)
+{
+    smq_topic_t* twin = smq_topic_in_list(&subscribed_topics, topic->name16);
+    if (twin != NULL && twin->twin)
+    {
+        return 1;
+    }
+    if (!smq_subscribe(topic->name16, topic->callback, topic->arg))
     {
-        fprintf(stderr, "Cannot publish to topic '%s' which is unadvertised\n", topic_name);
         return 0;
     }
-    // printf("smq_publish %s\n", topic_name);
+    twin = smq_topic_in_list(&subscribed_topics, topic->name16);
+    if (twin != NULL)
+    {
+        strncpy(twin->altname, topic->altname, SMQ_MAX_TOPIC_LENGTH);
+        twin->binary = topic->binary;
+        twin->twin = 1;
+    }
+    return 1;
+}
 
-    /* Construct a header for the message */
-    smq_msg_header_t header;
-    header.version = 0x01;
-    memcpy(header.guid, GUID, GUID_LEN);
-    strcpy(header.topic, topic_name);
-    header.type = SMQ_OP_PUB;
-    memset(header.flags, 0, SMQ_FLAGS_LENGTH);
+/* 32-bit mode: a peer or board uses this 16-bit hash. Topics with that 16-bit name then
+   travel under it, so subscriptions add the 16-bit filter, see smq_publish_topic. */
+static void smq_hash16_use(uint16_t hash16)
+{
+    if (topic_hash_size != 4 || smq_hash16_used(hash16))
+    {
+        return;
+    }
+    hash16_used[hash16 / 8] |= 1 << (hash16 % 8);
+    char name16[12];
+    sprintf(name16, "$crc%04X", hash16);
+    for (smq_topic_t* topic = subscribed_topics.first; topic != 0; topic = topic->next)
+    {
+        if (topic->twin || 0 != strcmp(topic->name16, name16))
+        {
+            continue;
+        }
+        printf("Topic '%s' is also used with 16-bit hashes, subscribing to '%s'\n",
+            (*topic->altname != 0) ? topic->altname : topic->name, name16);
+        if (topic->hashed)
+        {
+            smq_subscribe_twin(topic);
+        }
+        else if (0 != zmq_setsockopt(zmq_subscribe_sock, ZMQ_SUBSCRIBE, name16, strlen(name16)))
+        {
+            fprintf(stderr, "Error subscribing to topic '%s'\n", name16);
+        }
+    }
+}
+
+/* Send the three parts of a PUB */
+static void smq_send_pub(const char* wire_topic, const smq_msg_header_t* header, const uint8_t* msg, size_t len)
+{
     uint8_t buffer[SMQ_UDP_MAX_SIZE];
-    size_t header_len = serialize_msg_header(buffer, &header);
+    size_t header_len = smq_serialize_msg_header(buffer, header);
     /* Send the topic as the first part of a three part message */
     zmq_msg_t topic_msg;
-    assert(0 == zmq_msg_init_size(&topic_msg, strlen(topic_name)));
-    memcpy(zmq_msg_data(&topic_msg), topic_name, strlen(topic_name));
-    assert(strlen(topic_name) == zmq_msg_send(&topic_msg, zmq_publish_sock, ZMQ_SNDMORE));
+    assert(0 == zmq_msg_init_size(&topic_msg, strlen(wire_topic)));
+    memcpy(zmq_msg_data(&topic_msg), wire_topic, strlen(wire_topic));
+    assert(strlen(wire_topic) == zmq_msg_send(&topic_msg, zmq_publish_sock, ZMQ_SNDMORE));
     zmq_msg_close(&topic_msg);
     /* Send the header the next part */
     zmq_msg_t header_msg;
@@ -1031,69 +1972,297 @@ int smq_publish(const char* topic_name, const uint8_t* msg, size_t len)
     memcpy(zmq_msg_data(&data_msg), msg, len);
     assert(len == zmq_msg_send(&data_msg, zmq_publish_sock, 0));
     zmq_msg_close(&data_msg);
-    return 1;
 }
 
-int smq_publish_hash(const char* topicName, const uint8_t *msg, size_t len)
+/* Some subscription filter matches the topic */
+static int smq_is_remote_subscribed(const char* topic_name)
 {
-    char buf[32];
-    sprintf(buf, "$crc%04X", smq_string_hash(topicName));
-    return smq_publish(buf, msg, len);
+    for (smq_topic_t* subscription = remote_subscriptions.first; subscription != 0; subscription = subscription->next)
+    {
+        if (subscription->subscribers > 0 && 0 == strncmp(topic_name, subscription->name, strlen(subscription->name)))
+            return 1;
+    }
+    return 0;
 }
 
-int smq_timer(smq_timer_callback_t* callback, long timer_period_ms, void* arg)
+/* A subscriber filters on exactly this name, hash names are never matched by prefix */
+static int smq_is_remote_filter(const char* topic_name)
 {
-    if (timer_period_ms < 0)
-    {
-        fprintf(stderr, "Cannot set a timer with period less than 0\n");
-        return 0;
-    }
-    if (callback != 0 && timer_period_ms == 0)
-    {
-        fprintf(stderr, "Cannot set a timer with period 0\n");
-        return 0;
-    }
-    timer_callback = callback;
-    timer_arg = arg;
-    timer_period = timer_period_ms;
-    smq_get_time_now(&last_timer);
-    return 1;
+    smq_topic_t* subscription = smq_topic_in_list(&remote_subscriptions, topic_name);
+    return (subscription != NULL && subscription->subscribers > 0);
 }
 
-int smq_clear_timer()
+/* 32-bit mode: a 16-bit node or board subscribes the topic's 16-bit name,
+   so every subscriber gets it under that name and 32-bit ones add that filter */
+static int smq_topic_uses_hash16(const smq_topic_t* topic)
 {
-    return smq_timer(0, 0, NULL);
+    return (topic->name16[0] != '\0' && smq_is_remote_filter(topic->name16));
 }
 
-static int handle_bcast_msg(uint8_t* buffer, int length)
+static int smq_publish_topic(smq_topic_t* topic, const uint8_t* msg, size_t len, uint8_t encoding)
 {
-    smq_msg_header_t header;
-    size_t header_size = deserialize_msg_header(&header, buffer, length);
-    // printf("handle_bcast_msg type=%d\n", header.type);
-    if (header.type == SMQ_OP_ADV)
+    /* A topic advertised in both forms is sent once under its hash name,
+       the header keeps the plain name so subscribers to either form get it */
+    const char* wire_topic = topic->name;
+    smq_topic_t* hash_topic = topic->hashed ? topic : smq_topic_hashed(&published_topics, topic->hash, topic->hash_size);
+    uint32_t topic_id = topic->hash;
+    uint8_t topic_id_size = topic->hash_size;
+    if (hash_topic != NULL)
     {
-        smq_adv_msg_t adv_msg;
-        deserialize_adv_msg(&adv_msg, buffer + header_size, length - header_size);
-        memcpy(&adv_msg.header, &header, sizeof(header));
-        if (smq_guid_compare(GUID, adv_msg.header.guid))
+        wire_topic = hash_topic->name;
+        if (smq_topic_uses_hash16(topic))
         {
-            /* Ignore self messages */
-            return 1;
+            wire_topic = topic->name16;
+            topic_id = smq_topic_hash(topic->name16);
+            topic_id_size = 2;
         }
-        if (0 == strncmp("tcp://", adv_msg.addr, 6))
-        {
-            printf("I should connect to tcp address: %s\n", adv_msg.addr);
-            if (0 != smq_addr_in_list(&connections, adv_msg.addr))
-            {
-                printf("Skipping connection to address '%s', because it has already been made\n", adv_msg.addr);
-                return 1;
-            }
-            if (0 != zmq_connect(zmq_subscribe_sock, adv_msg.addr))
+    }
+
+    /* Construct a header for the message */
+    smq_msg_header_t header;
+    header.version = smq_header_version();
+    memcpy(header.guid, GUID, GUID_LEN);
+    strcpy(header.topic, (topic->hashed) ? wire_topic : topic->name);
+    header.type = SMQ_OP_PUB;
+    memset(header.flags, 0, SMQ_FLAGS_LENGTH);
+    header.flags[SMQ_FLAG_ENCODING] = encoding;
+    header.flags[SMQ_FLAG_TOPIC_ID_SIZE] = topic_id_size;
+    memcpy(header.flags + SMQ_FLAG_TOPIC_ID, &topic_id, sizeof(topic_id));
+    if (topic->delta != NULL && encoding == SMQ_ENCODING_JSON)
+        msg = smq_delta_encode(topic, &header, msg, &len);
+    const uint8_t* packed;
+    size_t packed_len = smq_compress(topic, msg, len, &packed);
+    if (packed_len != 0)
+    {
+        uint32_t raw_len = len;
+        header.flags[SMQ_FLAG_COMPRESSION] = topic->compression;
+        memcpy(header.flags + SMQ_FLAG_RAW_LENGTH, &raw_len, sizeof(raw_len));
+        msg = packed;
+        len = packed_len;
+    }
+    smq_send_pub(wire_topic, &header, msg, len);
+    if (!topic->hashed && wire_topic != topic->name && smq_is_remote_subscribed(topic->name))
+    {
+        /* Older peers only filter on the plain name, newer ones drop this copy */
+        header.version |= SMQ_VERSION_PLAIN_COPY;
+        smq_send_pub(topic->name, &header, msg, len);
+    }
+    return 1;
+}
+
+static int smq_publish_encoded(const char* topic_name, const uint8_t* msg, size_t len, uint8_t encoding)
+{
+    if (!init_called)
+    {
+        fprintf(stderr, "(smq_publish) smq_init must be called first\n");
+        return 0;
+    }
+    smq_topic_t* topic = smq_topic_in_list(&published_topics, topic_name);
+    if (topic == NULL)
+    {
+        fprintf(stderr, "Cannot publish to topic '%s' which is unadvertised\n", topic_name);
+        return 0;
+    }
+    // printf("smq_publish %s\n", topic_name);
+    return smq_publish_topic(topic, msg, len, encoding);
+}
+
+int smq_publish(const char* topic_name, const uint8_t* msg, size_t len)
+{
+    return smq_publish_encoded(topic_name, msg, len, SMQ_ENCODING_JSON);
+}
+
+int smq_publish_binary(const char* topic_name, const uint8_t* msg, size_t len)
+{
+    return smq_publish_encoded(topic_name, msg, len, SMQ_ENCODING_TLV);
+}
+
+static int smq_publish_hash_encoded(const char* topicName, const uint8_t *msg, size_t len, uint8_t encoding)
+{
+    if (!init_called)
+    {
+        fprintf(stderr, "(smq_publish_hash) smq_init must be called first\n");
+        return 0;
+    }
+    uint32_t hash = smq_topic_hash(topicName);
+    smq_topic_t* topic = smq_topic_hashed(&published_topics, hash, smq_topic_hash_size(topicName));
+    if (topic == NULL)
+    {
+        char buf[32];
+        smq_hash_topic_name(buf, topicName);
+        fprintf(stderr, "Cannot publish to topic '%s' which is unadvertised\n", buf);
+        return 0;
+    }
+    /* Aliased: one message under the plain name serves both forms */
+    smq_topic_t* plain = smq_topic_plain(&published_topics, hash, topicName);
+    return smq_publish_topic((plain != NULL) ? plain : topic, msg, len, encoding);
+}
+
+int smq_publish_hash(const char* topicName, const uint8_t *msg, size_t len)
+{
+    return smq_publish_hash_encoded(topicName, msg, len, SMQ_ENCODING_JSON);
+}
+
+int smq_publish_hash_binary(const char* topicName, const uint8_t *msg, size_t len)
+{
+    return smq_publish_hash_encoded(topicName, msg, len, SMQ_ENCODING_TLV);
+}
+
+int smq_set_compression(const char* topic_name, int compression)
+{
+    if (compression != SMQ_COMPRESSION_NONE && compression != SMQ_COMPRESSION_LZ4 && compression != SMQ_COMPRESSION_ZSTD)
+    {
+        fprintf(stderr, "Unknown compression %d for topic '%s'\n", compression, topic_name);
+        return 0;
+    }
+    if (!smq_compression_available(compression))
+    {
+        fprintf(stderr, "Compression %d for topic '%s' is not built in\n", compression, topic_name);
+        return 0;
+    }
+    /* Both forms of an advertised topic, either may be the one published */
+    smq_topic_t* topics[2];
+    topics[0] = smq_topic_in_list(&published_topics, topic_name);
+    topics[1] = smq_topic_hashed(&published_topics, smq_topic_hash(topic_name), smq_topic_hash_size(topic_name));
+    if (topics[0] == NULL && topics[1] == NULL)
+    {
+        fprintf(stderr, "Cannot compress topic '%s' which is unadvertised\n", topic_name);
+        return 0;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        smq_topic_t* topic = topics[i];
+        if (topic == NULL || topic->compression == compression)
+            continue;
+        smq_compress_free(topic);
+        topic->compression = compression;
+        topic->compress_backoff = 0;
+    }
+    return 1;
+}
+
+int smq_timer(smq_timer_callback_t* callback, long timer_period_ms, void* arg)
+{
+    if (timer_period_ms < 0)
+    {
+        fprintf(stderr, "Cannot set a timer with period less than 0\n");
+        return 0;
+    }
+    if (callback != 0 && timer_period_ms == 0)
+    {
+        fprintf(stderr, "Cannot set a timer with period 0\n");
+        return 0;
+    }
+    timer_callback = callback;
+    timer_arg = arg;
+    timer_period = timer_period_ms;
+    smq_get_time_now(&last_timer);
+    return 1;
+}
+
+int smq_clear_timer()
+{
+    return smq_timer(0, 0, NULL);
+}
+
+/* Names in discovery feed the collision check, the version tells the peer's hash width */
+static void smq_check_peer_topic(const smq_msg_header_t* header)
+{
+    static char mismatch_reported;
+    if (header->version != smq_header_version() && !mismatch_reported)
+    {
+        mismatch_reported = 1;
+        printf("Peer uses %d-bit topic hashes and this node %d-bit, topics shared with it go through 16-bit names\n",
+            (header->version == SMQ_VERSION_HASH32) ? 32 : 16, topic_hash_size * 8);
+    }
+    /* A 32-bit node negotiates down to 16-bit names per topic, for 16-bit peers and for boards */
+    if (smq_is_hash16_topic(header->topic))
+        smq_hash16_use(smq_topic_hash(header->topic));
+    else if (topic_hash_size == 4 && header->version == SMQ_VERSION && !smq_is_hash_topic(header->topic))
+        smq_hash16_use(smq_string_hash(header->topic));
+    smq_topic_check_collision(header->topic);
+}
+
+/* The host id can match across containers sharing /etc/machine-id without sharing SMQ_IPC_DIR,
+   only take the ipc endpoint if its socket answers from here */
+static int smq_ipc_reachable(const char* ipc_addr)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", ipc_addr + strlen("ipc://"));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (0 > fd)
+    {
+        return 0;
+    }
+    int rc = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+    close(fd);
+    if (0 > rc)
+    {
+        printf("Cannot reach '%s', using tcp\n", ipc_addr);
+        return 0;
+    }
+    return 1;
+}
+
+static int handle_bcast_msg(uint8_t* buffer, int length, const struct sockaddr_in* src_addr)
+{
+    smq_msg_header_t header;
+    size_t header_size = smq_deserialize_msg_header(&header, buffer, length);
+    if (header_size == 0)
+    {
+        fprintf(stderr, "Ignoring malformed discovery message\n");
+        return 1;
+    }
+    // printf("handle_bcast_msg type=%d\n", header.type);
+    if ((header.type == SMQ_OP_ADV || header.type == SMQ_OP_SUB) && !smq_guid_compare(GUID, header.guid))
+    {
+        smq_check_peer_topic(&header);
+    }
+    if (header.type == SMQ_OP_ADV)
+    {
+        smq_adv_msg_t adv_msg;
+        if (0 == smq_deserialize_adv_msg(&adv_msg, buffer + header_size, length - header_size))
+        {
+            fprintf(stderr, "Ignoring malformed ADV message\n");
+            return 1;
+        }
+        memcpy(&adv_msg.header, &header, sizeof(header));
+        if (smq_guid_compare(GUID, adv_msg.header.guid))
+        {
+            /* Ignore self messages */
+            return 1;
+        }
+        if (0 == strncmp("tcp://", adv_msg.addr, 6))
+        {
+            /* Publishers on this host are reached over ipc rather than tcp loopback */
+            const char* addr = adv_msg.addr;
+            if (0 == strncmp("ipc://", adv_msg.ipc_addr, 6) && 0 == strcmp(adv_msg.host_id, host_id) &&
+                smq_ipc_reachable(adv_msg.ipc_addr))
             {
-                fprintf(stderr, "Error connecting to addr '%s'\n", adv_msg.addr);
+                addr = adv_msg.ipc_addr;
+            }
+            printf("I should connect to address: %s\n", addr);
+            smq_cache_update(adv_msg.header.guid, adv_msg.header.topic, addr);
+            smq_connection_t* connection = smq_addr_in_list(&connections, addr);
+            if (0 != connection)
+            {
+                if (connection->expires != 0)
+                {
+                    printf("Verified cached address '%s'\n", addr);
+                    connection->expires = 0;
+                    cache_pending--;
+                }
+                printf("Skipping connection to address '%s', because it has already been made\n", addr);
+                return 1;
+            }
+            if (0 != zmq_connect(zmq_subscribe_sock, addr))
+            {
+                fprintf(stderr, "Error connecting to addr '%s'\n", addr);
                 return 0;
             }
-            if (!smq_connection_list_append(&connections, -1, adv_msg.addr))
+            if (!smq_connection_list_append(&connections, -1, addr))
             {
                 fprintf(stderr, "Failed to add connection to list\n");
                 return 0;
@@ -1109,11 +2278,31 @@ static int handle_bcast_msg(uint8_t* buffer, int length)
     else if (header.type == SMQ_OP_SUB)
     {
         printf("header.topic : %s\n", header.topic);
-        if (0 != smq_topic_in_list(&published_topics, header.topic))
+        if (smq_guid_compare(GUID, header.guid))
+        {
+            /* Ignore self messages */
+            return 1;
+        }
+        smq_topic_t* topic = smq_topic_in_list(&published_topics, header.topic);
+        if (0 == topic && smq_is_hash16_topic(header.topic))
+        {
+            topic = smq_topic_by_name16(&published_topics, header.topic);
+        }
+        if (0 != topic)
         {
-            /* Resend the ADV message */
-            printf("Resending ADV for topic '%s'\n", header.topic);
-            return send_adv(header.topic);
+            struct sockaddr_in reply_addr;
+            if (!smq_adv_reply_addr(&header, src_addr, topic->adv_replies, &reply_addr))
+            {
+                return 1;
+            }
+            printf("Resending ADV for topic '%s' to %s:%u\n", header.topic,
+                inet_ntoa(reply_addr.sin_addr), ntohs(reply_addr.sin_port));
+            if (smq_topic_uses_hash16(topic) && 0 != strcmp(header.topic, topic->name16))
+            {
+                /* Sent under the 16-bit name, the subscriber has to filter on it */
+                send_adv_to(topic->name16, &reply_addr);
+            }
+            return send_adv_to(header.topic, &reply_addr);
         }
         else
         {
@@ -1127,1046 +2316,3607 @@ static int handle_bcast_msg(uint8_t* buffer, int length)
     return 1;
 }
 
-int smq_spin_once(long timeout)
+static void smq_announce_all()
 {
-    if (!init_called)
+    for (smq_topic_t* topic = published_topics.first; topic != 0; topic = topic->next)
     {
-        fprintf(stderr, "(smq_spin_once) smq_init must be called first\n");
-        return 0;
+        send_adv(topic->name);
     }
-    /* If there is a timer set */
-    long time_till_timer = -1;
-    if (0 != timer_callback)
+    for (smq_topic_t* topic = subscribed_topics.first; topic != 0; topic = topic->next)
     {
-        /* Determine the time until the next firing */
-        time_till_timer = smq_time_till(&last_timer, timer_period);
-        /* If we have no time left, run the callback now */
-        if (time_till_timer <= 0)
-        {
-            smq_get_time_now(&last_timer);
-            timer_callback(timer_arg);
-            return 1;
-        }
+        send_sub(topic->name);
     }
-    /* Poll for either the given timeout, or the time until the next timer, which ever is shorter */
-    long zmq_timeout = (-1 != time_till_timer && time_till_timer < timeout) ? time_till_timer : timeout;
-    int rc = zmq_poll(poll_items, poll_items_count, zmq_timeout);
-    if (rc < 0)
+}
+
+/* Pick an address and (re)bind tcp and discovery to it. Returns 0 while no usable address exists. */
+static int smq_bind_network()
+{
+    char address[INET_ADDRSTRLEN];
+    if (!smq_find_address(address))
     {
-        switch (errno)
-        {
-            case EINTR:
-                return 1;
-            case EFAULT:
-                perror("Invalid poll items");
-                return 0;
-            case ETERM:
-                perror("Socket terminated");
-                return 0;
-            default:
-                perror("Unknown error in zmq_poll");
-                return 0;
-        }
+        return 0;
     }
-    /* Check for serial messages */
-    if (zmq_subscribe_serial &&
-        poll_items_count > 1 && poll_items[2].revents & ZMQ_POLLIN)
+    if (network_ready && 0 == strcmp(address, ip_address))
     {
-        smq_process_serial(poll_items[2].fd, 0xFF);
+        return 1;
     }
-
-    /* Timeout */
-    if (rc == 0)
+    strcpy(ip_address, address);
+    /* Get the broadcast address from the IPv4 address */
+    bcast_address[0] = '\0';
+    if (0 >= smq_broadcast_ip_from_address_ip(ip_address, bcast_address))
     {
-        /* TODO: check timer again */
-        return 1;
+        fprintf(stderr, "Error computing broadcast ip address\n");
+        return 0;
     }
-
-    /* Check for incoming broadcast messages */
-    if (0 < poll_items_count && poll_items[0].revents & ZMQ_POLLIN)
+    if (discd_fd == -1)
     {
-        uint8_t buffer[SMQ_UDP_MAX_SIZE];
-        socklen_t len_rcv_addr = sizeof(rcv_addr);
-        int ret = recvfrom(bcast_fd, buffer, SMQ_UDP_MAX_SIZE, 0, (struct sockaddr *) &rcv_addr, &len_rcv_addr);
-        if (ret < 0)
+        if (bcast_fd != -1)
+            close(bcast_fd);
+        if (ucast_fd != -1)
+            close(ucast_fd);
+        bcast_fd = ucast_fd = -1;
+        if (!smq_open_discovery_sockets())
         {
-            perror("Error in recvfrom on broadcast socket");
             return 0;
         }
-        return handle_bcast_msg(buffer, ret);
+        if (init_called)
+        {
+            poll_items[SMQ_POLL_BCAST].fd = bcast_fd;
+            poll_items[SMQ_POLL_UCAST].fd = ucast_fd;
+        }
     }
-    /* Check for incoming ZMQ messages */
-    if (poll_items[1].revents & ZMQ_POLLIN)
+    if (zmq_publish_sock != NULL)
     {
-        char topic[SMQ_MAX_TOPIC_LENGTH];
-        smq_msg_header_t header;
-        /* Get the topic msg */
-        zmq_msg_t topic_msg;
-        assert(0 == zmq_msg_init(&topic_msg));
-        assert(-1 != zmq_msg_recv(&topic_msg, zmq_subscribe_sock, 0));
-        memcpy(topic, zmq_msg_data(&topic_msg), zmq_msg_size(&topic_msg));
-        topic[zmq_msg_size(&topic_msg)] = 0;
-        assert(zmq_msg_more(&topic_msg));
-        zmq_msg_close(&topic_msg);
-        /* Get the header msg */
-        zmq_msg_t header_msg;
-        assert(0 == zmq_msg_init(&header_msg));
-        assert(-1 != zmq_msg_recv(&header_msg, zmq_subscribe_sock, 0));
-        deserialize_msg_header(&header, (uint8_t *) zmq_msg_data(&header_msg), zmq_msg_size(&header_msg));
-        int more = zmq_msg_more(&header_msg);
-        zmq_msg_close(&header_msg);
-        // printf("header.type = %d\n", header.type);
-        if (header.type == SMQ_OP_PUB)
+        /* Bind publisher to tcp transport */
+        if (tcp_address[0] != '\0')
         {
-            /* Find subscriber */
-            smq_topic_t* subscriber = smq_topic_in_list(&subscribed_topics, topic);
-            if (!subscriber)
-            {
-                fprintf(stderr, "Could not find subscriber for topic '%s'\n", topic);
-                return 0;
-            }
-            /* Receive final data msg */
-            assert(more);
-            zmq_msg_t data_msg;
-            assert(0 == zmq_msg_init(&data_msg));
-            assert(-1 != zmq_msg_recv(&data_msg, zmq_subscribe_sock, 0));
-            size_t data_len = zmq_msg_size(&data_msg);
-            uint8_t* data = (uint8_t *) zmq_msg_data(&data_msg);
-            const char* topic_name = topic;
-            if (*subscriber->altname != 0)
-                topic_name = subscriber->altname ;
-            if (subscriber->scallback != NULL)
-                subscriber->scallback(topic_name, data, data_len, subscriber->arg);
-            if (subscriber->callback != NULL)
-                subscriber->callback(topic_name, data, data_len, subscriber->arg);
-            if (global_callback != NULL)
-                global_callback(topic_name, data, data_len, global_callback_arg);
-            zmq_msg_close(&data_msg);
+            zmq_unbind(zmq_publish_sock, tcp_address);
         }
-        return 1;
+        char publish_addr[SMQ_MAX_ADDR_LENGTH];
+        sprintf(publish_addr, "tcp://%s:*", ip_address);
+        if (0 > zmq_bind(zmq_publish_sock, publish_addr))
+        {
+            fprintf(stderr, "Error binding zmq socket to tcp\n");
+            return 0;
+        }
+        size_t size_of_tcp_address = sizeof(tcp_address);
+        memset(tcp_address, 0, size_of_tcp_address);
+        if (0 > zmq_getsockopt(zmq_publish_sock, ZMQ_LAST_ENDPOINT, tcp_address, &size_of_tcp_address))
+        {
+            fprintf(stderr, "Error getting endpoint address of publisher socket\n");
+            return 0;
+        }
+    }
+    network_ready = 1;
+    printf("IPv4 Address:  %s\n", ip_address);
+    printf("Bcast Address: %s\n", bcast_address);
+    printf("TCP Endpoint:  %s\n", tcp_address);
+    printf("Reply Port:    %u\n", ntohs(ucast_port));
+    /* Announce everything that was advertised or subscribed before the address changed */
+    if (init_called)
+    {
+        smq_announce_all();
     }
     return 1;
 }
 
-int smq_wait()
+int smq_network_start()
 {
-    int ret = 0;
-    while (0 < (ret = smq_spin_once(-1))) {}
-    return ret;
+    uuid_generate(GUID);
+    smq_init_host_id();
+    netlink_fd = smq_open_netlink();
+    return smq_bind_network();
 }
 
-int smq_wait_for(long millis)
+/* Rebind after the interfaces changed, returns 1 if the address is a new one */
+int smq_network_rebind()
 {
-    int ret = 0;
-    struct timespec now;
-    long time_till_timer = -1;
-    smq_get_time_now(&now);
-    for (;;)
-    {
-        time_till_timer = smq_time_till(&now, millis);
-        if (time_till_timer <= 0)
-            break;
-        ret = smq_spin_once(time_till_timer);
-        if (ret < 0)
-            break;
-    }
-    return ret;
+    char last_address[INET_ADDRSTRLEN];
+    strcpy(last_address, ip_address);
+    return smq_bind_network() && 0 != strcmp(last_address, ip_address);
 }
 
-// ----------------------------------------------
-
-static inline uint16_t update_crc(uint16_t crc, const uint8_t data)
+int smq_network_ready()
 {
-    // crc-16 poly 0x8005 (x^16 + x^15 + x^2 + 1)
-    static const uint16_t crc16_table[256] =
-    {
-        0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241, 0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
-        0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40, 0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
-        0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40, 0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
-        0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641, 0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
-        0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240, 0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
-        0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41, 0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
-        0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41, 0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
-        0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640, 0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
-        0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240, 0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
-        0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41, 0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
-        0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41, 0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
-        0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640, 0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
-        0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241, 0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
-        0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40, 0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
-        0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40, 0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
-        0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641, 0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
-    };
-    return (crc >> 8) ^ crc16_table[(crc ^ data) & 0xFF];
+    return network_ready;
 }
 
-uint16_t smq_calc_crc(const void* buf, size_t len, uint16_t crc)
+int smq_network_fd(int which)
 {
-    const uint8_t* b = (uint8_t*)buf;
-    const uint8_t* buf_end = (uint8_t*)buf + len;
-    while (b < buf_end)
+    switch (which)
     {
-        crc = update_crc(crc, *b++);
+        case SMQ_NETWORK_BCAST:
+            return bcast_fd;
+        case SMQ_NETWORK_UCAST:
+            return ucast_fd;
+        case SMQ_NETWORK_NETLINK:
+            return netlink_fd;
     }
-    return crc;
+    return -1;
 }
 
-uint16_t smq_string_hash(const char* str)
+uint16_t smq_network_reply_port()
 {
-    return ~smq_calc_crc(str, strlen(str), ~0);
+    return ucast_port;
 }
 
-// ------------------------------------------------------
-
-static void smq_send_raw_bytes(int fd, const void* buf, size_t len)
+static int smq_discoveryd_lost()
 {
-    write(fd, buf, len);
-#if 0
-    printf("==>%d:[0x", len);
-    for (int i = 0; i < len; i++)
+    fprintf(stderr, "Lost connection to discovery daemon, falling back to local discovery\n");
+    close(discd_fd);
+    discd_fd = -1;
+    bcast_fd = -1;
+    poll_items[SMQ_POLL_BCAST].fd = -1;
+    if (network_ready)
     {
-        printf("%02X ", ((uint8_t*)buf)[i]);
+        if (!smq_open_discovery_sockets())
+        {
+            return 0;
+        }
+        poll_items[SMQ_POLL_BCAST].fd = bcast_fd;
+        poll_items[SMQ_POLL_UCAST].fd = ucast_fd;
+        /* Announce everything again now that we own the discovery sockets */
+        smq_announce_all();
     }
-    printf("]\n");
-#endif
+    return 1;
 }
 
-static void smq_send_data(int fd, const void* buf, uint16_t len)
+static void handle_xpub_msgs()
 {
-    uint16_t crc = 0;
-    const uint8_t* b = (uint8_t*)buf;
-    const uint8_t* buf_end = (uint8_t*)buf + len;
-    while (b < buf_end)
+    /* Subscription frames are a 0x01 (subscribe) or 0x00 (unsubscribe) byte followed by the filter */
+    uint8_t buffer[SMQ_MAX_TOPIC_LENGTH + 1];
+    int len;
+    while (0 < (len = zmq_recv(zmq_publish_sock, buffer, sizeof(buffer), ZMQ_DONTWAIT)))
     {
-        crc = update_crc(crc, *b++);
+        /* zmq_recv reports the full length of longer frames, those are truncated */
+        if (len >= (int)sizeof(buffer) || (buffer[0] != 0x00 && buffer[0] != 0x01))
+        {
+            continue;
+        }
+        char filter[SMQ_MAX_TOPIC_LENGTH];
+        memcpy(filter, buffer + 1, len - 1);
+        filter[len - 1] = '\0';
+        smq_topic_t* subscription = smq_topic_in_list(&remote_subscriptions, filter);
+        if (subscription == 0 && buffer[0] == 0x01)
+        {
+            if (!smq_topic_list_append(&remote_subscriptions, filter, NULL, NULL))
+                continue;
+            subscription = remote_subscriptions.last;
+        }
+        if (subscription == 0)
+        {
+            continue;
+        }
+        if (buffer[0] == 0x01)
+        {
+            subscription->subscribers += 1;
+            /* Late joiners cannot use deltas until they have seen a keyframe */
+            smq_delta_resync(filter);
+            if (subscription->subscribers == 1 && smq_is_hash16_topic(filter) &&
+                smq_topic_by_name16(&published_topics, filter) != NULL)
+            {
+                /* The topic now goes out under its 16-bit name, tell 32-bit subscribers to filter on it */
+                printf("Topic '%s' has a 16-bit subscriber, publishing it under that name\n", filter);
+                send_adv(filter);
+            }
+        }
+        else if (subscription->subscribers > 0)
+        {
+            subscription->subscribers -= 1;
+        }
     }
-    smq_send_raw_bytes(fd, &crc, sizeof(crc));
-    smq_send_raw_bytes(fd, buf, len);
 }
 
-void smq_send_string(int fd, const char* str)
-{
-    uint8_t delim = 0x00;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-
-    uint16_t len = strlen(str);
-    smq_send_data(fd, &len, sizeof(len));
-    smq_send_data(fd, str, len);
-}
-
-void smq_send_string_hash(int fd, const char* str)
+static int smq_count_subscribers(const char* topic_name)
 {
-    uint8_t delim = 0x01;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-
-    uint16_t crc = 0xFFFF;
-    size_t len = strlen(str);
-    const uint8_t* b = (uint8_t*)str;
-    const uint8_t* buf_end = (uint8_t*)str + len;
-    while (b < buf_end)
+    int count = 0;
+    /* Hashed topics are counted under the one name they are sent under, see smq_publish_topic.
+       A 32-bit subscriber may hold both filters of a topic but only one of them gets the message. */
+    int hashed = smq_is_hash_topic(topic_name);
+    if (hashed)
     {
-        crc = update_crc(crc, *b++);
+        smq_topic_t* topic = smq_topic_hashed(&published_topics, smq_topic_hash(topic_name), smq_topic_hash_size(topic_name));
+        if (topic != NULL && smq_topic_uses_hash16(topic))
+            topic_name = topic->name16;
     }
-    crc = ~crc;
-    smq_send_raw_bytes(fd, &crc, sizeof(crc));
+    /* Any subscription whose filter is a prefix of the topic receives it */
+    for (smq_topic_t* subscription = remote_subscriptions.first; subscription != 0; subscription = subscription->next)
+    {
+        if (hashed ? 0 == strcmp(topic_name, subscription->name) :
+                     0 == strncmp(topic_name, subscription->name, strlen(subscription->name)))
+            count += subscription->subscribers;
+    }
+    /* Our own inproc subscriber shows up as well, don't count it */
+    for (smq_topic_t* topic = subscribed_topics.first; topic != 0; topic = topic->next)
+    {
+        if ((hashed ? 0 == strcmp(topic_name, topic->name) :
+                      0 == strncmp(topic_name, topic->name, strlen(topic->name))) && count > 0)
+            count -= 1;
+    }
+    return count;
 }
 
-void smq_send_int8(int fd, int8_t val)
+/* Subscribers to the wire topic of a PUB and to its other form, if any */
+static smq_topic_t* smq_topic_subscribers(const char* topic, const smq_msg_header_t* header, smq_topic_t** alias)
 {
-    uint8_t delim = 0x02;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    smq_topic_t* subscriber;
+    const char* plain_name = smq_is_hash_topic(header->topic) ? NULL : header->topic;
+    uint8_t id_size = header->flags[SMQ_FLAG_TOPIC_ID_SIZE];
+    *alias = NULL;
+    if (id_size == 2 || id_size == 4)
+    {
+        /* Integer lookup, the names are only compared between plain topics */
+        uint32_t topic_id;
+        memcpy(&topic_id, header->flags + SMQ_FLAG_TOPIC_ID, sizeof(topic_id));
+        if (!smq_is_hash_topic(topic))
+        {
+            if (id_size != topic_hash_size)
+                return smq_topic_in_list(&subscribed_topics, topic);
+            return smq_topic_plain(&subscribed_topics, topic_id, topic);
+        }
+        subscriber = smq_topic_hashed(&subscribed_topics, topic_id, id_size);
+        if (id_size == topic_hash_size)
+            *alias = smq_topic_plain(&subscribed_topics, topic_id, plain_name);
+        else if (plain_name != NULL)
+            *alias = smq_topic_in_list(&subscribed_topics, plain_name);
+        else if (smq_is_hash16_topic(topic))
+        {
+            /* A 16-bit name reaches plain subscriptions, the hashed ones have their twin */
+            for (smq_topic_t* plain = subscribed_topics.first; plain != NULL && *alias == NULL; plain = plain->next)
+            {
+                if (!plain->hashed && 0 == strcmp(plain->name16, topic))
+                    *alias = plain;
+            }
+        }
+    }
+    else
+    {
+        /* Older publishers only send the name */
+        subscriber = smq_topic_in_list(&subscribed_topics, topic);
+        if (plain_name != NULL && strcmp(plain_name, topic) != 0)
+            *alias = smq_topic_in_list(&subscribed_topics, plain_name);
+        else if (smq_is_hash_topic(topic) && smq_topic_hash_size(topic) == topic_hash_size)
+            *alias = smq_topic_plain(&subscribed_topics, smq_topic_hash(topic), NULL);
+    }
+    if (*alias != NULL && plain_name == NULL && smq_topic_collides((*alias)->hash))
+    {
+        /* Only the hash is known and it names more than one topic */
+        fprintf(stderr, "Not delivering '%s' to '%s', the hash is ambiguous\n", topic, (*alias)->name);
+        *alias = NULL;
+    }
+    return subscriber;
 }
 
-void smq_send_int16(int fd, int16_t val)
+/* Discard the remaining parts of a message so the next receive starts at a topic */
+static void smq_zmq_drain(int more)
 {
-    uint8_t delim = 0x03;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    while (more)
+    {
+        zmq_msg_t msg;
+        assert(0 == zmq_msg_init(&msg));
+        assert(-1 != zmq_msg_recv(&msg, zmq_subscribe_sock, 0));
+        more = zmq_msg_more(&msg);
+        zmq_msg_close(&msg);
+    }
 }
 
-void smq_send_int32(int fd, int32_t val)
+static int smq_topic_wants_json(smq_topic_t* subscriber)
 {
-    uint8_t delim = 0x04;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    return (subscriber != NULL && subscriber->callback != NULL && !subscriber->binary);
 }
 
-void smq_send_uint8(int fd, uint8_t val)
+static void smq_message_begin(const uint8_t* data, size_t len, int encoding, const uint8_t* jdata, size_t jdata_len, json_object* jconv)
 {
-    uint8_t delim = 0x05;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    smq_message_t* message = &current_message;
+    message->data = data;
+    message->len = len;
+    message->encoding = encoding;
+    message->json = (encoding == SMQ_ENCODING_JSON || jconv != NULL) ? (const char*)jdata : NULL;
+    message->json_len = jdata_len;
+    message->jobj = jconv;
+    message->jobj_owned = 0;
+    message->indexed = 0;
+    message->valid = 0;
+    message->field_count = 0;
+    message_active = 1;
 }
 
-void smq_send_uint16(int fd, uint16_t val)
+static void smq_message_end()
 {
-    uint8_t delim = 0x06;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    if (current_message.jobj_owned)
+        json_object_put(current_message.jobj);
+    current_message.jobj = NULL;
+    current_message.jobj_owned = 0;
+    message_active = 0;
 }
 
-void smq_send_uint32(int fd, uint32_t val)
+static const char* smq_message_text(size_t* len)
 {
-    uint8_t delim = 0x07;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    smq_message_t* message = &current_message;
+    if (message->json == NULL)
+    {
+        message->jobj = smq_tlv_to_json(message->data, message->len);
+        message->jobj_owned = 1;
+        message->json = json_object_to_json_string(message->jobj);
+        message->json_len = strlen(message->json);
+    }
+    *len = message->json_len;
+    return message->json;
 }
 
-void smq_send_float(int fd, float val)
+struct json_object* smq_message_json()
 {
-    uint8_t delim = 0x08;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &val, sizeof(val));
+    smq_message_t* message = &current_message;
+    if (!message_active)
+        return NULL;
+    if (message->jobj == NULL)
+    {
+        size_t len;
+        const char* text = smq_message_text(&len);
+        if (message->jobj == NULL)
+        {
+            json_tokener* tok = json_tokener_new();
+            message->jobj = json_tokener_parse_ex(tok, text, len);
+            message->jobj_owned = 1;
+            json_tokener_free(tok);
+        }
+    }
+    return message->jobj;
 }
 
-void smq_send_boolean(int fd, char val)
+/* Fields of the message, scanned once and kept in a buffer reused across messages */
+static int smq_message_index()
 {
-    uint8_t delim = (val) ? 0x0A : 0x0B;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_message_t* message = &current_message;
+    if (!message_active)
+        return 0;
+    if (!message->indexed)
+    {
+        size_t len;
+        const char* text = smq_message_text(&len);
+        smq_json_t json;
+        smq_json_field_t field;
+        smq_json_init(&json, (const uint8_t*)text, len);
+        while (smq_json_next(&json, &field))
+        {
+            if (message->field_count == message->field_cap)
+            {
+                size_t cap = (message->field_cap != 0) ? message->field_cap * 2 : 16;
+                smq_json_field_t* fields = (smq_json_field_t*)realloc(message->fields, cap * sizeof(*fields));
+                if (fields == NULL)
+                    break;
+                message->fields = fields;
+                message->field_cap = cap;
+            }
+            message->fields[message->field_count++] = field;
+        }
+        message->valid = !smq_json_failed(&json) && json.done;
+        message->indexed = 1;
+    }
+    return message->valid;
 }
 
-void smq_send_null(int fd)
+int smq_message_fields(const smq_json_field_t** fields, size_t* count)
 {
-    uint8_t delim = 0x0C;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    if (!smq_message_index())
+        return 0;
+    *fields = current_message.fields;
+    *count = current_message.field_count;
+    return 1;
 }
 
-void smq_send_buffer(int fd, const void* buf, uint16_t len)
+const smq_json_field_t* smq_message_field(const char* key)
 {
-    uint8_t delim = 0x0D;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
-    smq_send_data(fd, &len, sizeof(len));
-    smq_send_data(fd, buf, len);
+    if (!smq_message_index())
+        return NULL;
+    for (size_t i = 0; i < current_message.field_count; i++)
+    {
+        if (smq_json_key_is(&current_message.fields[i], key))
+            return &current_message.fields[i];
+    }
+    return NULL;
 }
 
-void smq_end(int fd)
+static void smq_deliver(smq_topic_t* subscriber, int encoding, const uint8_t* data, size_t data_len, const uint8_t* jdata, size_t jdata_len)
 {
-    uint8_t delim = 0xFF;
-    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    const char* topic_name = subscriber->name;
+    if (*subscriber->altname != 0)
+        topic_name = subscriber->altname;
+    message_encoding = encoding;
+    message_topic_hash = (uint16_t)subscriber->hash;
+    if (subscriber->scallback != NULL)
+        subscriber->scallback(topic_name, data, data_len, subscriber->arg);
+    if (subscriber->callback != NULL && subscriber->binary)
+        subscriber->callback(topic_name, data, data_len, subscriber->arg);
+    message_encoding = SMQ_ENCODING_JSON;
+    if (subscriber->callback != NULL && !subscriber->binary)
+        subscriber->callback(topic_name, jdata, jdata_len, subscriber->arg);
 }
 
-// ------------------------------------------------------
-
-static int smsg_read(int fd, void* buf, size_t len)
+int smq_spin_once(long timeout)
 {
-    char* b = (char*)buf;
-    char* b_end = b + len;
-    while (b < b_end)
+    if (!init_called)
     {
-        int cnt = b_end - b;
-        int n = read(fd, b, cnt);
-        if (n < 0)
+        fprintf(stderr, "(smq_spin_once) smq_init must be called first\n");
+        return 0;
+    }
+    /* If there is a timer set */
+    long time_till_timer = -1;
+    if (0 != timer_callback)
+    {
+        /* Determine the time until the next firing */
+        time_till_timer = smq_time_till(&last_timer, timer_period);
+        /* If we have no time left, run the callback now */
+        if (time_till_timer <= 0)
         {
-            cnt = b - (char*)buf;
-            return (cnt) ? cnt : -1;
+            smq_get_time_now(&last_timer);
+            timer_callback(timer_arg);
+            return 1;
         }
-        b = b + n;
     }
-    int cnt = b - (char*)buf;
-#if 0
-    if (cnt > 0)
+    /* Poll for either the given timeout, or the time until the next timer, which ever is shorter */
+    long zmq_timeout = (-1 != time_till_timer && time_till_timer < timeout) ? time_till_timer : timeout;
+    /* Without an address watcher keep checking for an address periodically */
+    if (!network_ready && netlink_fd == -1)
     {
-        printf("<==%d:[0x", cnt);
-        for (int i = 0; i < cnt; i++)
+        long time_till_check = smq_time_till(&last_addr_check, SMQ_ADDR_RETRY_MS);
+        if (time_till_check <= 0)
         {
-            printf("%02X %c", ((uint8_t*)buf)[i], ((uint8_t*)buf)[i]);
+            smq_get_time_now(&last_addr_check);
+            smq_bind_network();
+            time_till_check = SMQ_ADDR_RETRY_MS;
         }
-        printf("]\n");
+        if (zmq_timeout < 0 || time_till_check < zmq_timeout)
+            zmq_timeout = time_till_check;
     }
-#endif
-    return cnt;
-}
-
-static int strcmp_hash(const char* topicNameHash, const char* topicName)
-{
-    char buf[32];
-    sprintf(buf, "$crc%04X", smq_string_hash(topicName));
-    return strcmp(topicNameHash, buf);
-}
-
-static const char* sDataType[] =
-{
-    "STRING",
-    "HASH",
-    "INT8",
-    "INT16",
-    "INT32",
-    "UINT8",
-    "UINT16",
-    "UINT32",
-    "FLOAT",
-    "BUFFER"
-};
-
-#if 0
-#define REPORT_TYPE(b) \
-{   if (b < sizeof(sDataType)/sizeof(sDataType[0])) printf("[%s]\n", sDataType[b]); }
-#else
-#define REPORT_TYPE(b)
-#endif
-#define REPORT_MEM_ERROR() \
-{   printf("ERROR : %d\n", __LINE__); \
-    exit(1); \
-    return -1; }
-#define REPORT_READ_ERROR() \
-{   printf("ERROR : %d\n", __LINE__); \
-    exit(1); \
-    return -1; }
-#define REPORT_BAD_CRC(crc, recrc) \
-{   printf("CRC BAD GOT 0x%04X EXPECTED 0x%04X @%d\n", crc, recrc, __LINE__); \
-    exit(1);\
-    return -1; }\
-
-static int smsg_callback_fd;
-static void smsg_callback(const char * topic_name, const uint8_t * msg, size_t len, void* arg);
-
-int smq_process_serial(int fd, uint8_t id)
-{
-    uint8_t buffer[8];
-    char* jkey = NULL;
-    char* topicName = NULL;
-    json_object* jobj = NULL;
-    //printf("============smq_process_serial\n");
-    buffer[0] = id;
-    char needACK = (id == 0xFF); 
-    for (;;)
+    /* Unacked serial frames are resent on a timer */
+    long time_till_resend = smq_serial_check_resend();
+    if (time_till_resend >= 0 && (zmq_timeout < 0 || time_till_resend < zmq_timeout))
+        zmq_timeout = time_till_resend;
+    int rc = zmq_poll(poll_items, poll_items_count, zmq_timeout);
+    if (rc < 0)
     {
-        if (id == 0xFF)
-            smsg_read(fd, buffer, 1);
-        id = 0xFF;
-        REPORT_TYPE(buffer[0]);
-	//printf("[0x%02X]\n", buffer[0]);
-        switch (buffer[0])
+        switch (errno)
         {
-            case 0x00:
-            {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                //printf("    CRC : 0x%04X\n", crc);
-                uint16_t len;
-                if (smsg_read(fd, &len, sizeof(len)) != sizeof(len))
-                    REPORT_READ_ERROR();
-                //printf("    LEN : %d\n", len);
-                uint16_t recrc = smq_calc_crc(&len, sizeof(len), 0);
-                if (crc == recrc)
-                {
-                    if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                        REPORT_READ_ERROR();
-
-                    //printf("    CRC : 0x%04X\n", crc);
-                    char* buffer = (char*)malloc(len+1);
-                    if (buffer == NULL)
-                        REPORT_MEM_ERROR();
-                    ssize_t readlen = smsg_read(fd, buffer, len);
-                    if (readlen != len)
-                    {
-                        printf("read : %d wanted : %d\n", (int)readlen, (int)len);
-                        REPORT_READ_ERROR();
-                    }
-                    buffer[len] = '\0';
-                    recrc = smq_calc_crc(buffer, len, 0);
-                    if (crc == recrc)
-                    {
-                        // printf("[STRING] %s\n", buffer);
-                        if (jobj == NULL)
-                        {
-                            topicName = buffer;
-                            jobj = json_object_new_object();
-                        }
-                        else if (jkey == NULL)
-                        {
-                            jkey = buffer;
-                        }
-                        else
-                        {
-                            json_object_object_add(jobj, jkey, json_object_new_string(buffer));
-                            free(buffer);
-                            free(jkey);
-                            jkey = NULL;
-                        }
-                    }
-                    else
-                    {
-                        free(buffer);
-                        REPORT_BAD_CRC(crc, recrc);
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
-            }
-            case 0x01:
-            {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                printf("[CRC_STRING] : 0x%04X\n", crc);
-                char buf[32];
-                sprintf(buf, "$crc%04X", crc);
-                if (strcmp_hash(buf, "subscribers") == 0)
-                {
-                    uint16_t count;
-                    if (smsg_read(fd, &count, sizeof(count)) != sizeof(count))
-                        REPORT_READ_ERROR();
-                    printf("count : %d\n", count);
-                    for (unsigned i = 0; i < count; i++)
-                    {
-                        uint16_t crcsub;
-                        if (smsg_read(fd, &crcsub, sizeof(crcsub)) != sizeof(crcsub))
-                            REPORT_READ_ERROR();
-                        sprintf(buf, "$crc%04X", crcsub);
-                        if (!smq_is_subscribed_serial(buf))
-                        {
-                            smsg_callback_fd = fd;
-                            if (!smq_subscribe_ser(buf, smsg_callback))
-                            {
-                                printf("FAILED TO SUBSCRIBE %s\n", buf);
-                            }
-                            else
-                            {
-                                printf("subscribe %s\n", buf);
-                            }
-                        }
-                    }
-                }
-                else if (jobj == NULL)
-                {
-                    topicName = strdup((const char*)buffer);
-                    jobj = json_object_new_object();
-                }
-                else if (jkey == NULL)
+            case EINTR:
+                return 1;
+            case EFAULT:
+                perror("Invalid poll items");
+                return 0;
+            case ETERM:
+                perror("Socket terminated");
+                return 0;
+            default:
+                perror("Unknown error in zmq_poll");
+                return 0;
+        }
+    }
+    smq_cache_expire();
+    /* Check for serial messages */
+    if (zmq_subscribe_serial &&
+        poll_items_count > SMQ_POLL_SERIAL && poll_items[SMQ_POLL_SERIAL].revents & ZMQ_POLLIN)
+    {
+        smq_process_serial(poll_items[SMQ_POLL_SERIAL].fd, 0xFF);
+    }
+
+    /* Timeout */
+    if (rc == 0)
+    {
+        /* TODO: check timer again */
+        return 1;
+    }
+
+    /* Check for address changes */
+    if (SMQ_POLL_NETLINK < poll_items_count && poll_items[SMQ_POLL_NETLINK].revents & ZMQ_POLLIN)
+    {
+        if (smq_netlink_changed())
+            smq_bind_network();
+    }
+    /* Check for subscription changes on the publisher */
+    if (SMQ_POLL_XPUB < poll_items_count && poll_items[SMQ_POLL_XPUB].revents & ZMQ_POLLIN)
+    {
+        handle_xpub_msgs();
+    }
+    /* Check for incoming broadcast messages */
+    if (SMQ_POLL_BCAST < poll_items_count && poll_items[SMQ_POLL_BCAST].revents & ZMQ_POLLIN)
+    {
+        uint8_t buffer[SMQ_UDP_MAX_SIZE];
+        socklen_t len_rcv_addr = sizeof(rcv_addr);
+        int ret = recvfrom(bcast_fd, buffer, SMQ_UDP_MAX_SIZE, 0, (struct sockaddr *) &rcv_addr, &len_rcv_addr);
+        if (ret <= 0 && discd_fd != -1)
+        {
+            return smq_discoveryd_lost();
+        }
+        if (ret < 0)
+        {
+            perror("Error in recvfrom on broadcast socket");
+            return 0;
+        }
+        return handle_bcast_msg(buffer, ret, &rcv_addr);
+    }
+    /* Check for directed ADV replies */
+    if (SMQ_POLL_UCAST < poll_items_count && poll_items[SMQ_POLL_UCAST].revents & ZMQ_POLLIN)
+    {
+        uint8_t buffer[SMQ_UDP_MAX_SIZE];
+        struct sockaddr_in src_addr;
+        socklen_t len_src_addr = sizeof(src_addr);
+        int ret = recvfrom(ucast_fd, buffer, SMQ_UDP_MAX_SIZE, 0, (struct sockaddr *) &src_addr, &len_src_addr);
+        if (ret < 0)
+        {
+            perror("Error in recvfrom on unicast socket");
+            return 0;
+        }
+        return handle_bcast_msg(buffer, ret, &src_addr);
+    }
+    /* Check for incoming ZMQ messages */
+    if (poll_items[SMQ_POLL_ZMQ].revents & ZMQ_POLLIN)
+    {
+        char topic[SMQ_MAX_TOPIC_LENGTH];
+        smq_msg_header_t header;
+        /* Get the topic msg */
+        zmq_msg_t topic_msg;
+        assert(0 == zmq_msg_init(&topic_msg));
+        assert(-1 != zmq_msg_recv(&topic_msg, zmq_subscribe_sock, 0));
+        memcpy(topic, zmq_msg_data(&topic_msg), zmq_msg_size(&topic_msg));
+        topic[zmq_msg_size(&topic_msg)] = 0;
+        assert(zmq_msg_more(&topic_msg));
+        zmq_msg_close(&topic_msg);
+        /* Get the header msg */
+        zmq_msg_t header_msg;
+        assert(0 == zmq_msg_init(&header_msg));
+        assert(-1 != zmq_msg_recv(&header_msg, zmq_subscribe_sock, 0));
+        smq_deserialize_msg_header(&header, (uint8_t *) zmq_msg_data(&header_msg), zmq_msg_size(&header_msg));
+        int more = zmq_msg_more(&header_msg);
+        zmq_msg_close(&header_msg);
+        // printf("header.type = %d\n", header.type);
+        if (header.type == SMQ_OP_PUB && (header.version & SMQ_VERSION_PLAIN_COPY))
+        {
+            /* Plain subscriptions also filter on the hash name, the aliased message already came */
+            smq_zmq_drain(more);
+        }
+        else if (header.type == SMQ_OP_PUB)
+        {
+            /* Find subscribers to the wire name and to its alias */
+            smq_topic_t* alias;
+            smq_topic_t* subscriber = smq_topic_subscribers(topic, &header, &alias);
+            if (!subscriber)
+            {
+                subscriber = alias;
+                alias = NULL;
+            }
+            if (!subscriber)
+            {
+                /* Another topic sharing a subscribed hash filter, or one just unsubscribed */
+                smq_zmq_drain(more);
+                return 1;
+            }
+            /* Receive final data msg */
+            assert(more);
+            zmq_msg_t data_msg;
+            assert(0 == zmq_msg_init(&data_msg));
+            assert(-1 != zmq_msg_recv(&data_msg, zmq_subscribe_sock, 0));
+            size_t data_len = zmq_msg_size(&data_msg);
+            uint8_t* data = (uint8_t *) zmq_msg_data(&data_msg);
+            if (header.flags[SMQ_FLAG_COMPRESSION] != SMQ_COMPRESSION_NONE)
+            {
+                uint32_t raw_len;
+                memcpy(&raw_len, header.flags + SMQ_FLAG_RAW_LENGTH, sizeof(raw_len));
+                data = smq_decompress(header.flags[SMQ_FLAG_COMPRESSION], data, data_len, raw_len);
+                if (data == NULL)
                 {
-                    jkey = strdup((const char*)buffer);
+                    fprintf(stderr, "Could not decompress message for topic '%s'\n", topic);
+                    zmq_msg_close(&data_msg);
+                    return 1;
                 }
-                else
+                data_len = raw_len;
+            }
+            const char* topic_name = topic;
+            if (*subscriber->altname != 0)
+                topic_name = subscriber->altname ;
+            int encoding = header.flags[SMQ_FLAG_ENCODING];
+            uint8_t delta = header.flags[SMQ_FLAG_DELTA];
+            if (encoding == SMQ_ENCODING_JSON && (delta == SMQ_DELTA_KEYFRAME || delta == SMQ_DELTA_UPDATE))
+            {
+                /* Deltas after a lost message are dropped until the next keyframe */
+                data = smq_delta_decode(subscriber, &header, data, &data_len);
+                if (data == NULL)
                 {
-                    json_object_object_add(jobj, jkey, json_object_new_string((const char*)buffer));
-                    free(jkey);
-                    jkey = NULL;
+                    zmq_msg_close(&data_msg);
+                    return 1;
                 }
-                break;
             }
-            case 0x02:
+            /* Binary payloads are converted to JSON once, and only if someone needs it */
+            json_object* jconv = NULL;
+            const uint8_t* jdata = data;
+            size_t jdata_len = data_len;
+            if (encoding == SMQ_ENCODING_TLV &&
+                (smq_topic_wants_json(subscriber) || smq_topic_wants_json(alias) || global_callback != NULL))
+            {
+                jconv = smq_tlv_to_json(data, data_len);
+                jdata = (const uint8_t*)json_object_to_json_string(jconv);
+                jdata_len = strlen((const char*)jdata);
+            }
+            /* Callbacks share one decode through smq_message_json and smq_message_field */
+            smq_message_begin(data, data_len, encoding, jdata, jdata_len, jconv);
+            smq_deliver(subscriber, encoding, data, data_len, jdata, jdata_len);
+            if (alias != NULL && alias != subscriber)
+                smq_deliver(alias, encoding, data, data_len, jdata, jdata_len);
+            if (global_callback != NULL)
+                global_callback(topic_name, jdata, jdata_len, global_callback_arg);
+            smq_message_end();
+            if (jconv != NULL)
+                json_object_put(jconv);
+            zmq_msg_close(&data_msg);
+        }
+        else
+        {
+            smq_zmq_drain(more);
+        }
+        return 1;
+    }
+    return 1;
+}
+
+int smq_wait()
+{
+    int ret = 0;
+    while (0 < (ret = smq_spin_once(-1))) {}
+    return ret;
+}
+
+int smq_wait_for(long millis)
+{
+    int ret = 0;
+    struct timespec now;
+    long time_till_timer = -1;
+    smq_get_time_now(&now);
+    for (;;)
+    {
+        time_till_timer = smq_time_till(&now, millis);
+        if (time_till_timer <= 0)
+            break;
+        ret = smq_spin_once(time_till_timer);
+        if (ret < 0)
+            break;
+    }
+    return ret;
+}
+
+int smq_wait_for_subscribers(const char* topic_name, int min_count, long timeout_ms)
+{
+    if (!init_called)
+    {
+        fprintf(stderr, "(smq_wait_for_subscribers) smq_init must be called first\n");
+        return 0;
+    }
+    struct timespec start;
+    smq_get_time_now(&start);
+    for (;;)
+    {
+        if (smq_count_subscribers(topic_name) >= min_count)
+            return 1;
+        long time_left = smq_time_till(&start, timeout_ms);
+        if (time_left <= 0)
+            break;
+        /* 0 is an unrelated message that was not handled, keep waiting */
+        if (0 > smq_spin_once(time_left))
+            break;
+    }
+    return 0;
+}
+
+int smq_wait_for_subscribers_hash(const char* topic_name, int min_count, long timeout_ms)
+{
+    char buf[32];
+    smq_hash_topic_name(buf, topic_name);
+    return smq_wait_for_subscribers(buf, min_count, timeout_ms);
+}
+
+// ----------------------------------------------
+
+static inline uint16_t update_crc(uint16_t crc, const uint8_t data)
+{
+    // crc-16 poly 0x8005 (x^16 + x^15 + x^2 + 1)
+    static const uint16_t crc16_table[256] =
+    {
+        0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241, 0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+        0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40, 0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+        0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40, 0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+        0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641, 0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+        0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240, 0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+        0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41, 0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+        0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41, 0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+        0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640, 0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+        0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240, 0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+        0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41, 0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+        0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41, 0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+        0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640, 0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+        0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241, 0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+        0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40, 0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+        0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40, 0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+        0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641, 0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+    };
+    return (crc >> 8) ^ crc16_table[(crc ^ data) & 0xFF];
+}
+
+// Slicing-by-8: crc16_slice[k][b] is the crc of byte b followed by k zero bytes,
+// so eight table lookups advance the crc by eight bytes at once
+static uint16_t crc16_slice[8][256];
+static char crc16_slice_ready;
+
+static void crc16_slice_init()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        crc16_slice[0][i] = update_crc(0, i);
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t crc = crc16_slice[k-1][i];
+            crc16_slice[k][i] = (crc >> 8) ^ crc16_slice[0][crc & 0xFF];
+        }
+    }
+    crc16_slice_ready = 1;
+}
+
+static uint16_t smq_calc_crc_slice8(const uint8_t* b, size_t len, uint16_t crc)
+{
+    while (len >= 8)
+    {
+        crc ^= b[0] | (b[1] << 8);
+        crc = crc16_slice[7][crc & 0xFF] ^ crc16_slice[6][crc >> 8] ^
+              crc16_slice[5][b[2]] ^ crc16_slice[4][b[3]] ^
+              crc16_slice[3][b[4]] ^ crc16_slice[2][b[5]] ^
+              crc16_slice[1][b[6]] ^ crc16_slice[0][b[7]];
+        b += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc = update_crc(crc, *b++);
+    }
+    return crc;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SMQ_CRC_CLMUL 1
+#include <immintrin.h>
+
+// Carry-less multiply folding (Intel, "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ"). The reflected crc-16 is run as a 32 bit crc over
+// x^16 * (x^16 + x^15 + x^2 + 1), which leaves the crc-16 in the low half.
+// Constants are bit reflected and shifted left by one.
+static const uint64_t crc16_clmul_k1k2[2] = { 0x1b0c2, 0x0bffa };        /* x^(4*128+32), x^(4*128-32) mod P */
+static const uint64_t crc16_clmul_k3k4[2] = { 0x1d0c2, 0x18cc2 };        /* x^(128+32), x^(128-32) mod P */
+static const uint64_t crc16_clmul_k5k0[2] = { 0x1bc02, 0x00000 };        /* x^64 mod P */
+static const uint64_t crc16_clmul_poly[2] = { 0x14003, 0x1cfffbfff };    /* P', mu' = x^64 / P */
+
+/* len must be a multiple of 16 and at least 64 */
+__attribute__((target("pclmul,sse4.1")))
+static uint16_t smq_calc_crc_clmul(const uint8_t* b, size_t len, uint16_t crc)
+{
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_loadu_si128((const __m128i*)(b + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(b + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(b + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(b + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_loadu_si128((const __m128i*)crc16_clmul_k1k2);
+    b += 64;
+    len -= 64;
+
+    // Fold four lanes in parallel
+    while (len >= 64)
+    {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(b + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(b + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(b + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(b + 0x30)));
+        b += 64;
+        len -= 64;
+    }
+
+    // Fold the lanes into one
+    x0 = _mm_loadu_si128((const __m128i*)crc16_clmul_k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16)
+    {
+        x2 = _mm_loadu_si128((const __m128i*)b);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        b += 16;
+        len -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)crc16_clmul_k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_loadu_si128((const __m128i*)crc16_clmul_poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint16_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+// Folding only pays off once the setup is amortized, short items use the tables
+#define SMQ_CRC_CLMUL_MIN 64
+
+static int crc16_use_clmul = -1;
+
+uint16_t smq_calc_crc(const void* buf, size_t len, uint16_t crc)
+{
+    const uint8_t* b = (uint8_t*)buf;
+    if (len < 8)
+    {
+        while (len-- > 0)
+        {
+            crc = update_crc(crc, *b++);
+        }
+        return crc;
+    }
+    if (!crc16_slice_ready)
+    {
+        crc16_slice_init();
+    }
+#ifdef SMQ_CRC_CLMUL
+    if (crc16_use_clmul < 0)
+    {
+        __builtin_cpu_init();
+        crc16_use_clmul = (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1") &&
+                           getenv("SMQ_CRC_NOSIMD") == NULL);
+    }
+    if (crc16_use_clmul && len >= SMQ_CRC_CLMUL_MIN)
+    {
+        size_t fold_len = len & ~(size_t)15;
+        crc = smq_calc_crc_clmul(b, fold_len, crc);
+        b += fold_len;
+        len -= fold_len;
+    }
+#endif
+    return smq_calc_crc_slice8(b, len, crc);
+}
+
+uint16_t smq_string_hash(const char* str)
+{
+    return ~smq_calc_crc(str, strlen(str), ~0);
+}
+
+// ------------------------------------------------------
+// Typed TLV items, shared by the serial link and SMQ_ENCODING_TLV payloads
+
+typedef struct
+{
+    uint8_t* data;
+    size_t len;
+    size_t size;
+} smq_buffer_t;
+
+static int smq_buffer_reserve(smq_buffer_t* buf, size_t len)
+{
+    if (len > buf->size)
+    {
+        size_t size = (buf->size != 0) ? buf->size : 256;
+        while (size < len)
+            size *= 2;
+        uint8_t* newdata = (uint8_t*)realloc(buf->data, size);
+        if (newdata == NULL)
+        {
+            fprintf(stderr, "Error allocating buffer\n");
+            return 0;
+        }
+        buf->data = newdata;
+        buf->size = size;
+    }
+    return 1;
+}
+
+static int smq_buffer_append(smq_buffer_t* buf, const void* data, size_t len)
+{
+    if (!smq_buffer_reserve(buf, buf->len + len))
+        return 0;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 1;
+}
+
+// ------------------------------------------------------
+// Payload compression, per topic on the publisher and transparent to subscribers
+
+static smq_buffer_t compress_buf;
+static smq_buffer_t decompress_buf;
+#ifdef SMQ_WITH_ZSTD
+static ZSTD_DCtx* zstd_dctx;
+#endif
+
+/* Codecs are optional, see SMQ_WITH_LZ4 and SMQ_WITH_ZSTD in the Makefile */
+static int smq_compression_available(int compression)
+{
+#ifdef SMQ_WITH_LZ4
+    if (compression == SMQ_COMPRESSION_LZ4)
+        return 1;
+#endif
+#ifdef SMQ_WITH_ZSTD
+    if (compression == SMQ_COMPRESSION_ZSTD)
+        return 1;
+#endif
+    return (compression == SMQ_COMPRESSION_NONE);
+}
+
+static void smq_compress_free(smq_topic_t* topic)
+{
+    if (topic->compress_ctx == NULL)
+        return;
+#ifdef SMQ_WITH_ZSTD
+    if (topic->compression == SMQ_COMPRESSION_ZSTD)
+        ZSTD_freeCCtx((ZSTD_CCtx*)topic->compress_ctx);
+    else
+#endif
+        free(topic->compress_ctx);
+    topic->compress_ctx = NULL;
+}
+
+/* Compressed length, 0 to send the message as it is */
+static size_t smq_compress(smq_topic_t* topic, const uint8_t* msg, size_t len, const uint8_t** packed)
+{
+    size_t packed_len = 0;
+    if (topic->compression == SMQ_COMPRESSION_NONE || len < compress_min_size || len > SMQ_MAX_RAW_LENGTH)
+        return 0;
+    if (topic->compress_backoff > 0)
+    {
+        topic->compress_backoff--;
+        return 0;
+    }
+#ifdef SMQ_WITH_LZ4
+    if (topic->compression == SMQ_COMPRESSION_LZ4)
+    {
+        int bound = LZ4_compressBound(len);
+        if (topic->compress_ctx == NULL)
+            topic->compress_ctx = malloc(LZ4_sizeofState());
+        if (topic->compress_ctx == NULL || !smq_buffer_reserve(&compress_buf, bound))
+            return 0;
+        int n = LZ4_compress_fast_extState(topic->compress_ctx, (const char*)msg, (char*)compress_buf.data, len, bound, 1);
+        packed_len = (n > 0) ? n : 0;
+    }
+#endif
+#ifdef SMQ_WITH_ZSTD
+    if (topic->compression == SMQ_COMPRESSION_ZSTD)
+    {
+        size_t bound = ZSTD_compressBound(len);
+        if (topic->compress_ctx == NULL)
+            topic->compress_ctx = ZSTD_createCCtx();
+        if (topic->compress_ctx == NULL || !smq_buffer_reserve(&compress_buf, bound))
+            return 0;
+        size_t n = ZSTD_compressCCtx((ZSTD_CCtx*)topic->compress_ctx, compress_buf.data, bound, msg, len, ZSTD_CLEVEL_DEFAULT);
+        packed_len = ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    /* Worth the subscribers' time only if it saves an eighth */
+    if (packed_len == 0 || packed_len > len - len / 8)
+    {
+        topic->compress_backoff = SMQ_COMPRESS_BACKOFF;
+        return 0;
+    }
+    *packed = compress_buf.data;
+    return packed_len;
+}
+
+/* raw_len bytes of payload, valid until the next message */
+static uint8_t* smq_decompress(int compression, const uint8_t* data, size_t len, uint32_t raw_len)
+{
+    if (raw_len == 0 || raw_len > SMQ_MAX_RAW_LENGTH || !smq_buffer_reserve(&decompress_buf, raw_len))
+        return NULL;
+#ifdef SMQ_WITH_LZ4
+    if (compression == SMQ_COMPRESSION_LZ4)
+    {
+        int n = LZ4_decompress_safe((const char*)data, (char*)decompress_buf.data, len, raw_len);
+        return (n == (int)raw_len) ? decompress_buf.data : NULL;
+    }
+#endif
+#ifdef SMQ_WITH_ZSTD
+    if (compression == SMQ_COMPRESSION_ZSTD)
+    {
+        if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+            return NULL;
+        size_t n = ZSTD_decompressDCtx(zstd_dctx, decompress_buf.data, raw_len, data, len);
+        return (!ZSTD_isError(n) && n == raw_len) ? decompress_buf.data : NULL;
+    }
+#endif
+    return NULL;
+}
+
+static void smq_compression_shutdown()
+{
+    free(compress_buf.data);
+    free(decompress_buf.data);
+    memset(&compress_buf, 0, sizeof(compress_buf));
+    memset(&decompress_buf, 0, sizeof(decompress_buf));
+#ifdef SMQ_WITH_ZSTD
+    ZSTD_freeDCtx(zstd_dctx);
+    zstd_dctx = NULL;
+#endif
+}
+
+// ------------------------------------------------------
+// Delta encoding of JSON state topics: keyframes carry the whole message, the messages in
+// between only the fields that changed. Subscribers rebuild the whole message per publisher.
+
+typedef struct
+{
+    smq_buffer_t key;           /* raw text without the quotes */
+    smq_buffer_t value;         /* raw JSON text, strings keep their quotes */
+} smq_delta_field_t;
+
+typedef struct smq_delta_t
+{
+    /* Publisher of the stream on subscribed topics */
+    uuid_t guid;
+    uint16_t seq;
+    char valid;
+    smq_delta_field_t* fields;
+    size_t count;
+    size_t cap;
+    /* Published topics only, see smq_set_delta */
+    unsigned keyframe_interval;
+    unsigned since_keyframe;
+    uint64_t keyframe_time;
+    char keyframe_pending;
+    struct smq_delta_t* next;
+} smq_delta_t;
+
+static smq_json_field_t* delta_scratch;
+static size_t delta_scratch_cap;
+/* Separate so a callback may publish while a rebuilt message is being delivered */
+static smq_buffer_t delta_encode_buf;
+static smq_buffer_t delta_decode_buf;
+
+static void smq_delta_free(smq_topic_t* topic)
+{
+    while (topic->delta != NULL)
+    {
+        smq_delta_t* delta = topic->delta;
+        topic->delta = delta->next;
+        for (size_t i = 0; i < delta->cap; i++)
+        {
+            free(delta->fields[i].key.data);
+            free(delta->fields[i].value.data);
+        }
+        free(delta->fields);
+        free(delta);
+    }
+}
+
+/* Fields of a JSON object message into delta_scratch */
+static int smq_delta_parse(const uint8_t* msg, size_t len, size_t* count)
+{
+    smq_json_t json;
+    smq_json_init(&json, msg, len);
+    *count = 0;
+    for (;;)
+    {
+        if (*count == delta_scratch_cap)
+        {
+            size_t cap = (delta_scratch_cap != 0) ? delta_scratch_cap * 2 : 16;
+            smq_json_field_t* scratch = (smq_json_field_t*)realloc(delta_scratch, cap * sizeof(smq_json_field_t));
+            if (scratch == NULL)
+            {
+                fprintf(stderr, "Error allocating delta fields\n");
+                return 0;
+            }
+            delta_scratch = scratch;
+            delta_scratch_cap = cap;
+        }
+        if (!smq_json_next(&json, &delta_scratch[*count]))
+            break;
+        (*count)++;
+    }
+    return !smq_json_failed(&json);
+}
+
+static int smq_delta_key_is(const smq_delta_field_t* field, const smq_json_field_t* json_field)
+{
+    return (field->key.len == json_field->key_len && 0 == memcmp(field->key.data, json_field->key, json_field->key_len));
+}
+
+/* Raw text of a value, strings with their quotes */
+static const char* smq_delta_value_text(const smq_json_field_t* json_field, size_t* len)
+{
+    if (json_field->type == SMQ_JSON_STRING)
+    {
+        *len = json_field->value_len + 2;
+        return json_field->value - 1;
+    }
+    *len = json_field->value_len;
+    return json_field->value;
+}
+
+static int smq_delta_value_is(const smq_delta_field_t* field, const smq_json_field_t* json_field)
+{
+    size_t len;
+    const char* text = smq_delta_value_text(json_field, &len);
+    return (field->value.len == len && 0 == memcmp(field->value.data, text, len));
+}
+
+static int smq_delta_set_value(smq_delta_field_t* field, const smq_json_field_t* json_field)
+{
+    size_t len;
+    const char* text = smq_delta_value_text(json_field, &len);
+    field->value.len = 0;
+    return smq_buffer_append(&field->value, text, len);
+}
+
+/* Replace the fields of a stream with those of a whole message */
+static int smq_delta_store(smq_delta_t* delta, const smq_json_field_t* json_fields, size_t count)
+{
+    delta->count = 0;
+    if (count > delta->cap)
+    {
+        smq_delta_field_t* fields = (smq_delta_field_t*)realloc(delta->fields, count * sizeof(smq_delta_field_t));
+        if (fields == NULL)
+        {
+            fprintf(stderr, "Error allocating delta fields\n");
+            return 0;
+        }
+        memset(fields + delta->cap, 0, (count - delta->cap) * sizeof(smq_delta_field_t));
+        delta->fields = fields;
+        delta->cap = count;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        smq_delta_field_t* field = &delta->fields[i];
+        field->key.len = 0;
+        if (!smq_buffer_append(&field->key, json_fields[i].key, json_fields[i].key_len) ||
+            !smq_delta_set_value(field, &json_fields[i]))
+            return 0;
+    }
+    delta->count = count;
+    return 1;
+}
+
+/* Append "key":value to a JSON object being built */
+static int smq_delta_append_field(smq_buffer_t* buf, const smq_delta_field_t* field)
+{
+    if (buf->len > 1 && !smq_buffer_append(buf, ",", 1))
+        return 0;
+    return (smq_buffer_append(buf, "\"", 1) &&
+            smq_buffer_append(buf, field->key.data, field->key.len) &&
+            smq_buffer_append(buf, "\":", 2) &&
+            smq_buffer_append(buf, field->value.data, field->value.len));
+}
+
+/* Payload to send for a message of a delta topic, sets the delta flags of the header */
+static const uint8_t* smq_delta_encode(smq_topic_t* topic, smq_msg_header_t* header, const uint8_t* msg, size_t* len)
+{
+    smq_delta_t* delta = topic->delta;
+    size_t count;
+    if (!smq_delta_parse(msg, *len, &count))
+    {
+        /* Not an object, sent as it is and the next message starts over */
+        delta->keyframe_pending = 1;
+        return msg;
+    }
+    uint64_t now = smq_current_time();
+    int keyframe = (delta->keyframe_pending || count != delta->count ||
+                    delta->since_keyframe + 1 >= delta->keyframe_interval ||
+                    now - delta->keyframe_time >= SMQ_DELTA_KEYFRAME_MS);
+    for (size_t i = 0; i < count && !keyframe; i++)
+        keyframe = !smq_delta_key_is(&delta->fields[i], &delta_scratch[i]);
+    const uint8_t* payload = msg;
+    if (!keyframe)
+    {
+        /* Same keys in the same order, send the values that changed */
+        delta_encode_buf.len = 0;
+        int ok = smq_buffer_append(&delta_encode_buf, "{", 1);
+        for (size_t i = 0; i < count && ok; i++)
+        {
+            smq_delta_field_t* field = &delta->fields[i];
+            if (!smq_delta_value_is(field, &delta_scratch[i]))
+                ok = smq_delta_set_value(field, &delta_scratch[i]) && smq_delta_append_field(&delta_encode_buf, field);
+        }
+        ok = ok && smq_buffer_append(&delta_encode_buf, "}", 1);
+        if (!ok)
+        {
+            delta->keyframe_pending = 1;
+            return msg;
+        }
+        /* Mostly changed messages are cheaper as keyframes */
+        if (delta_encode_buf.len < *len)
+        {
+            payload = delta_encode_buf.data;
+            *len = delta_encode_buf.len;
+            delta->since_keyframe++;
+        }
+        else
+        {
+            keyframe = 1;
+        }
+    }
+    if (keyframe)
+    {
+        if (!smq_delta_store(delta, delta_scratch, count))
+        {
+            delta->keyframe_pending = 1;
+            return msg;
+        }
+        delta->since_keyframe = 0;
+        delta->keyframe_time = now;
+        delta->keyframe_pending = 0;
+    }
+    delta->seq++;
+    header->flags[SMQ_FLAG_DELTA] = keyframe ? SMQ_DELTA_KEYFRAME : SMQ_DELTA_UPDATE;
+    memcpy(header->flags + SMQ_FLAG_DELTA_SEQ, &delta->seq, sizeof(delta->seq));
+    return payload;
+}
+
+/* Whole message of a delta topic payload, NULL until the next keyframe if it cannot be rebuilt */
+static uint8_t* smq_delta_decode(smq_topic_t* topic, const smq_msg_header_t* header, uint8_t* data, size_t* len)
+{
+    uint16_t seq;
+    memcpy(&seq, header->flags + SMQ_FLAG_DELTA_SEQ, sizeof(seq));
+    smq_delta_t* stream = topic->delta;
+    while (stream != NULL && 0 != memcmp(stream->guid, header->guid, GUID_LEN))
+    {
+        stream = stream->next;
+    }
+    if (stream == NULL)
+    {
+        stream = (smq_delta_t*)calloc(1, sizeof(smq_delta_t));
+        if (stream == NULL)
+        {
+            fprintf(stderr, "Error allocating delta state\n");
+            return NULL;
+        }
+        memcpy(stream->guid, header->guid, GUID_LEN);
+        stream->next = topic->delta;
+        topic->delta = stream;
+    }
+    size_t count;
+    if (header->flags[SMQ_FLAG_DELTA] == SMQ_DELTA_KEYFRAME)
+    {
+        stream->valid = (smq_delta_parse(data, *len, &count) && smq_delta_store(stream, delta_scratch, count));
+        stream->seq = seq;
+        return data;
+    }
+    /* A missed message leaves the stream unusable until the next keyframe */
+    if (!stream->valid || seq != (uint16_t)(stream->seq + 1) || !smq_delta_parse(data, *len, &count))
+    {
+        stream->valid = 0;
+        return NULL;
+    }
+    stream->seq = seq;
+    size_t next = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        /* Changed fields come in message order */
+        size_t j = next;
+        while (j < stream->count && !smq_delta_key_is(&stream->fields[j], &delta_scratch[i]))
+            j++;
+        if (j == stream->count || !smq_delta_set_value(&stream->fields[j], &delta_scratch[i]))
+        {
+            stream->valid = 0;
+            return NULL;
+        }
+        next = j + 1;
+    }
+    delta_decode_buf.len = 0;
+    int ok = smq_buffer_append(&delta_decode_buf, "{", 1);
+    for (size_t i = 0; i < stream->count && ok; i++)
+        ok = smq_delta_append_field(&delta_decode_buf, &stream->fields[i]);
+    /* Terminated for callbacks that treat the message as a string */
+    if (!ok || !smq_buffer_append(&delta_decode_buf, "}", 2))
+    {
+        stream->valid = 0;
+        return NULL;
+    }
+    *len = delta_decode_buf.len - 1;
+    return delta_decode_buf.data;
+}
+
+/* Published delta topics matching a new subscription send a keyframe next */
+static void smq_delta_resync(const char* filter)
+{
+    size_t filter_len = strlen(filter);
+    for (smq_topic_t* topic = published_topics.first; topic != NULL; topic = topic->next)
+    {
+        if (topic->delta == NULL || 0 != strncmp(topic->name, filter, filter_len))
+            continue;
+        topic->delta->keyframe_pending = 1;
+        /* The plain form of a topic is sent under its hash name */
+        if (topic->hashed)
+        {
+            smq_topic_t* plain = smq_topic_plain(&published_topics, topic->hash, NULL);
+            if (plain != NULL && plain->delta != NULL)
+                plain->delta->keyframe_pending = 1;
+        }
+    }
+}
+
+int smq_set_delta(const char* topic_name, unsigned keyframe_interval)
+{
+    /* Both forms of an advertised topic, either may be the one published */
+    smq_topic_t* topics[2];
+    topics[0] = smq_topic_in_list(&published_topics, topic_name);
+    topics[1] = smq_topic_hashed(&published_topics, smq_topic_hash(topic_name), smq_topic_hash_size(topic_name));
+    if (topics[0] == NULL && topics[1] == NULL)
+    {
+        fprintf(stderr, "Cannot delta encode topic '%s' which is unadvertised\n", topic_name);
+        return 0;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        smq_topic_t* topic = topics[i];
+        if (topic == NULL)
+            continue;
+        if (keyframe_interval == 0)
+        {
+            smq_delta_free(topic);
+            continue;
+        }
+        if (topic->delta == NULL)
+        {
+            topic->delta = (smq_delta_t*)calloc(1, sizeof(smq_delta_t));
+            if (topic->delta == NULL)
+            {
+                fprintf(stderr, "Error allocating delta state\n");
+                return 0;
+            }
+            topic->delta->keyframe_pending = 1;
+        }
+        topic->delta->keyframe_interval = keyframe_interval;
+    }
+    return 1;
+}
+
+static void smq_delta_shutdown()
+{
+    free(delta_scratch);
+    delta_scratch = NULL;
+    delta_scratch_cap = 0;
+    free(delta_encode_buf.data);
+    free(delta_decode_buf.data);
+    memset(&delta_encode_buf, 0, sizeof(delta_encode_buf));
+    memset(&delta_decode_buf, 0, sizeof(delta_decode_buf));
+}
+
+static const uint8_t sValueSize[] =
+{
+    0, 0, 1, 2, 4, 1, 2, 4, 4, 8
+};
+
+/* Size of the complete item at p, 0 if it is truncated or unknown */
+static size_t smq_tlv_item_size(const uint8_t* p, size_t avail)
+{
+    size_t need;
+    if (avail == 0)
+        return 0;
+    switch (p[0])
+    {
+        case 0x00:
+        case 0x0D:
+        {
+            uint16_t len;
+            if (avail < 5)
+                return 0;
+            memcpy(&len, p + 3, sizeof(len));
+            need = 7 + len;
+            break;
+        }
+        case 0x01:
+            need = 3;
+            break;
+        case 0x02:
+        case 0x03:
+        case 0x04:
+        case 0x05:
+        case 0x06:
+        case 0x07:
+        case 0x08:
+        case 0x09:
+            need = 3 + sValueSize[p[0]];
+            break;
+        case 0x0A:
+        case 0x0B:
+        case 0x0C:
+            need = 1;
+            break;
+        default:
+            return 0;
+    }
+    return (need <= avail) ? need : 0;
+}
+
+static void smq_tlv_append_data(smq_buffer_t* buf, uint8_t type, const void* data, uint16_t len)
+{
+    uint16_t crc;
+    smq_buffer_append(buf, &type, sizeof(type));
+    crc = smq_calc_crc(&len, sizeof(len), 0);
+    smq_buffer_append(buf, &crc, sizeof(crc));
+    smq_buffer_append(buf, &len, sizeof(len));
+    crc = smq_calc_crc(data, len, 0);
+    smq_buffer_append(buf, &crc, sizeof(crc));
+    smq_buffer_append(buf, data, len);
+}
+
+/* Next key/value pair of a TLV payload, returns 0 at the end */
+static int smq_tlv_next_pair(const uint8_t* data, size_t len, size_t* pos, const uint8_t** key, const uint8_t** val, size_t* val_len)
+{
+    size_t key_len = smq_tlv_item_size(data + *pos, len - *pos);
+    if (key_len == 0 || (data[*pos] != 0x00 && data[*pos] != 0x01))
+        return 0;
+    *val_len = smq_tlv_item_size(data + *pos + key_len, len - *pos - key_len);
+    if (*val_len == 0)
+        return 0;
+    *key = data + *pos;
+    *val = data + *pos + key_len;
+    *pos += key_len + *val_len;
+    return 1;
+}
+
+static int smq_tlv_key_is(const uint8_t* key, const char* name)
+{
+    if (key[0] == 0x01)
+    {
+        uint16_t crc;
+        memcpy(&crc, key + 1, sizeof(crc));
+        return (crc == smq_string_hash(name));
+    }
+    uint16_t len;
+    memcpy(&len, key + 3, sizeof(len));
+    return (len == strlen(name) && memcmp(key + 7, name, len) == 0);
+}
+
+/* Copy of a string item, or the $crcXXXX name of a hash item */
+static char* smq_tlv_strdup(const uint8_t* key)
+{
+    if (key[0] == 0x01)
+    {
+        char buf[32];
+        uint16_t crc;
+        memcpy(&crc, key + 1, sizeof(crc));
+        sprintf(buf, "$crc%04X", crc);
+        return strdup(buf);
+    }
+    uint16_t len;
+    memcpy(&len, key + 3, sizeof(len));
+    return strndup((const char*)key + 7, len);
+}
+
+static json_object* smq_tlv_json_value(const uint8_t* p)
+{
+    size_t size = (p[0] < sizeof(sValueSize)) ? sValueSize[p[0]] : 0;
+    switch (p[0])
+    {
+        case 0x00:
+        {
+            uint16_t len;
+            memcpy(&len, p + 3, sizeof(len));
+            return json_object_new_string_len((const char*)p + 7, len);
+        }
+        case 0x01:
+        {
+            char buf[32];
+            uint16_t crc;
+            memcpy(&crc, p + 1, sizeof(crc));
+            sprintf(buf, "$crc%04X", crc);
+            return json_object_new_string(buf);
+        }
+        case 0x02: { int8_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x03: { int16_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x04: { int32_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x05: { uint8_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x06: { uint16_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x07: { uint32_t v; memcpy(&v, p + 3, size); return json_object_new_int(v); }
+        case 0x08: { float v; memcpy(&v, p + 3, size); return json_object_new_double(v); }
+        case 0x09: { double v; memcpy(&v, p + 3, size); return json_object_new_double(v); }
+        case 0x0A:
+            return json_object_new_boolean(1);
+        case 0x0B:
+            return json_object_new_boolean(0);
+        case 0x0D:
+        {
+            uint16_t len;
+            memcpy(&len, p + 3, sizeof(len));
+            json_object* jarr = json_object_new_array();
+            for (unsigned i = 0; i < len; i++)
+            {
+                json_object_array_add(jarr, json_object_new_int(p[7 + i]));
+            }
+            return jarr;
+        }
+    }
+    return NULL;
+}
+
+static json_object* smq_tlv_to_json(const uint8_t* data, size_t len)
+{
+    json_object* jobj = json_object_new_object();
+    const uint8_t* key;
+    const uint8_t* val;
+    size_t val_len;
+    size_t pos = 0;
+    while (smq_tlv_next_pair(data, len, &pos, &key, &val, &val_len))
+    {
+        char* name = smq_tlv_strdup(key);
+        json_object_object_add(jobj, name, smq_tlv_json_value(val));
+        free(name);
+    }
+    return jobj;
+}
+
+// ------------------------------------------------------
+
+void smsg_init(smsg_t* smsg, const uint8_t* msg, size_t len)
+{
+    smsg->msg = msg;
+    smsg->msgend = msg + len;
+    smsg->len = len;
+}
+
+void smsg_failed(smsg_t* smsg)
+{
+    longjmp(smsg->jmp, 1);
+}
+
+void smsg_complete(smsg_t* smsg)
+{
+    if (smsg->msg != smsg->msgend)
+        smsg_failed(smsg);
+}
+
+int smsg_peek_type(smsg_t* smsg)
+{
+    return (smsg->msg < smsg->msgend) ? smsg->msg[0] : -1;
+}
+
+static const uint8_t* smsg_item(smsg_t* smsg)
+{
+    size_t need = smq_tlv_item_size(smsg->msg, smsg->msgend - smsg->msg);
+    if (need == 0)
+        smsg_failed(smsg);
+    const uint8_t* p = smsg->msg;
+    smsg->msg += need;
+    return p;
+}
+
+void smsg_skip(smsg_t* smsg)
+{
+    smsg_item(smsg);
+}
+
+/* Any integer item, as long as the value fits the requested range */
+static int64_t smsg_read_integer(smsg_t* smsg, int64_t min, int64_t max)
+{
+    const uint8_t* p = smsg_item(smsg);
+    int64_t val = 0;
+    switch (p[0])
+    {
+        case 0x02: { int8_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        case 0x03: { int16_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        case 0x04: { int32_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        case 0x05: { uint8_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        case 0x06: { uint16_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        case 0x07: { uint32_t v; memcpy(&v, p + 3, sizeof(v)); val = v; break; }
+        default:
+            smsg_failed(smsg);
+    }
+    if (val < min || val > max)
+        smsg_failed(smsg);
+    return val;
+}
+
+int8_t smsg_read_int8(smsg_t* smsg)
+{
+    return (int8_t)smsg_read_integer(smsg, -128, 127);
+}
+
+int16_t smsg_read_int16(smsg_t* smsg)
+{
+    return (int16_t)smsg_read_integer(smsg, -32768, 32767);
+}
+
+int32_t smsg_read_int32(smsg_t* smsg)
+{
+    return (int32_t)smsg_read_integer(smsg, -2147483647 - 1, 2147483647);
+}
+
+uint8_t smsg_read_uint8(smsg_t* smsg)
+{
+    return (uint8_t)smsg_read_integer(smsg, 0, 0xFF);
+}
+
+uint16_t smsg_read_uint16(smsg_t* smsg)
+{
+    return (uint16_t)smsg_read_integer(smsg, 0, 0xFFFF);
+}
+
+uint32_t smsg_read_uint32(smsg_t* smsg)
+{
+    return (uint32_t)smsg_read_integer(smsg, 0, 0xFFFFFFFF);
+}
+
+double smsg_read_double(smsg_t* smsg)
+{
+    int type = smsg_peek_type(smsg);
+    if (type == 0x08)
+    {
+        float v;
+        memcpy(&v, smsg_item(smsg) + 3, sizeof(v));
+        return v;
+    }
+    if (type == 0x09)
+    {
+        double v;
+        memcpy(&v, smsg_item(smsg) + 3, sizeof(v));
+        return v;
+    }
+    return (double)smsg_read_integer(smsg, -2147483647 - 1, 0xFFFFFFFF);
+}
+
+float smsg_read_float(smsg_t* smsg)
+{
+    return (float)smsg_read_double(smsg);
+}
+
+char smsg_read_boolean(smsg_t* smsg)
+{
+    const uint8_t* p = smsg_item(smsg);
+    if (p[0] != 0x0A && p[0] != 0x0B)
+        smsg_failed(smsg);
+    return (p[0] == 0x0A);
+}
+
+const char* smsg_read_string(smsg_t* smsg, size_t* len)
+{
+    const uint8_t* p = smsg_item(smsg);
+    uint16_t slen;
+    if (p[0] != 0x00)
+        smsg_failed(smsg);
+    memcpy(&slen, p + 3, sizeof(slen));
+    if (len != NULL)
+        *len = slen;
+    return (const char*)p + 7;
+}
+
+const uint8_t* smsg_read_buffer(smsg_t* smsg, size_t* len)
+{
+    const uint8_t* p = smsg_item(smsg);
+    uint16_t blen;
+    if (p[0] != 0x0D)
+        smsg_failed(smsg);
+    memcpy(&blen, p + 3, sizeof(blen));
+    if (len != NULL)
+        *len = blen;
+    return p + 7;
+}
+
+/* Hash of a key, whether it was sent hashed or as a string */
+uint16_t smsg_read_hash(smsg_t* smsg)
+{
+    const uint8_t* p = smsg_item(smsg);
+    uint16_t crc;
+    if (p[0] == 0x01)
+    {
+        memcpy(&crc, p + 1, sizeof(crc));
+        return crc;
+    }
+    if (p[0] != 0x00)
+        smsg_failed(smsg);
+    uint16_t len;
+    memcpy(&len, p + 3, sizeof(len));
+    return ~smq_calc_crc(p + 7, len, ~0);
+}
+
+void smsg_writer_init(smsg_writer_t* writer, uint8_t* buf, size_t size)
+{
+    writer->buf = buf;
+    writer->pos = buf;
+    writer->bufend = buf + size;
+}
+
+size_t smsg_writer_len(smsg_writer_t* writer)
+{
+    return writer->pos - writer->buf;
+}
+
+static uint8_t* smsg_reserve(smsg_writer_t* writer, size_t len)
+{
+    if ((size_t)(writer->bufend - writer->pos) < len)
+        longjmp(writer->jmp, 1);
+    uint8_t* p = writer->pos;
+    writer->pos += len;
+    return p;
+}
+
+static void smsg_write_value(smsg_writer_t* writer, uint8_t type, const void* val, size_t size)
+{
+    uint8_t* p = smsg_reserve(writer, 3 + size);
+    uint16_t crc = smq_calc_crc(val, size, 0);
+    p[0] = type;
+    memcpy(p + 1, &crc, sizeof(crc));
+    memcpy(p + 3, val, size);
+}
+
+static void smsg_write_data(smsg_writer_t* writer, uint8_t type, const void* data, uint16_t len)
+{
+    uint8_t* p = smsg_reserve(writer, 7 + (size_t)len);
+    uint16_t crc;
+    p[0] = type;
+    crc = smq_calc_crc(&len, sizeof(len), 0);
+    memcpy(p + 1, &crc, sizeof(crc));
+    memcpy(p + 3, &len, sizeof(len));
+    crc = smq_calc_crc(data, len, 0);
+    memcpy(p + 5, &crc, sizeof(crc));
+    memcpy(p + 7, data, len);
+}
+
+void smsg_write_int8(smsg_writer_t* writer, int8_t val)
+{
+    smsg_write_value(writer, 0x02, &val, sizeof(val));
+}
+
+void smsg_write_int16(smsg_writer_t* writer, int16_t val)
+{
+    smsg_write_value(writer, 0x03, &val, sizeof(val));
+}
+
+void smsg_write_int32(smsg_writer_t* writer, int32_t val)
+{
+    smsg_write_value(writer, 0x04, &val, sizeof(val));
+}
+
+void smsg_write_uint8(smsg_writer_t* writer, uint8_t val)
+{
+    smsg_write_value(writer, 0x05, &val, sizeof(val));
+}
+
+void smsg_write_uint16(smsg_writer_t* writer, uint16_t val)
+{
+    smsg_write_value(writer, 0x06, &val, sizeof(val));
+}
+
+void smsg_write_uint32(smsg_writer_t* writer, uint32_t val)
+{
+    smsg_write_value(writer, 0x07, &val, sizeof(val));
+}
+
+void smsg_write_float(smsg_writer_t* writer, float val)
+{
+    smsg_write_value(writer, 0x08, &val, sizeof(val));
+}
+
+void smsg_write_double(smsg_writer_t* writer, double val)
+{
+    smsg_write_value(writer, 0x09, &val, sizeof(val));
+}
+
+void smsg_write_boolean(smsg_writer_t* writer, char val)
+{
+    *smsg_reserve(writer, 1) = (val) ? 0x0A : 0x0B;
+}
+
+void smsg_write_null(smsg_writer_t* writer)
+{
+    *smsg_reserve(writer, 1) = 0x0C;
+}
+
+void smsg_write_string(smsg_writer_t* writer, const char* str)
+{
+    /* The item length is 16 bits, longer strings are an error like overflow */
+    size_t len = strlen(str);
+    if (len > 0xFFFF)
+        longjmp(writer->jmp, 1);
+    smsg_write_data(writer, 0x00, str, len);
+}
+
+void smsg_write_string_len(smsg_writer_t* writer, const char* str, uint16_t len)
+{
+    smsg_write_data(writer, 0x00, str, len);
+}
+
+void smsg_write_buffer(smsg_writer_t* writer, const void* buf, uint16_t len)
+{
+    smsg_write_data(writer, 0x0D, buf, len);
+}
+
+void smsg_write_hash(smsg_writer_t* writer, const char* str)
+{
+    uint8_t* p = smsg_reserve(writer, 3);
+    uint16_t crc = smq_string_hash(str);
+    p[0] = 0x01;
+    memcpy(p + 1, &crc, sizeof(crc));
+}
+
+/* Items encoded ahead of time, such as the keys of a fixed message layout */
+void smsg_write_raw(smsg_writer_t* writer, const void* items, size_t len)
+{
+    memcpy(smsg_reserve(writer, len), items, len);
+}
+
+void smsg_write_end(smsg_writer_t* writer)
+{
+    *smsg_reserve(writer, 1) = 0xFF;
+}
+
+// ------------------------------------------------------
+// smq_json - streaming scan of JSON objects in place, no allocation
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const char* smq_json_ws(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    {
+        p++;
+    }
+    return p;
+}
+
+/* Closing quote of a string starting after its opening quote, NULL if unterminated */
+static const char* smq_json_string_end(const char* p, const char* end, char* escaped)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - p >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+        if (mask == 0)
+        {
+            p += 16;
+            continue;
+        }
+        p += __builtin_ctz(mask);
+        if (*p == '"')
+            return p;
+        *escaped = 1;
+        p += 2;
+    }
+#endif
+    while (p < end)
+    {
+        if (*p == '"')
+            return p;
+        if (*p == '\\')
+        {
+            *escaped = 1;
+            p++;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/* End of a nested object or array starting at p */
+static const char* smq_json_skip_nested(const char* p, const char* end)
+{
+    int depth = 0;
+    while (p < end)
+    {
+        char c = *p++;
+        if (c == '"')
+        {
+            char escaped = 0;
+            p = smq_json_string_end(p, end, &escaped);
+            if (p == NULL)
+                return NULL;
+            p++;
+        }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if ((c == '}' || c == ']') && --depth == 0)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int smq_json_literal(const char* p, const char* end, const char* literal)
+{
+    size_t len = strlen(literal);
+    return ((size_t)(end - p) >= len && memcmp(p, literal, len) == 0);
+}
+
+void smq_json_init(smq_json_t* json, const uint8_t* msg, size_t len)
+{
+    json->pos = (const char*)msg;
+    json->end = (const char*)msg + len;
+    json->first = 1;
+    json->done = 0;
+    json->error = 0;
+    json->pos = smq_json_ws(json->pos, json->end);
+    if (json->pos < json->end && *json->pos == '{')
+    {
+        json->pos++;
+    }
+    else
+    {
+        json->error = 1;
+    }
+}
+
+static int smq_json_fail(smq_json_t* json)
+{
+    json->error = 1;
+    return 0;
+}
+
+int smq_json_next(smq_json_t* json, smq_json_field_t* field)
+{
+    if (json->done || json->error)
+        return 0;
+    const char* p = smq_json_ws(json->pos, json->end);
+    const char* end = json->end;
+    if (p < end && *p == '}')
+    {
+        json->done = 1;
+        return 0;
+    }
+    if (!json->first)
+    {
+        if (p >= end || *p != ',')
+            return smq_json_fail(json);
+        p = smq_json_ws(p + 1, end);
+    }
+    json->first = 0;
+    /* Key */
+    if (p >= end || *p != '"')
+        return smq_json_fail(json);
+    field->key_escaped = 0;
+    field->key = p + 1;
+    p = smq_json_string_end(p + 1, end, &field->key_escaped);
+    if (p == NULL)
+        return smq_json_fail(json);
+    field->key_len = p - field->key;
+    p = smq_json_ws(p + 1, end);
+    if (p >= end || *p != ':')
+        return smq_json_fail(json);
+    p = smq_json_ws(p + 1, end);
+    if (p >= end)
+        return smq_json_fail(json);
+    /* Value */
+    field->value = p;
+    field->value_escaped = 0;
+    switch (*p)
+    {
+        case '"':
+            field->type = SMQ_JSON_STRING;
+            field->value = ++p;
+            p = smq_json_string_end(p, end, &field->value_escaped);
+            if (p == NULL)
+                return smq_json_fail(json);
+            field->value_len = p - field->value;
+            p++;
+            break;
+        case '{':
+        case '[':
+            field->type = (*p == '{') ? SMQ_JSON_OBJECT : SMQ_JSON_ARRAY;
+            p = smq_json_skip_nested(p, end);
+            if (p == NULL)
+                return smq_json_fail(json);
+            field->value_len = p - field->value;
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+        {
+            const char* literal = (*p == 't') ? "true" : (*p == 'f') ? "false" : "null";
+            if (!smq_json_literal(p, end, literal))
+                return smq_json_fail(json);
+            field->type = (*p == 'n') ? SMQ_JSON_NULL : SMQ_JSON_BOOLEAN;
+            field->value_len = strlen(literal);
+            p += field->value_len;
+            break;
+        }
+        default:
+            /* json-c makes numbers with a fraction or exponent doubles */
+            field->type = SMQ_JSON_INT;
+            while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E'))
+            {
+                if (*p == '.' || *p == 'e' || *p == 'E')
+                    field->type = SMQ_JSON_DOUBLE;
+                p++;
+            }
+            field->value_len = p - field->value;
+            if (field->value_len == 0)
+                return smq_json_fail(json);
+            break;
+    }
+    json->pos = p;
+    return 1;
+}
+
+int smq_json_failed(smq_json_t* json)
+{
+    return json->error;
+}
+
+/* Numbers are copied out since the message is not NUL terminated */
+static void smq_json_number_text(const smq_json_field_t* field, char* buf, size_t size)
+{
+    size_t len = (field->value_len < size) ? field->value_len : size - 1;
+    memcpy(buf, field->value, len);
+    buf[len] = '\0';
+}
+
+int smq_json_boolean(const smq_json_field_t* field)
+{
+    return (field->type == SMQ_JSON_BOOLEAN && field->value[0] == 't');
+}
+
+int64_t smq_json_int(const smq_json_field_t* field)
+{
+    char buf[64];
+    if (field->type == SMQ_JSON_DOUBLE)
+        return (int64_t)smq_json_double(field);
+    if (field->type != SMQ_JSON_INT)
+        return 0;
+    smq_json_number_text(field, buf, sizeof(buf));
+    return strtoll(buf, NULL, 10);
+}
+
+double smq_json_double(const smq_json_field_t* field)
+{
+    char buf[64];
+    if (field->type != SMQ_JSON_INT && field->type != SMQ_JSON_DOUBLE)
+        return 0;
+    smq_json_number_text(field, buf, sizeof(buf));
+    return strtod(buf, NULL);
+}
+
+static int smq_json_hex(const char* p)
+{
+    int val = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+        val <<= 4;
+        if (c >= '0' && c <= '9')
+            val |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            val |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            val |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return val;
+}
+
+size_t smq_json_unescape(const char* str, size_t len, char* buf, size_t size)
+{
+    const char* end = str + len;
+    size_t n = 0;
+    if (size == 0)
+        return 0;
+    while (str < end && n + 1 < size)
+    {
+        char c = *str++;
+        if (c != '\\' || str >= end)
+        {
+            buf[n++] = c;
+            continue;
+        }
+        c = *str++;
+        switch (c)
+        {
+            case 'b': buf[n++] = '\b'; break;
+            case 'f': buf[n++] = '\f'; break;
+            case 'n': buf[n++] = '\n'; break;
+            case 'r': buf[n++] = '\r'; break;
+            case 't': buf[n++] = '\t'; break;
+            case 'u':
+            {
+                int cp = (end - str >= 4) ? smq_json_hex(str) : -1;
+                if (cp < 0)
+                    break;
+                str += 4;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - str >= 6 && str[0] == '\\' && str[1] == 'u')
+                {
+                    int lo = smq_json_hex(str + 2);
+                    if (lo >= 0xDC00 && lo < 0xE000)
+                    {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        str += 6;
+                    }
+                }
+                /* UTF-8, dropped rather than split if it does not fit */
+                uint8_t utf8[4];
+                size_t utf8_len;
+                if (cp < 0x80)
+                {
+                    utf8[0] = cp;
+                    utf8_len = 1;
+                }
+                else if (cp < 0x800)
+                {
+                    utf8[0] = 0xC0 | (cp >> 6);
+                    utf8[1] = 0x80 | (cp & 0x3F);
+                    utf8_len = 2;
+                }
+                else if (cp < 0x10000)
+                {
+                    utf8[0] = 0xE0 | (cp >> 12);
+                    utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+                    utf8[2] = 0x80 | (cp & 0x3F);
+                    utf8_len = 3;
+                }
+                else
+                {
+                    utf8[0] = 0xF0 | (cp >> 18);
+                    utf8[1] = 0x80 | ((cp >> 12) & 0x3F);
+                    utf8[2] = 0x80 | ((cp >> 6) & 0x3F);
+                    utf8[3] = 0x80 | (cp & 0x3F);
+                    utf8_len = 4;
+                }
+                if (n + utf8_len >= size)
+                    str = end;
+                else
+                {
+                    memcpy(buf + n, utf8, utf8_len);
+                    n += utf8_len;
+                }
+                break;
+            }
+            default:
+                /* \" \\ \/ */
+                buf[n++] = c;
+                break;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static int smq_json_text_is(const char* text, size_t len, char escaped, const char* str)
+{
+    if (escaped)
+    {
+        char buf[256];
+        if (len >= sizeof(buf))
+            return 0;
+        len = smq_json_unescape(text, len, buf, sizeof(buf));
+        return (len == strlen(str) && memcmp(buf, str, len) == 0);
+    }
+    return (len == strlen(str) && memcmp(text, str, len) == 0);
+}
+
+int smq_json_key_is(const smq_json_field_t* field, const char* key)
+{
+    return smq_json_text_is(field->key, field->key_len, field->key_escaped, key);
+}
+
+/* Same as smq_string_hash of the unescaped key, to match keys against TLV hash items */
+uint16_t smq_json_key_hash(const smq_json_field_t* field)
+{
+    char buf[256];
+    const char* text = field->key;
+    size_t len = field->key_len;
+    char* unescaped = NULL;
+    if (field->key_escaped)
+    {
+        unescaped = (len < sizeof(buf)) ? buf : (char*)malloc(len + 1);
+        len = smq_json_unescape(text, len, unescaped, len + 1);
+        text = unescaped;
+    }
+    uint16_t crc = ~smq_calc_crc(text, len, ~0);
+    if (unescaped != NULL && unescaped != buf)
+        free(unescaped);
+    return crc;
+}
+
+int smq_json_string_is(const smq_json_field_t* field, const char* str)
+{
+    return (field->type == SMQ_JSON_STRING && smq_json_text_is(field->value, field->value_len, field->value_escaped, str));
+}
+
+// ------------------------------------------------------
+
+#define SMQ_MAX_SERIAL_PORTS 8
+#define SMQ_SERIAL_BUFFER_SIZE (65536 + 64)
+
+/* Windowed mode control items: each is the type byte followed by one byte */
+#define SMQ_SERIAL_HELLO     0xC0   /* offer window size */
+#define SMQ_SERIAL_HELLO_ACK 0xC1   /* accept window size */
+#define SMQ_SERIAL_SEQ       0xC2   /* sequence number of the frame that follows */
+#define SMQ_SERIAL_ACK       0xC3   /* cumulative ack of the last complete frame */
+#define SMQ_SERIAL_WINDOW    8
+#define SMQ_SERIAL_MAX_WINDOW 127
+#define SMQ_SERIAL_ACK_TIMEOUT_MS 1000
+#define SMQ_SERIAL_MAX_RETRIES 3
+
+typedef struct
+{
+    int fd;
+    /* Receive buffer, large enough for any single item, longer subscriber lists are dropped */
+    uint8_t* buf;
+    size_t pos;
+    size_t len;
+    /* Frame state carried across reads */
+    char in_frame;
+    char frame_ack;
+    char frame_seq;
+    char handshake;
+    /* Negotiated window, 0 for the legacy 'D'/'R'/'A' handshake */
+    uint8_t window;
+    uint8_t rx_seq;
+    char rx_seq_valid;
+    char rx_ack_pending;
+    uint8_t tx_seq;
+    uint8_t tx_acked;
+    /* Unacked frames by sequence number, resent go-back-N from tx_acked */
+    smq_buffer_t tx_frames[SMQ_SERIAL_MAX_WINDOW + 1];
+    uint64_t tx_time;
+    uint8_t tx_retries;
+    char tx_resent;
+    /* Sequence number of the frame being received, becomes rx_seq if it arrives whole */
+    uint8_t frame_rx_seq;
+    char frame_lost;
+    /* A frame was lost since rx_seq, the frames after it are not counted again */
+    char rx_lost;
+    /* Frame topic, either a name or the id of a hash item */
+    char* topic_name;
+    char topic_hashed;
+    uint16_t topic_id;
+    char* jkey;
+    json_object* jobj;
+    /* Skipping the rest of a corrupted frame */
+    char resync;
+    unsigned errors;
+    /* Inbound items of the current frame, kept in JSON mode for frames with buffers */
+    smq_buffer_t frame;
+    char frame_binary;
+    /* Outbound frame, written with a single write() by smq_serial_flush */
+    smq_buffer_t out;
+    /* Part of the outbound frame could not be buffered, the whole frame is dropped */
+    char out_failed;
+} smq_serial_port_t;
+
+static smq_serial_port_t serial_ports[SMQ_MAX_SERIAL_PORTS];
+/* Port whose frame is currently being built, if any */
+static smq_serial_port_t* serial_out_port;
+
+static int smq_write_all(int fd, const void* buf, size_t len)
+{
+    const uint8_t* b = (const uint8_t*)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, b, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                /* A stalled board must not block the spin loop for good */
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                if (0 == poll(&pfd, 1, SMQ_SERIAL_ACK_TIMEOUT_MS))
+                {
+                    fprintf(stderr, "Timeout writing to serial port\n");
+                    errno = ETIMEDOUT;
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void smq_send_raw_bytes(int fd, const void* buf, size_t len)
+{
+    smq_serial_port_t* port = serial_out_port;
+    if (port != NULL && port->fd == fd)
+    {
+        if (!smq_buffer_append(&port->out, buf, len))
+            port->out_failed = 1;
+        return;
+    }
+    if (smq_write_all(fd, buf, len) != 0)
+    {
+        fprintf(stderr, "Error writing to serial port\n");
+    }
+#if 0
+    printf("==>%d:[0x", len);
+    for (int i = 0; i < len; i++)
+    {
+        printf("%02X ", ((uint8_t*)buf)[i]);
+    }
+    printf("]\n");
+#endif
+}
+
+/* Collect everything sent to the port until smq_serial_flush */
+static void smq_serial_begin(smq_serial_port_t* port)
+{
+    port->out.len = 0;
+    port->out_failed = 0;
+    serial_out_port = port;
+}
+
+static int smq_serial_flush(smq_serial_port_t* port)
+{
+    int ret = -1;
+    if (port->window != 0 && !port->out_failed)
+    {
+        /* Kept until acked in case it has to be resent */
+        smq_buffer_t* copy = &port->tx_frames[port->out.data[1] & SMQ_SERIAL_MAX_WINDOW];
+        copy->len = 0;
+        if (!smq_buffer_append(copy, port->out.data, port->out.len))
+            port->out_failed = 1;
+        else if ((uint8_t)(port->tx_seq - port->tx_acked) == 1)
+            port->tx_time = smq_current_time();
+    }
+    if (port->out_failed)
+    {
+        fprintf(stderr, "Serial frame dropped, out of memory\n");
+        /* Never sent, its sequence number goes to the next frame */
+        if (port->window != 0)
+            port->tx_seq--;
+    }
+    else
+    {
+        ret = smq_write_all(port->fd, port->out.data, port->out.len);
+    }
+    port->out.len = 0;
+    port->out_failed = 0;
+    serial_out_port = NULL;
+    return ret;
+}
+
+static void smq_send_data(int fd, const void* buf, uint16_t len)
+{
+    uint16_t crc = smq_calc_crc(buf, len, 0);
+    smq_send_raw_bytes(fd, &crc, sizeof(crc));
+    smq_send_raw_bytes(fd, buf, len);
+}
+
+void smq_send_string(int fd, const char* str)
+{
+    uint8_t delim = 0x00;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+
+    uint16_t len = strlen(str);
+    smq_send_data(fd, &len, sizeof(len));
+    smq_send_data(fd, str, len);
+}
+
+void smq_send_string_hash(int fd, const char* str)
+{
+    uint8_t delim = 0x01;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+
+    uint16_t crc = smq_string_hash(str);
+    smq_send_raw_bytes(fd, &crc, sizeof(crc));
+}
+
+void smq_send_int8(int fd, int8_t val)
+{
+    uint8_t delim = 0x02;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_int16(int fd, int16_t val)
+{
+    uint8_t delim = 0x03;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_int32(int fd, int32_t val)
+{
+    uint8_t delim = 0x04;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_uint8(int fd, uint8_t val)
+{
+    uint8_t delim = 0x05;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_uint16(int fd, uint16_t val)
+{
+    uint8_t delim = 0x06;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_uint32(int fd, uint32_t val)
+{
+    uint8_t delim = 0x07;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_float(int fd, float val)
+{
+    uint8_t delim = 0x08;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &val, sizeof(val));
+}
+
+void smq_send_boolean(int fd, char val)
+{
+    uint8_t delim = (val) ? 0x0A : 0x0B;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+}
+
+void smq_send_null(int fd)
+{
+    uint8_t delim = 0x0C;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+}
+
+void smq_send_buffer(int fd, const void* buf, uint16_t len)
+{
+    uint8_t delim = 0x0D;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    smq_send_data(fd, &len, sizeof(len));
+    smq_send_data(fd, buf, len);
+}
+
+void smq_end(int fd)
+{
+    uint8_t delim = 0xFF;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+}
+
+// ------------------------------------------------------
+
+static smq_serial_port_t* smq_serial_port(int fd)
+{
+    smq_serial_port_t* free_port = NULL;
+    for (int i = 0; i < SMQ_MAX_SERIAL_PORTS; i++)
+    {
+        if (serial_ports[i].buf != NULL && serial_ports[i].fd == fd)
+            return &serial_ports[i];
+        if (serial_ports[i].buf == NULL && free_port == NULL)
+            free_port = &serial_ports[i];
+    }
+    if (free_port == NULL)
+    {
+        fprintf(stderr, "Too many serial ports\n");
+        return NULL;
+    }
+    memset(free_port, 0, sizeof(*free_port));
+    free_port->buf = (uint8_t*)malloc(SMQ_SERIAL_BUFFER_SIZE);
+    if (free_port->buf == NULL)
+    {
+        fprintf(stderr, "Error allocating serial buffer\n");
+        return NULL;
+    }
+    free_port->fd = fd;
+    return free_port;
+}
+
+static void smq_serial_port_release(int fd)
+{
+    for (int i = 0; i < SMQ_MAX_SERIAL_PORTS; i++)
+    {
+        smq_serial_port_t* port = &serial_ports[i];
+        if (port->buf != NULL && port->fd == fd)
+        {
+            if (port->jobj != NULL)
+                json_object_put(port->jobj);
+            if (serial_out_port == port)
+                serial_out_port = NULL;
+            free(port->topic_name);
+            free(port->jkey);
+            free(port->buf);
+            free(port->frame.data);
+            free(port->out.data);
+            for (int j = 0; j <= SMQ_SERIAL_MAX_WINDOW; j++)
+                free(port->tx_frames[j].data);
+            memset(port, 0, sizeof(*port));
+        }
+    }
+}
+
+static void smq_serial_compact(smq_serial_port_t* port)
+{
+    if (port->pos > 0)
+    {
+        memmove(port->buf, port->buf + port->pos, port->len - port->pos);
+        port->len -= port->pos;
+        port->pos = 0;
+    }
+}
+
+/* Read whatever is available in a single read() */
+static int smq_serial_fill(smq_serial_port_t* port)
+{
+    smq_serial_compact(port);
+    ssize_t n = read(port->fd, port->buf + port->len, SMQ_SERIAL_BUFFER_SIZE - port->len);
+    if (n < 0)
+    {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+#if 0
+    printf("<==%d:[0x", (int)n);
+    for (int i = 0; i < n; i++)
+    {
+        printf("%02X ", port->buf[port->len + i]);
+    }
+    printf("]\n");
+#endif
+    port->len += n;
+    return n;
+}
+
+static const char* sDataType[] =
+{
+    "STRING",
+    "HASH",
+    "INT8",
+    "INT16",
+    "INT32",
+    "UINT8",
+    "UINT16",
+    "UINT32",
+    "FLOAT",
+    "BUFFER"
+};
+
+#if 0
+#define REPORT_TYPE(b) \
+{   if (b < sizeof(sDataType)/sizeof(sDataType[0])) printf("[%s]\n", sDataType[b]); }
+#else
+#define REPORT_TYPE(b)
+#endif
+/* Errors drop the current frame and resynchronize on the next frame boundary */
+#define REPORT_BAD_CRC(crc, recrc) \
+{   printf("CRC BAD GOT 0x%04X EXPECTED 0x%04X @%d\n", crc, recrc, __LINE__); \
+    smq_serial_drop(port); \
+    continue; }
+
+static int smsg_callback_fd;
+static void smsg_callback(const char * topic_name, const uint8_t * msg, size_t len, void* arg);
+
+static void smq_serial_string(smq_serial_port_t* port, char* str)
+{
+    if (port->jobj == NULL)
+    {
+        port->topic_name = str;
+        port->jobj = json_object_new_object();
+    }
+    else if (port->jkey == NULL)
+    {
+        port->jkey = str;
+    }
+    else
+    {
+        json_object_object_add(port->jobj, port->jkey, json_object_new_string(str));
+        free(str);
+        free(port->jkey);
+        port->jkey = NULL;
+    }
+}
+
+static void smq_serial_value(smq_serial_port_t* port, json_object* val)
+{
+    if (port->jkey != NULL)
+    {
+        json_object_object_add(port->jobj, port->jkey, val);
+        free(port->jkey);
+        port->jkey = NULL;
+    }
+    else
+    {
+        // INVALID
+        json_object_put(val);
+    }
+}
+
+static void smq_serial_subscribe(int fd, uint16_t crcsub)
+{
+    smq_topic_t* topic = smq_topic_hashed(&subscribed_topics, crcsub, sizeof(crcsub));
+    if (topic == NULL || topic->scallback == NULL)
+    {
+        char buf[32];
+        sprintf(buf, "$crc%04X", crcsub);
+        smsg_callback_fd = fd;
+        if (!smq_subscribe_ser(buf, smsg_callback))
+        {
+            printf("FAILED TO SUBSCRIBE %s\n", buf);
+        }
+        else
+        {
+            printf("subscribe %s\n", buf);
+        }
+    }
+}
+
+/* SMQ_SERIAL_ENCODING=buffers: JSON, except frames with a buffer which go out as TLV */
+static char serial_tlv_buffers;
+
+static uint8_t smq_serial_encoding()
+{
+    static int encoding = -1;
+    if (encoding < 0)
+    {
+        const char* env = getenv("SMQ_SERIAL_ENCODING");
+        encoding = (env != NULL && strcmp(env, "tlv") == 0) ? SMQ_ENCODING_TLV : SMQ_ENCODING_JSON;
+        serial_tlv_buffers = (env != NULL && strcmp(env, "buffers") == 0);
+    }
+    return (uint8_t)encoding;
+}
+
+static void smq_serial_item(smq_serial_port_t* port, const uint8_t* p, size_t need)
+{
+    if (p[0] == 0x01 && port->topic_name == NULL && !port->topic_hashed && port->jobj == NULL)
+    {
+        /* Hashed topics stay as their id */
+        port->topic_hashed = 1;
+        memcpy(&port->topic_id, p + 1, sizeof(port->topic_id));
+        if (smq_serial_encoding() != SMQ_ENCODING_TLV)
+            port->jobj = json_object_new_object();
+        return;
+    }
+    if (smq_serial_encoding() == SMQ_ENCODING_TLV)
+    {
+        /* Items are published as they arrived, the first string is the topic */
+        if (port->topic_name == NULL && !port->topic_hashed)
+        {
+            if (p[0] == 0x00)
+                port->topic_name = smq_tlv_strdup(p);
+        }
+        else
+        {
+            smq_buffer_append(&port->frame, p, need);
+        }
+    }
+    else
+    {
+        /* Peers before SMQ_ENCODING_TLV take any payload as JSON, so buffers are
+           int arrays unless TLV buffer frames are asked for */
+        if (port->jobj != NULL && serial_tlv_buffers)
+            smq_buffer_append(&port->frame, p, need);
+        if (p[0] == 0x0D && port->jobj != NULL && serial_tlv_buffers)
+        {
+            port->frame_binary = 1;
+            free(port->jkey);
+            port->jkey = NULL;
+        }
+        else if (p[0] == 0x00 || p[0] == 0x01)
+        {
+            smq_serial_string(port, smq_tlv_strdup(p));
+        }
+        else
+        {
+            smq_serial_value(port, smq_tlv_json_value(p));
+        }
+    }
+}
+
+static void smq_serial_advertise(const char* topicName)
+{
+    if (!smq_is_advertised(topicName))
+    {
+        if (!smq_advertise(topicName))
+        {
+            printf("FAILED TO ADVERTISE %s\n", topicName);
+        }
+        else
+        {
+            printf("advertise %s\n", topicName);
+            if (smq_is_hash_topic(topicName))
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                int8_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                /* Only the id is known */
             }
-            case 0x03:
+            else if (!smq_advertise_hash(topicName))
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                int16_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                printf("FAILED TO ADVERTISE HASH %s\n", topicName);
             }
-            case 0x04:
+            else
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                int32_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                printf("advertise hash %s\n", topicName);
             }
-            case 0x05:
+        }
+    }
+}
+
+/* Published topic of the current frame, advertised on first use */
+static smq_topic_t* smq_serial_topic(smq_serial_port_t* port)
+{
+    if (port->topic_hashed)
+    {
+        /* Boards always use 16-bit hashes */
+        smq_topic_t* topic = smq_topic_hashed(&published_topics, port->topic_id, sizeof(port->topic_id));
+        if (topic == NULL)
+        {
+            char buf[32];
+            sprintf(buf, "$crc%04X", port->topic_id);
+            smq_serial_advertise(buf);
+            topic = smq_topic_hashed(&published_topics, port->topic_id, sizeof(port->topic_id));
+        }
+        return topic;
+    }
+    smq_serial_advertise(port->topic_name);
+    return smq_topic_in_list(&published_topics, port->topic_name);
+}
+
+static void smq_serial_frame_end(smq_serial_port_t* port)
+{
+    /* With SMQ_SERIAL_ENCODING=buffers frames with a buffer are published as TLV */
+    if (port->jobj != NULL && !port->frame_binary)
+    {
+        smq_topic_t* topic = smq_serial_topic(port);
+        json_object_object_add(port->jobj, "_src_", json_object_new_string(smq_get_host()));
+        /* Both forms are advertised, so one aliased message reaches either */
+        const char* msg = json_object_to_json_string(port->jobj);
+        if (topic != NULL)
+        {
+            smq_publish_topic(topic, (const uint8_t*)msg, strlen(msg), SMQ_ENCODING_JSON);
+        }
+    }
+    else if (port->topic_name != NULL || port->topic_hashed)
+    {
+        smq_topic_t* topic = smq_serial_topic(port);
+        const char* host = smq_get_host();
+        smq_tlv_append_data(&port->frame, 0x00, "_src_", 5);
+        smq_tlv_append_data(&port->frame, 0x00, host, strlen(host));
+        if (topic != NULL)
+        {
+            smq_publish_topic(topic, port->frame.data, port->frame.len, SMQ_ENCODING_TLV);
+        }
+    }
+    if (port->jobj != NULL)
+    {
+        json_object_put(port->jobj);
+        port->jobj = NULL;
+    }
+    free(port->topic_name);
+    port->topic_name = NULL;
+    port->topic_hashed = 0;
+    port->frame.len = 0;
+    port->frame_binary = 0;
+    free(port->jkey);
+    port->jkey = NULL;
+    if (port->frame_ack && port->frame_seq)
+    {
+        /* Acked cumulatively once the current batch is parsed, a lost frame acks the last good one again */
+        if (!port->frame_lost)
+        {
+            port->rx_seq = port->frame_rx_seq;
+            port->rx_seq_valid = 1;
+        }
+        port->rx_lost = port->frame_lost;
+        port->rx_ack_pending = 1;
+    }
+    else if (port->frame_ack)
+    {
+        char ready = 'A';
+        if (write(port->fd, &ready, 1) != 1)
+        {
+            printf("FAIL\n");
+        }
+    }
+    port->in_frame = 0;
+    port->frame_seq = 0;
+    port->frame_lost = 0;
+}
+
+static uint8_t smq_serial_window()
+{
+    static int window = -1;
+    if (window < 0)
+    {
+        const char* env = getenv("SMQ_SERIAL_WINDOW");
+        window = (env != NULL) ? atoi(env) : SMQ_SERIAL_WINDOW;
+        if (window < 0)
+            window = 0;
+        if (window > SMQ_SERIAL_MAX_WINDOW)
+            window = SMQ_SERIAL_MAX_WINDOW;
+    }
+    return (uint8_t)window;
+}
+
+/* Resend every unacked frame, giving up on them after SMQ_SERIAL_MAX_RETRIES rounds */
+static void smq_serial_resend(smq_serial_port_t* port)
+{
+    if (++port->tx_retries > SMQ_SERIAL_MAX_RETRIES)
+    {
+        port->errors++;
+        printf("Serial frames #%u-#%u not acked, dropped (%u errors)\n",
+            port->tx_acked, (uint8_t)(port->tx_seq - 1), port->errors);
+        port->tx_acked = port->tx_seq;
+        port->tx_retries = 0;
+        port->tx_resent = 0;
+        return;
+    }
+    printf("Serial resending from #%u\n", port->tx_acked);
+    for (uint8_t seq = port->tx_acked; seq != port->tx_seq; seq++)
+    {
+        smq_buffer_t* frame = &port->tx_frames[seq & SMQ_SERIAL_MAX_WINDOW];
+        if (smq_write_all(port->fd, frame->data, frame->len) != 0)
+            break;
+    }
+    port->tx_resent = 1;
+    port->tx_time = smq_current_time();
+}
+
+static void smq_serial_acked(smq_serial_port_t* port, uint8_t acked)
+{
+    uint8_t in_flight = port->tx_seq - port->tx_acked;
+    uint8_t advance = acked - port->tx_acked;
+    if (advance != 0 && advance <= in_flight)
+    {
+        port->tx_acked = acked;
+        port->tx_retries = 0;
+        port->tx_resent = 0;
+        port->tx_time = smq_current_time();
+    }
+    else if (advance == 0 && in_flight != 0 && !port->tx_resent)
+    {
+        /* The same ack again: the board lost the frame after it */
+        smq_serial_resend(port);
+    }
+}
+
+/* Resend frames whose ack is overdue, returns the time until the next check or -1 */
+static long smq_serial_check_resend()
+{
+    long next = -1;
+    uint64_t now = smq_current_time();
+    for (int i = 0; i < SMQ_MAX_SERIAL_PORTS; i++)
+    {
+        smq_serial_port_t* port = &serial_ports[i];
+        if (port->buf == NULL || port->window == 0 || port->tx_seq == port->tx_acked)
+            continue;
+        if (now - port->tx_time >= SMQ_SERIAL_ACK_TIMEOUT_MS)
+            smq_serial_resend(port);
+        if (port->tx_seq != port->tx_acked)
+        {
+            long left = (long)(port->tx_time + SMQ_SERIAL_ACK_TIMEOUT_MS - now);
+            if (left < 0)
+                left = 0;
+            if (next < 0 || left < next)
+                next = left;
+        }
+    }
+    return next;
+}
+
+static void smq_serial_control(smq_serial_port_t* port, uint8_t type, uint8_t arg)
+{
+    switch (type)
+    {
+        case SMQ_SERIAL_HELLO:
+        {
+            uint8_t window = smq_serial_window();
+            if (arg < window)
+                window = arg;
+            uint8_t reply[2] = { SMQ_SERIAL_HELLO_ACK, window };
+            if (write(port->fd, reply, sizeof(reply)) == sizeof(reply))
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                uint8_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                port->window = window;
             }
-            case 0x06:
+            break;
+        }
+        case SMQ_SERIAL_HELLO_ACK:
+            port->window = (arg <= smq_serial_window()) ? arg : smq_serial_window();
+            break;
+        case SMQ_SERIAL_SEQ:
+            if (!port->in_frame)
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                uint16_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
+                port->in_frame = 1;
+                port->frame_seq = 1;
+                port->frame_ack = 1;
+                port->frame_rx_seq = arg;
+                /* Go-back-N: any frame but the next one is skipped, the board resends from the ack */
+                uint8_t ahead = arg - (uint8_t)(port->rx_seq + 1);
+                if (port->rx_seq_valid && ahead != 0)
                 {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
+                    if (ahead <= SMQ_SERIAL_MAX_WINDOW && !port->rx_lost)
                     {
-                        // INVALID
+                        port->errors++;
+                        printf("Serial frames lost before #%u (%u errors)\n", arg, port->errors);
                     }
+                    port->frame_lost = 1;
+                    port->resync = 1;
                 }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
             }
-            case 0x07:
+            break;
+        case SMQ_SERIAL_ACK:
+            smq_serial_acked(port, arg + 1);
+            break;
+    }
+    if (type == SMQ_SERIAL_HELLO || type == SMQ_SERIAL_HELLO_ACK)
+    {
+        port->tx_seq = port->tx_acked = 0;
+        port->tx_retries = 0;
+        port->tx_resent = 0;
+        port->rx_seq = 0xFF;
+        port->rx_seq_valid = 0;
+        port->rx_lost = 0;
+        if (port->window != 0)
+            printf("Serial window %d\n", port->window);
+    }
+}
+
+/* Discard the partial frame and skip input up to the next end of frame */
+static void smq_serial_drop(smq_serial_port_t* port)
+{
+    if (port->jobj != NULL)
+        json_object_put(port->jobj);
+    free(port->topic_name);
+    free(port->jkey);
+    port->jobj = NULL;
+    port->topic_name = NULL;
+    port->topic_hashed = 0;
+    port->jkey = NULL;
+    port->frame.len = 0;
+    port->frame_binary = 0;
+    port->in_frame = 1;
+    port->resync = 1;
+    port->frame_lost = 1;
+    port->errors++;
+    port->pos++;
+    printf("Serial frame dropped (%u errors)\n", port->errors);
+}
+
+/* Consume every complete item in the receive buffer. Returns 0 once more data is needed. */
+static int smq_serial_parse_items(smq_serial_port_t* port)
+{
+    static uint16_t subscribers_hash;
+    if (subscribers_hash == 0)
+        subscribers_hash = smq_string_hash("subscribers");
+    for (;;)
+    {
+        const uint8_t* p = port->buf + port->pos;
+        size_t avail = port->len - port->pos;
+        if (avail == 0)
+            return 0;
+        uint8_t type = p[0];
+        if (port->resync)
+        {
+            /* Only the end of frame counts here, control bytes in the garbage are not acted on */
+            port->pos++;
+            if (type == 0xFF)
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                uint32_t val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_int(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                /* Still acknowledged so the board does not stall, the frame is lost */
+                port->resync = 0;
+                smq_serial_frame_end(port);
             }
-            case 0x08:
+            continue;
+        }
+        if (type >= SMQ_SERIAL_HELLO && type <= SMQ_SERIAL_ACK)
+        {
+            if (avail < 2)
+                return 0;
+            port->pos += 2;
+            smq_serial_control(port, type, p[1]);
+            continue;
+        }
+        if (!port->in_frame)
+        {
+            /* Between frames: 'R' answers our own 'D', other unknown bytes are noise */
+            if (port->handshake && type == 'R')
+                return 0;
+            if (type <= 0x0D || type == 0xFF)
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                float val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_double(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
-                    REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
+                port->in_frame = 1;
+                port->frame_ack = !port->handshake;
             }
-            case 0x09:
+        }
+        REPORT_TYPE(type);
+        size_t need = 1;
+        uint16_t crc;
+        uint16_t recrc;
+        switch (type)
+        {
+            case 0x00:
+            case 0x0D:
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                double val;
-                if (smsg_read(fd, &val, sizeof(val)) != sizeof(val))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&val, sizeof(val), 0);
-                if (crc == recrc)
-                {
-                    if (jkey != NULL)
-                    {
-                        json_object_object_add(jobj, jkey, json_object_new_double(val));
-                        free(jkey);
-                        jkey = NULL;
-                    }
-                    else
-                    {
-                        // INVALID
-                    }
-                }
-                else
-                {
+                uint16_t len;
+                if (avail < 5)
+                    return 0;
+                memcpy(&crc, p + 1, sizeof(crc));
+                memcpy(&len, p + 3, sizeof(len));
+                recrc = smq_calc_crc(&len, sizeof(len), 0);
+                if (crc != recrc)
                     REPORT_BAD_CRC(crc, recrc);
-                }
-                break;
-            }
-            case 0x0A:
-            {
-                if (jkey != NULL)
-                {
-                    json_object_object_add(jobj, jkey, json_object_new_boolean(1));
-                    free(jkey);
-                    jkey = NULL;
-                }
-                else
-                {
-                    // INVALID
-                }
-                break;
-            }
-            case 0x0B:
-            {
-                if (jkey != NULL)
-                {
-                    json_object_object_add(jobj, jkey, json_object_new_boolean(0));
-                    free(jkey);
-                    jkey = NULL;
-                }
-                else
-                {
-                    // INVALID
-                }
-                break;
-            }
-            case 0x0C:
-            {
-                if (jkey != NULL)
-                {
-                    json_object_object_add(jobj, jkey, NULL);
-                    free(jkey);
-                    jkey = NULL;
-                }
-                else
-                {
-                    // INVALID
-                }
+                need = 7 + len;
+                if (avail < need)
+                    return 0;
+                memcpy(&crc, p + 5, sizeof(crc));
+                recrc = smq_calc_crc(p + 7, len, 0);
+                if (crc != recrc)
+                    REPORT_BAD_CRC(crc, recrc);
+                smq_serial_item(port, p, need);
                 break;
             }
-            case 0x0D:
+            case 0x01:
             {
-                uint16_t crc;
-                if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                    REPORT_READ_ERROR();
-                uint16_t len;
-                if (smsg_read(fd, &len, sizeof(len)) != sizeof(len))
-                    REPORT_READ_ERROR();
-                uint16_t recrc = smq_calc_crc(&len, sizeof(len), 0);
-                if (crc == recrc)
+                if (avail < 3)
+                    return 0;
+                memcpy(&crc, p + 1, sizeof(crc));
+                if (crc == subscribers_hash)
                 {
-                    if (smsg_read(fd, &crc, sizeof(crc)) != sizeof(crc))
-                        REPORT_READ_ERROR();
-
-                    char* buffer = (char*)malloc(len);
-                    if (buffer == NULL)
-                        REPORT_MEM_ERROR();
-                    if (smsg_read(fd, buffer, len) != len)
-                        REPORT_READ_ERROR();
-                    recrc = smq_calc_crc(buffer, len, 0);
-                    if (crc == recrc)
+                    uint16_t count;
+                    if (avail < 5)
+                        return 0;
+                    memcpy(&count, p + 3, sizeof(count));
+                    need = 5 + count * sizeof(uint16_t);
+                    if (need > SMQ_SERIAL_BUFFER_SIZE)
                     {
-                        if (jkey != NULL)
-                        {
-                            json_object* jarr = json_object_new_array();
-                            for (unsigned i = 0; i < len; i++)
-                            {
-                                json_object_array_add(jarr, json_object_new_int(buffer[i]));
-                            }
-                            json_object_object_add(jobj, jkey, jarr);
-                            free(jkey);
-                            jkey = NULL;
-                        }
-                        else
-                        {
-                            // INVALID
-                        }
+                        /* The count is not CRC protected, one that cannot fit is corruption */
+                        smq_serial_drop(port);
+                        continue;
                     }
-                    else
+                    if (avail < need)
+                        return 0;
+                    for (unsigned i = 0; i < count; i++)
                     {
-                        free(buffer);
-                        REPORT_BAD_CRC(crc, recrc);
+                        uint16_t crcsub;
+                        memcpy(&crcsub, p + 5 + i * sizeof(crcsub), sizeof(crcsub));
+                        smq_serial_subscribe(port->fd, crcsub);
                     }
-                    free(buffer);
                 }
                 else
                 {
-                    REPORT_BAD_CRC(crc, recrc);
+                    need = 3;
+                    smq_serial_item(port, p, need);
                 }
                 break;
             }
+            case 0x02:
+            case 0x03:
+            case 0x04:
+            case 0x05:
+            case 0x06:
+            case 0x07:
+            case 0x08:
+            case 0x09:
+            {
+                size_t size = sValueSize[type];
+                need = 3 + size;
+                if (avail < need)
+                    return 0;
+                memcpy(&crc, p + 1, sizeof(crc));
+                recrc = smq_calc_crc(p + 3, size, 0);
+                if (crc != recrc)
+                    REPORT_BAD_CRC(crc, recrc);
+                smq_serial_item(port, p, need);
+                break;
+            }
+            case 0x0A:
+            case 0x0B:
+            case 0x0C:
+                smq_serial_item(port, p, need);
+                break;
             case 0xDB:
             {
-                uint8_t ch;
-                if (smsg_read(fd, &ch, sizeof(ch)) != sizeof(ch))
-                    REPORT_READ_ERROR();
-                printf("%c", ch);
+                need = 2;
+                if (avail < need)
+                    return 0;
+                printf("%c", p[1]);
                 break;
             }
             case 0xDD:
             {
-                printf("HMM\n");
-                uint8_t len;
-                if (smsg_read(fd, &len, sizeof(len)) != sizeof(len))
-                    REPORT_READ_ERROR();
-                printf("len : %d\n", len);
-                char* buffer = (char*)malloc(len+1);
-                if (buffer == NULL)
-                    REPORT_MEM_ERROR();
-                if (smsg_read(fd, buffer, len) != len)
-                    REPORT_READ_ERROR();
-                buffer[len] = '\0';
-                printf("%s", buffer);
-                free(buffer);
+                if (avail < 2)
+                    return 0;
+                need = 2 + p[1];
+                if (avail < need)
+                    return 0;
+                printf("%.*s", (int)p[1], (const char*)p + 2);
                 break;
             }
             case 0xDE:
             {
-                printf("HMM2\n");
-                uint8_t lenhi;
-                uint8_t lenlo;
-                if (smsg_read(fd, &lenhi, sizeof(lenhi)) != sizeof(lenhi))
-                    REPORT_READ_ERROR();
-                if (smsg_read(fd, &lenlo, sizeof(lenlo)) != sizeof(lenlo))
-                    REPORT_READ_ERROR();
-                uint16_t len = (lenhi << 8) | lenlo;
-                printf("len : %d\n", len);
-                char* buffer = (char*)malloc(len+1);
-                if (buffer == NULL)
-                    REPORT_MEM_ERROR();
-                if (smsg_read(fd, buffer, len) != len)
-                    REPORT_READ_ERROR();
-                buffer[len] = '\0';
-                printf("%s", buffer);
-                free(buffer);
+                if (avail < 3)
+                    return 0;
+                uint16_t len = (p[1] << 8) | p[2];
+                need = 3 + len;
+                if (avail < need)
+                    return 0;
+                printf("%.*s", (int)len, (const char*)p + 3);
                 break;
             }
             case 0xFF:
             {
-                if (jobj != NULL)
-                {
-                    if (!smq_is_advertised(topicName))
-                    {
-                        if (!smq_advertise(topicName))
-                        {
-                            printf("FAILED TO ADVERTISE %s\n", topicName);
-                        }
-                        else
-                        {
-                            printf("advertise %s\n", topicName);
-                            if (!smq_advertise_hash(topicName))
-                            {
-                                printf("FAILED TO ADVERTISE HASH %s\n", topicName);
-                            }
-                            else
-                            {
-                                printf("advertise hash %s\n", topicName);
-                            }
-                        }
-                    }
-                    json_object_object_add(jobj, "_src_", json_object_new_string(smq_get_host()));
-                    if (smq_is_advertised(topicName))
-                    {
-                        const char* msg = json_object_to_json_string(jobj);
-                        smq_publish(topicName, (const uint8_t*)msg, strlen(msg));
-                    }
-                    if (smq_is_advertised_hash(topicName))
-                    {
-                        const char* msg = json_object_to_json_string(jobj);
-                        smq_publish_hash(topicName, (const uint8_t*)msg, strlen(msg));
-                    }
-                    json_object_put(jobj);
-                    free(topicName);
-                    topicName = NULL;
-                    jobj = NULL;
-                }
-                if (needACK)
+                port->pos += need;
+                smq_serial_frame_end(port);
+                continue;
+            }
+            default:
+                /* Unknown items cannot be skipped, the rest of the frame is lost */
+                if (port->in_frame)
                 {
-                    char ready = 'A';
-                    if (write(fd, &ready, 1) != 1)
-                    {
-                        printf("FAIL\n");
-                    }
-                    // static uint32_t sCount;
-                    // printf("============smq_process_serial DONE ACK=%d\n", sCount);
-                    // sCount++;
+                    smq_serial_drop(port);
+                    continue;
                 }
-                return 0;
-            }
+                break;
         }
+        port->pos += need;
     }
 }
 
-static void smsg_callback(const char * topic_name, const uint8_t * msg, size_t len, void* arg)
+static int smq_serial_parse(smq_serial_port_t* port)
 {
-    int fd = smsg_callback_fd;
-    uint16_t crc;
-    if (strncmp(topic_name, "$crc", 4) == 0)
+    int ret = smq_serial_parse_items(port);
+    if (port->rx_ack_pending)
     {
-        int crcint;
-        sscanf(topic_name+4, "%x", &crcint);
-        crc = (uint16_t)crcint;
+        uint8_t ack[2] = { SMQ_SERIAL_ACK, port->rx_seq };
+        if (write(port->fd, ack, sizeof(ack)) != sizeof(ack))
+        {
+            printf("FAIL\n");
+        }
+        port->rx_ack_pending = 0;
     }
-    else
+    return ret;
+}
+
+unsigned smq_serial_error_count(int fd)
+{
+    for (int i = 0; i < SMQ_MAX_SERIAL_PORTS; i++)
     {
-        crc = smq_string_hash(topic_name);
+        if (serial_ports[i].buf != NULL && serial_ports[i].fd == fd)
+            return serial_ports[i].errors;
     }
-    printf("%s : %.*s\n", topic_name, (int)len, msg);
-    json_tokener* tok = json_tokener_new();
-    json_object* jobj = json_tokener_parse_ex(tok, (const char*)msg, len);
-    if (jobj != NULL)
+    return 0;
+}
+
+int smq_process_serial(int fd, uint8_t id)
+{
+    smq_serial_port_t* port = smq_serial_port(fd);
+    if (port == NULL)
+    {
+        return -1;
+    }
+    if (id != 0xFF)
+    {
+        /* The caller already consumed the type byte of the next item */
+        smq_serial_compact(port);
+        if (port->len < SMQ_SERIAL_BUFFER_SIZE)
+            port->buf[port->len++] = id;
+    }
+    else if (smq_serial_fill(port) < 0)
+    {
+        return -1;
+    }
+    return smq_serial_parse(port);
+}
+
+/* Wait for input, returns 0 on timeout and -1 once the port is gone */
+static int smq_serial_wait_input(smq_serial_port_t* port, long timeout_ms)
+{
+    struct pollfd pfd = { port->fd, POLLIN, 0 };
+    int rc;
+    do
+    {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    if (rc <= 0)
+        return rc;
+    /* Readable but nothing to read is a hangup */
+    errno = 0;
+    int n = smq_serial_fill(port);
+    if (n < 0 || (n == 0 && errno != EAGAIN && errno != EINTR))
+    {
+        printf("Serial port disconnected\n");
+        return -1;
+    }
+    return 1;
+}
+
+/* Wait for the board to answer 'R', parsing any inbound frames that arrive meanwhile */
+static int smq_serial_wait_ready(smq_serial_port_t* port)
+{
+    int ret = 0;
+    uint64_t deadline = smq_current_time() + SMQ_SERIAL_ACK_TIMEOUT_MS;
+    port->handshake = 1;
+    for (;;)
+    {
+        if (0 > smq_serial_parse(port))
+            break;
+        if (!port->in_frame && port->pos < port->len && port->buf[port->pos] == 'R')
+        {
+            port->pos++;
+            ret = 1;
+            break;
+        }
+        uint64_t now = smq_current_time();
+        int rc = (now < deadline) ? smq_serial_wait_input(port, deadline - now) : 0;
+        if (rc == 0)
+        {
+            port->errors++;
+            printf("Serial ready timeout (%u errors)\n", port->errors);
+        }
+        if (rc <= 0)
+            break;
+    }
+    port->handshake = 0;
+    return ret;
+}
+
+/* Wait until the window has room for another frame, parsing inbound frames meanwhile */
+static int smq_serial_wait_credit(smq_serial_port_t* port)
+{
+    while ((uint8_t)(port->tx_seq - port->tx_acked) >= port->window)
+    {
+        uint64_t now = smq_current_time();
+        uint64_t due = port->tx_time + SMQ_SERIAL_ACK_TIMEOUT_MS;
+        int rc = (now < due) ? smq_serial_wait_input(port, due - now) : 0;
+        if (rc < 0)
+            return 0;
+        if (rc == 0)
+            smq_serial_resend(port);
+        else if (0 > smq_serial_parse(port))
+            return 0;
+    }
+    return 1;
+}
+
+/* Start an outbound frame, waiting for the board's 'R' or for window credit */
+static int smsg_frame_begin(smq_serial_port_t* port)
+{
+    if (port->window != 0)
+    {
+        if (!smq_serial_wait_credit(port))
+            return 0;
+        smq_serial_begin(port);
+        uint8_t seq[2] = { SMQ_SERIAL_SEQ, port->tx_seq++ };
+        smq_send_raw_bytes(port->fd, seq, sizeof(seq));
+        return 1;
+    }
+    char delim = 'D';
+    smq_send_raw_bytes(port->fd, &delim, 1);
+    if (!smq_serial_wait_ready(port))
+        return 0;
+    smq_serial_begin(port);
+    return 1;
+}
+
+static void smsg_frame_end(smq_serial_port_t* port)
+{
+    smq_end(port->fd);
+    if (port->window == 0)
+    {
+        char ack = 'A';
+        smq_send_raw_bytes(port->fd, &ack, 1);
+    }
+    if (smq_serial_flush(port) != 0)
+    {
+        fprintf(stderr, "Serial frame not sent\n");
+    }
+}
+
+/* Forward an SMQ_ENCODING_TLV payload without going through JSON */
+static void smsg_send_tlv(smq_serial_port_t* port, uint16_t crc, const uint8_t* msg, size_t len)
+{
+    const uint8_t* key;
+    const uint8_t* val;
+    size_t val_len;
+    size_t pos = 0;
+    while (smq_tlv_next_pair(msg, len, &pos, &key, &val, &val_len))
     {
         // Check if this message is a broadcast or intented for a specific host
-        json_object* jdst = json_object_object_get(jobj, "_dst");
-        if (jdst != NULL && strcmp(json_object_get_string(jdst), smq_get_host()) != 0)
+        if (smq_tlv_key_is(key, "_dst") && val[0] == 0x00 && !smq_tlv_key_is(val, smq_get_host()))
+            return;
+    }
+    if (!smsg_frame_begin(port))
+        return;
+    smq_send_raw_bytes(port->fd, &crc, sizeof(crc));
+    pos = 0;
+    while (smq_tlv_next_pair(msg, len, &pos, &key, &val, &val_len))
+    {
+        if (smq_tlv_key_is(key, "_src") || smq_tlv_key_is(key, "_dst"))
         {
-            json_object_put(jobj);
-            jobj = NULL;
+            // don't serialize _src/_dst field
+            continue;
+        }
+        if (key[0] == 0x00)
+        {
+            uint8_t hash[3] = { 0x01 };
+            uint16_t keylen;
+            memcpy(&keylen, key + 3, sizeof(keylen));
+            uint16_t keycrc = ~smq_calc_crc(key + 7, keylen, ~0);
+            memcpy(hash + 1, &keycrc, sizeof(keycrc));
+            smq_send_raw_bytes(port->fd, hash, sizeof(hash));
+        }
+        else
+        {
+            smq_send_raw_bytes(port->fd, key, 3);
         }
+        smq_send_raw_bytes(port->fd, val, val_len);
+    }
+    smsg_frame_end(port);
+}
+
+// Per-topic plan for encoding JSON messages to serial: the key items of the last message by
+// position, and the encoded items of the last message to resend it as is
+
+typedef struct
+{
+    char* key;
+    size_t key_len;
+    char key_escaped;
+    /* _src/_dst, not sent to the board */
+    char skip;
+    uint8_t item[3];
+} smq_plan_key_t;
+
+typedef struct smq_encode_plan_t
+{
+    smq_plan_key_t* keys;
+    size_t key_count;
+    smq_buffer_t last_msg;
+    smq_buffer_t last_items;
+} smq_encode_plan_t;
+
+static void smq_encode_plan_free(smq_encode_plan_t* plan)
+{
+    if (plan == NULL)
+        return;
+    for (size_t i = 0; i < plan->key_count; i++)
+    {
+        free(plan->keys[i].key);
     }
-    if (jobj != NULL)
+    free(plan->keys);
+    free(plan->last_msg.data);
+    free(plan->last_items.data);
+    free(plan);
+}
+
+static smq_encode_plan_t* smq_topic_plan(smq_topic_t* topic)
+{
+    if (topic != NULL && topic->plan == NULL)
+    {
+        topic->plan = (smq_encode_plan_t*)calloc(1, sizeof(smq_encode_plan_t));
+    }
+    return (topic != NULL) ? topic->plan : NULL;
+}
+
+static void smq_plan_key_init(smq_plan_key_t* key, const smq_json_field_t* field)
+{
+    uint16_t crc = smq_json_key_hash(field);
+    key->skip = (crc == smq_string_hash("_src") || crc == smq_string_hash("_dst")) &&
+                (smq_json_key_is(field, "_src") || smq_json_key_is(field, "_dst"));
+    key->item[0] = 0x01;
+    memcpy(key->item + 1, &crc, sizeof(crc));
+}
+
+/* Hash item of the i-th key, NULL if the field is not sent */
+static const uint8_t* smq_plan_key(smq_encode_plan_t* plan, size_t i, const smq_json_field_t* field, smq_plan_key_t* scratch)
+{
+    smq_plan_key_t* key = scratch;
+    if (plan != NULL)
     {
-        char delim = 'D';
-        smq_send_raw_bytes(fd, &delim, 1);
-        for (;;)
+        if (i >= plan->key_count)
+        {
+            smq_plan_key_t* keys = (smq_plan_key_t*)realloc(plan->keys, (i + 1) * sizeof(*keys));
+            if (keys != NULL)
+            {
+                memset(keys + plan->key_count, 0, (i + 1 - plan->key_count) * sizeof(*keys));
+                plan->keys = keys;
+                plan->key_count = i + 1;
+            }
+        }
+        if (i < plan->key_count)
         {
-            int cnt = smsg_read(fd, &delim, 1);
-            // printf("smsg_read ");
-            if (delim == 'R')
+            key = &plan->keys[i];
+            if (key->key != NULL && key->key_len == field->key_len && key->key_escaped == field->key_escaped &&
+                memcmp(key->key, field->key, field->key_len) == 0)
+            {
+                return key->skip ? NULL : key->item;
+            }
+            char* copy = (char*)realloc(key->key, field->key_len + 1);
+            if (copy == NULL)
+            {
+                key = scratch;
+            }
+            else
             {
-                //printf("send CRC : 0x%04X\n", crc);
-                smq_send_raw_bytes(fd, &crc, sizeof(crc));
+                memcpy(copy, field->key, field->key_len);
+                key->key = copy;
+                key->key_len = field->key_len;
+                key->key_escaped = field->key_escaped;
+            }
+        }
+    }
+    smq_plan_key_init(key, field);
+    return key->skip ? NULL : key->item;
+}
 
-                json_object_object_foreach(jobj, key, val)
-                {
-                    int val_type = json_object_get_type(val);
-                    do
-                    {
-                        if (strcmp(key, "_src") == 0 || strcmp(key, "_dst") == 0)
-                        {
-                            // don't serialize _src/_dst field
-                            continue;
-                        }
-                        switch (val_type)
-                        {
-                            case json_type_null:
-                                smq_send_string_hash(fd, key);
-                                smq_send_null(fd);
-                                break;
-                            case json_type_boolean:
-                                smq_send_string_hash(fd, key);
-                                smq_send_boolean(fd, json_object_get_boolean(val));
-                                break;
-                            case json_type_double:
-                                smq_send_string_hash(fd, key);
-                                smq_send_float(fd, json_object_get_double(val));
-                                break;
-                            case json_type_int:
-                                smq_send_string_hash(fd, key);
-                                smq_send_int32(fd, json_object_get_int(val));
-                                break;
-                            case json_type_string:
-                                smq_send_string_hash(fd, key);
-                                smq_send_string(fd, json_object_get_string(val));
-                                break;
-                            case json_type_object:
-                                break;
-                            case json_type_array:
-                                // Support int array as byte-buffer
-                                break;
-                        }
-                    }
-                    while (0);
-                }
-                smq_end(fd);
-                char ready = 'A';
-                if (write(fd, &ready, 1) != 1)
-                {
-                    printf("FAIL\n");
-                }
+/* Bytes of an array of integers, as smq_tlv_to_json writes buffers. Negative values
+   are accepted for older peers that wrote bytes as signed chars */
+static int smq_json_bytes(const smq_json_field_t* field, smq_buffer_t* bytes)
+{
+    const char* p = field->value + 1;
+    const char* end = field->value + field->value_len - 1;
+    bytes->len = 0;
+    for (;;)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            p++;
+        if (p >= end)
+            break;
+        char* next;
+        long val = strtol(p, &next, 10);
+        if (next == p || next > end || val < -128 || val > 255 || bytes->len == 0xFFFF)
+            return 0;
+        uint8_t byte = (uint8_t)val;
+        if (!smq_buffer_append(bytes, &byte, sizeof(byte)))
+            return 0;
+        for (p = next; p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'); p++) {}
+        if (p < end && *p++ != ',')
+            return 0;
+    }
+    return 1;
+}
+
+/* JSON string value as a string item, unescaped only when it has to be */
+static void smq_send_json_string(int fd, const char* text, size_t len, char escaped)
+{
+    char buf[256];
+    char* unescaped = NULL;
+    if (escaped)
+    {
+        unescaped = (len < sizeof(buf)) ? buf : (char*)malloc(len + 1);
+        len = smq_json_unescape(text, len, unescaped, len + 1);
+        text = unescaped;
+    }
+    uint8_t delim = 0x00;
+    smq_send_raw_bytes(fd, &delim, sizeof(delim));
+    uint16_t len16 = len;
+    smq_send_data(fd, &len16, sizeof(len16));
+    smq_send_data(fd, text, len16);
+    if (unescaped != NULL && unescaped != buf)
+        free(unescaped);
+}
+
+/* Scratch for smq_json_bytes */
+static smq_buffer_t json_bytes;
+
+static void smsg_callback(const char * topic_name, const uint8_t * msg, size_t len, void* arg)
+{
+    int fd = smsg_callback_fd;
+    uint16_t crc = message_topic_hash;
+    if (smq_message_encoding() == SMQ_ENCODING_TLV)
+    {
+        smq_serial_port_t* port = smq_serial_port(fd);
+        if (port != NULL)
+            smsg_send_tlv(port, crc, msg, len);
+        return;
+    }
+    printf("%s : %.*s\n", topic_name, (int)len, msg);
+    smq_serial_port_t* port = smq_serial_port(fd);
+    if (port == NULL)
+        return;
+    smq_encode_plan_t* plan = smq_topic_plan(smq_topic_hashed(&subscribed_topics, crc, sizeof(crc)));
+    if (plan != NULL && plan->last_msg.len == len && len != 0 && memcmp(plan->last_msg.data, msg, len) == 0)
+    {
+        /* Same content as the previous message, the items are already encoded */
+        if (smsg_frame_begin(port))
+        {
+            smq_send_raw_bytes(fd, &crc, sizeof(crc));
+            smq_send_raw_bytes(fd, plan->last_items.data, plan->last_items.len);
+            smsg_frame_end(port);
+        }
+        return;
+    }
+    /* Fields are shared with the other callbacks of this delivery */
+    const smq_json_field_t* fields;
+    size_t count;
+    if (!smq_message_fields(&fields, &count))
+        return;
+    // Check if this message is a broadcast or intented for a specific host
+    const smq_json_field_t* dst = smq_message_field("_dst");
+    if (dst != NULL && !smq_json_string_is(dst, smq_get_host()))
+        return;
+    if (!smsg_frame_begin(port))
+        return;
+    //printf("send CRC : 0x%04X\n", crc);
+    smq_send_raw_bytes(fd, &crc, sizeof(crc));
+    size_t items_start = port->out.len;
+    for (size_t i = 0; i < count; i++)
+    {
+        const smq_json_field_t* field = &fields[i];
+        smq_plan_key_t scratch = { NULL };
+        const uint8_t* key = smq_plan_key(plan, i, field, &scratch);
+        if (key == NULL)
+        {
+            // don't serialize _src/_dst field
+            continue;
+        }
+        switch (field->type)
+        {
+            case SMQ_JSON_NULL:
+                smq_send_raw_bytes(fd, key, 3);
+                smq_send_null(fd);
                 break;
-            }
-            else if (delim == 0x00 || delim == 0x01)
+            case SMQ_JSON_BOOLEAN:
+                smq_send_raw_bytes(fd, key, 3);
+                smq_send_boolean(fd, smq_json_boolean(field));
+                break;
+            case SMQ_JSON_DOUBLE:
+                smq_send_raw_bytes(fd, key, 3);
+                smq_send_float(fd, smq_json_double(field));
+                break;
+            case SMQ_JSON_INT:
             {
-                smq_process_serial(fd, delim);
+                /* Clamped like json_object_get_int */
+                int64_t val = smq_json_int(field);
+                smq_send_raw_bytes(fd, key, 3);
+                if (val > 2147483647)
+                    val = 2147483647;
+                else if (val < -2147483647 - 1)
+                    val = -2147483647 - 1;
+                smq_send_int32(fd, (int32_t)val);
+                break;
             }
+            case SMQ_JSON_STRING:
+                smq_send_raw_bytes(fd, key, 3);
+                smq_send_json_string(fd, field->value, field->value_len, field->value_escaped);
+                break;
+            case SMQ_JSON_OBJECT:
+                break;
+            case SMQ_JSON_ARRAY:
+                /* Int arrays are byte buffers */
+                if (smq_json_bytes(field, &json_bytes))
+                {
+                    smq_send_raw_bytes(fd, key, 3);
+                    smq_send_buffer(fd, json_bytes.data, json_bytes.len);
+                }
+                break;
+        }
+    }
+    if (plan != NULL && serial_out_port == port && !port->out_failed)
+    {
+        plan->last_msg.len = 0;
+        plan->last_items.len = 0;
+        if (!smq_buffer_append(&plan->last_msg, msg, len) ||
+            !smq_buffer_append(&plan->last_items, port->out.data + items_start, port->out.len - items_start))
+        {
+            plan->last_msg.len = 0;
         }
-        json_object_put(jobj);
-        jobj = NULL;
     }
-    json_tokener_free(tok);
+    smsg_frame_end(port);
 }
 
 /// -----------------------------------------
@@ -2238,6 +5988,26 @@ int smq_reset_serial(int fd)
     return 0;
 }
 
+#ifdef __linux__
+/* termios2 from <asm/termbits.h>, which cannot be included next to <termios.h> */
+struct smq_termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+#define SMQ_TCGETS2 _IOR('T', 0x2A, struct smq_termios2)
+#define SMQ_TCSETS2 _IOW('T', 0x2B, struct smq_termios2)
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#endif
+
 static speed_t serial_baud_lookup(long baud)
 {
     struct baud_mapping
@@ -2256,6 +6026,24 @@ static speed_t serial_baud_lookup(long baud)
         { 57600,  B57600 },
         { 115200, B115200 },
         { 230400, B230400 },
+#ifdef B460800
+        { 460800, B460800 },
+#endif
+#ifdef B921600
+        { 921600, B921600 },
+#endif
+#ifdef B1000000
+        { 1000000, B1000000 },
+#endif
+#ifdef B1500000
+        { 1500000, B1500000 },
+#endif
+#ifdef B2000000
+        { 2000000, B2000000 },
+#endif
+#ifdef B3000000
+        { 3000000, B3000000 },
+#endif
         { 0,      0 }                 /* Terminator. */
     };
     for (struct baud_mapping *map = baud_lookup_table; map->baud; map++)
@@ -2263,20 +6051,68 @@ static speed_t serial_baud_lookup(long baud)
         if (map->baud == baud)
             return map->speed;
     }
-    return baud;
+    return 0;
+}
+
+/* Set a rate that has no Bxxx constant */
+static int serial_set_custom_baud(int fd, unsigned baud)
+{
+#if defined(__linux__)
+    struct smq_termios2 tio2;
+    if (ioctl(fd, SMQ_TCGETS2, &tio2) != 0)
+        return -1;
+    tio2.c_cflag &= ~CBAUD;
+    tio2.c_cflag |= BOTHER;
+    tio2.c_ispeed = baud;
+    tio2.c_ospeed = baud;
+    return ioctl(fd, SMQ_TCSETS2, &tio2);
+#elif defined(__APPLE__)
+    speed_t speed = baud;
+    return ioctl(fd, IOSSIOSPEED, &speed);
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+static int serial_set_low_latency(int fd)
+{
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) != 0)
+        return -1;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serial);
+#else
+    return -1;
+#endif
+}
+
+void smq_serial_config_init(smq_serial_config_t* config)
+{
+    memset(config, 0, sizeof(*config));
+    config->baud = 115200;
+    config->vmin = 1;
 }
 
 int smq_open_serial(const char* serial_port, unsigned baud, char blocking)
+{
+    smq_serial_config_t config;
+    smq_serial_config_init(&config);
+    if (baud != 0)
+        config.baud = baud;
+    config.vmin = (blocking) ? 1 : 0;
+    return smq_open_serial_config(serial_port, &config);
+}
+
+int smq_open_serial_config(const char* serial_port, const smq_serial_config_t* config)
 {
     int fd;
     int rc;
     struct termios termios;
     const char* sport = (serial_port != NULL) ? serial_port : "/dev/ttyUSB0";
-    speed_t speed = serial_baud_lookup((baud != 0) ? baud : 115200);
-    if (speed == 0)
-    {
-        // Non-standard speed
-    }
+    unsigned baud = (config->baud != 0) ? config->baud : 115200;
+    speed_t speed = serial_baud_lookup(baud);
 
 #ifdef __APPLE__
     fd = open(sport, O_RDWR | O_NOCTTY | O_NONBLOCK);
@@ -2313,13 +6149,14 @@ int smq_open_serial(const char* serial_port, unsigned baud, char blocking)
     termios.c_cc[VMIN]  = 1;
     termios.c_cc[VTIME] = 0;
 
-    rc = cfsetospeed(&termios, speed);
+    /* Non-standard rates are set after tcsetattr */
+    rc = cfsetospeed(&termios, (speed != 0) ? speed : B115200);
     if (rc == -1)
     {
         close(fd);
         return -1;
     }
-    rc = cfsetispeed(&termios, speed);
+    rc = cfsetispeed(&termios, (speed != 0) ? speed : B115200);
     if (rc == -1)
     {
         close(fd);
@@ -2329,8 +6166,11 @@ int smq_open_serial(const char* serial_port, unsigned baud, char blocking)
     termios.c_cflag &= ~CSIZE;
     termios.c_cflag |= CS8;
 
-    // No flow control
-    termios.c_cflag &= ~CRTSCTS;
+    // Optional RTS/CTS flow control, never software flow control
+    if (config->flow_control)
+        termios.c_cflag |= CRTSCTS;
+    else
+        termios.c_cflag &= ~CRTSCTS;
     termios.c_iflag &= ~(IXON | IXOFF | IXANY);
 
     // 1 stop bit
@@ -2344,11 +6184,10 @@ int smq_open_serial(const char* serial_port, unsigned baud, char blocking)
     termios.c_oflag = 0;
     termios.c_lflag = 0;
 
-    /* Control characters */
-    termios.c_cc[VTIME] = 0; // Inter-character timer unused
-    termios.c_cc[VMIN]  = 0; // Non-Blocking
-    if (blocking)
-        termios.c_cc[VMIN]  = 1; // Blocking read until 1 character received
+    /* Control characters: VMIN 0 is non-blocking, otherwise a read waits for
+       VMIN bytes or VTIME tenths of a second after the first one */
+    termios.c_cc[VTIME] = config->vtime;
+    termios.c_cc[VMIN]  = config->vmin;
 
     rc = tcsetattr(fd, TCSANOW, &termios);
     if (rc == -1)
@@ -2356,12 +6195,22 @@ int smq_open_serial(const char* serial_port, unsigned baud, char blocking)
         close(fd);
         return -1;
     }
+    if (speed == 0 && serial_set_custom_baud(fd, baud) != 0)
+    {
+        fprintf(stderr, "Unsupported baud rate %u\n", baud);
+        close(fd);
+        return -1;
+    }
+    if (config->low_latency && serial_set_low_latency(fd) != 0)
+    {
+        fprintf(stderr, "Low latency mode not supported on %s\n", sport);
+    }
     return fd;
 }
 
 int smq_available(int fd)
 {
-    return (poll_items_count > 1 && poll_items[2].revents & ZMQ_POLLIN);
+    return (poll_items_count > SMQ_POLL_SERIAL && poll_items[SMQ_POLL_SERIAL].revents & ZMQ_POLLIN);
 }
 
 void smq_register_fd(int fd)
@@ -2376,13 +6225,27 @@ void smq_unregister_fd(int fd)
 
 int smq_subscribe_serial(const char* serial_port, unsigned baud)
 {
-    int fd = smq_open_serial(serial_port, baud, 1);
+    smq_serial_config_t config;
+    smq_serial_config_init(&config);
+    if (baud != 0)
+        config.baud = baud;
+    return smq_subscribe_serial_config(serial_port, &config);
+}
+
+int smq_subscribe_serial_config(const char* serial_port, const smq_serial_config_t* config)
+{
+    int fd = smq_open_serial_config(serial_port, config);
     if (fd == -1)
     {
         fprintf(stderr, "Failed to initialize SMQ serial port : %s\n", serial_port);
         return -1;
     }
     zmq_subscribe_serial = 1;
+    if (smq_serial_port(fd) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
     smq_reset_serial(fd);
     sleep(1);
 
@@ -2392,6 +6255,12 @@ int smq_subscribe_serial(const char* serial_port, unsigned baud)
     {
         printf("Ready\n");
     }
+    if (smq_serial_window() != 0)
+    {
+        /* Offer windowed mode, firmware that does not know it ignores the offer */
+        uint8_t hello[2] = { SMQ_SERIAL_HELLO, smq_serial_window() };
+        smq_send_raw_bytes(fd, hello, sizeof(hello));
+    }
     sleep(1);
     return fd;
 }
@@ -2401,6 +6270,7 @@ int smq_close_serial(int fd)
     if (fd != -1)
     {
         unregister_file_descriptor(fd);
+        smq_serial_port_release(fd);
         return close(fd);
     }
     return -1;
@@ -38,18 +38,84 @@ typedef struct smsg_t
     jmp_buf jmp;
 } smsg_t;
 
+typedef struct smsg_writer_t
+{
+    uint8_t* buf;
+    uint8_t* pos;
+    uint8_t* bufend;
+    jmp_buf jmp;
+} smsg_writer_t;
+
+typedef struct smq_json_t
+{
+    const char* pos;
+    const char* end;
+    char first;
+    char done;
+    char error;
+} smq_json_t;
+
+typedef struct smq_json_field_t
+{
+    const char* key;        /* raw text, not NUL terminated */
+    size_t key_len;
+    const char* value;      /* string contents without the quotes, raw text otherwise */
+    size_t value_len;
+    int type;
+    char key_escaped;       /* text contains escapes, see smq_json_unescape */
+    char value_escaped;
+} smq_json_field_t;
+
 // --------------------------------------------------
 
+/* Payload encodings, see smq_message_encoding */
+#define SMQ_ENCODING_JSON 0
+#define SMQ_ENCODING_TLV  1     /* serial typed items, as sent by smq_subscribe_serial boards */
+
+/* Payload compression of a published topic, see smq_set_compression */
+#define SMQ_COMPRESSION_NONE 0
+#define SMQ_COMPRESSION_LZ4  1
+#define SMQ_COMPRESSION_ZSTD 2
+
+/* Field types of smq_json_next, in json-c's json_type order */
+#define SMQ_JSON_NULL    0
+#define SMQ_JSON_BOOLEAN 1
+#define SMQ_JSON_DOUBLE  2
+#define SMQ_JSON_INT     3
+#define SMQ_JSON_OBJECT  4
+#define SMQ_JSON_ARRAY   5
+#define SMQ_JSON_STRING  6
+
 typedef void (smq_msg_callback_t)(const char* topic_name, const uint8_t* msg, size_t len, void* arg);
 typedef void (smq_timer_callback_t)(void* arg);
 
 // --------------------------------------------------
 // smsg - serial message: messages to and from serial
+//
+// Readers decode typed items in place from a SMQ_ENCODING_TLV payload.
+// A missing, truncated or mismatched item longjmps to smsg->jmp:
+//
+//     smsg_t smsg;
+//     smsg_init(&smsg, msg, len);
+//     if (setjmp(smsg.jmp) == 0)
+//     {
+//         uint16_t key = smsg_read_hash(&smsg);
+//         int32_t val = smsg_read_int32(&smsg);
+//         ...
+//     }
+//
+// Strings and buffers point into the payload and are not NUL terminated.
+
+void smsg_init(smsg_t* smsg, const uint8_t* msg, size_t len);
 
 void smsg_failed(smsg_t* smsg);
 
 void smsg_complete(smsg_t* smsg);
 
+int smsg_peek_type(smsg_t* smsg);
+
+void smsg_skip(smsg_t* smsg);
+
 int8_t smsg_read_int8(smsg_t* smsg);
 
 int16_t smsg_read_int16(smsg_t* smsg);
@@ -62,6 +128,93 @@ uint16_t smsg_read_uint16(smsg_t* smsg);
 
 uint32_t smsg_read_uint32(smsg_t* smsg);
 
+float smsg_read_float(smsg_t* smsg);
+
+double smsg_read_double(smsg_t* smsg);
+
+char smsg_read_boolean(smsg_t* smsg);
+
+const char* smsg_read_string(smsg_t* smsg, size_t* len);
+
+const uint8_t* smsg_read_buffer(smsg_t* smsg, size_t* len);
+
+uint16_t smsg_read_hash(smsg_t* smsg);
+// Writers encode into a caller supplied buffer, overflow or a string over 65535 bytes longjmps to writer->jmp
+// Writers encode into a caller supplied buffer, overflow longjmps to writer->jmp
+
+void smsg_writer_init(smsg_writer_t* writer, uint8_t* buf, size_t size);
+
+size_t smsg_writer_len(smsg_writer_t* writer);
+
+void smsg_write_int8(smsg_writer_t* writer, int8_t val);
+
+void smsg_write_int16(smsg_writer_t* writer, int16_t val);
+
+void smsg_write_int32(smsg_writer_t* writer, int32_t val);
+
+void smsg_write_uint8(smsg_writer_t* writer, uint8_t val);
+
+void smsg_write_uint16(smsg_writer_t* writer, uint16_t val);
+
+void smsg_write_uint32(smsg_writer_t* writer, uint32_t val);
+
+void smsg_write_float(smsg_writer_t* writer, float val);
+
+void smsg_write_double(smsg_writer_t* writer, double val);
+
+void smsg_write_boolean(smsg_writer_t* writer, char val);
+
+void smsg_write_null(smsg_writer_t* writer);
+
+void smsg_write_string(smsg_writer_t* writer, const char* str);
+
+/* A string of known length, such as a fixed char array that may lack the terminator */
+void smsg_write_string_len(smsg_writer_t* writer, const char* str, uint16_t len);
+
+void smsg_write_buffer(smsg_writer_t* writer, const void* buf, uint16_t len);
+
+void smsg_write_hash(smsg_writer_t* writer, const char* str);
+
+void smsg_write_raw(smsg_writer_t* writer, const void* items, size_t len);
+
+void smsg_write_end(smsg_writer_t* writer);
+
+// --------------------------------------------------
+// smq_json - iterate the fields of a JSON object message in place
+//
+//     smq_json_t json;
+//     smq_json_field_t field;
+//     smq_json_init(&json, msg, len);
+//     while (smq_json_next(&json, &field))
+//     {
+//         if (smq_json_key_is(&field, "speed"))
+//             speed = smq_json_double(&field);
+//     }
+//     if (smq_json_failed(&json))
+//         ...
+//
+// Nested objects and arrays are returned whole as their raw text.
+
+void smq_json_init(smq_json_t* json, const uint8_t* msg, size_t len);
+
+int smq_json_next(smq_json_t* json, smq_json_field_t* field);
+
+int smq_json_failed(smq_json_t* json);
+
+int smq_json_key_is(const smq_json_field_t* field, const char* key);
+
+int smq_json_string_is(const smq_json_field_t* field, const char* str);
+
+uint16_t smq_json_key_hash(const smq_json_field_t* field);
+
+int smq_json_boolean(const smq_json_field_t* field);
+
+int64_t smq_json_int(const smq_json_field_t* field);
+
+double smq_json_double(const smq_json_field_t* field);
+
+size_t smq_json_unescape(const char* str, size_t len, char* buf, size_t size);
+
 // ----------------------------------------
 
 uint16_t smq_calc_crc(const void* buf, size_t len, uint16_t crc);
@@ -90,10 +243,40 @@ int smq_subscribe_hash(const char* topic_name, smq_msg_callback_t* callback, voi
 
 int smq_subscribe_all(smq_msg_callback_t* callback, void* arg);
 
+int smq_subscribe_binary(const char* topic_name, smq_msg_callback_t* callback, void* arg);
+
+int smq_subscribe_hash_binary(const char* topic_name, smq_msg_callback_t* callback, void* arg);
+
+int smq_message_encoding();
+
+/* The message of the running callback, decoded once and shared by every callback it is
+   delivered to. Only valid inside the callback, the json object must not be released. */
+struct json_object* smq_message_json();
+
+const smq_json_field_t* smq_message_field(const char* key);
+
+int smq_message_fields(const smq_json_field_t** fields, size_t* count);
+
 int smq_publish(const char* topic_name, const uint8_t * msg, size_t len);
 
 int smq_publish_hash(const char* topicName, const uint8_t *msg, size_t len);
 
+/* Publish an SMQ_ENCODING_TLV payload, see smsg_writer_init */
+int smq_publish_binary(const char* topic_name, const uint8_t* msg, size_t len);
+
+int smq_publish_hash_binary(const char* topicName, const uint8_t *msg, size_t len);
+
+/* Messages of an advertised topic are compressed from now on, except below SMQ_COMPRESS_MIN
+   bytes (default 256) or when it does not pay off. Subscribers must support compression.
+   Returns 0 for a codec libsmq was built without, see SMQ_WITH_LZ4 and SMQ_WITH_ZSTD. */
+int smq_set_compression(const char* topic_name, int compression);
+
+/* JSON object messages of an advertised topic are sent as the fields that changed since the
+   previous one, with the whole message every keyframe_interval messages, at least once a second
+   and for new subscribers. Subscribers rebuild whole messages and must support delta encoding,
+   after a lost message they get none until the next keyframe. 0 turns it off. */
+int smq_set_delta(const char* topic_name, unsigned keyframe_interval);
+
 int smq_timer(smq_timer_callback_t* callback, long period_ms, void* arg);
 
 int smq_clear_timer();
@@ -104,18 +287,43 @@ int smq_wait();
 
 int smq_wait_for(long millis);
 
+int smq_wait_for_subscribers(const char* topic_name, int min_count, long timeout_ms);
+
+int smq_wait_for_subscribers_hash(const char* topic_name, int min_count, long timeout_ms);
+
+unsigned smq_topic_collision_count();
+
 // ----------------------------------------
 
+typedef struct
+{
+    unsigned baud;          /* any rate, non-standard ones use BOTHER/IOSSIOSPEED */
+    char flow_control;      /* RTS/CTS hardware flow control */
+    char low_latency;       /* ASYNC_LOW_LATENCY where the driver supports it */
+    uint8_t vmin;           /* read coalescing, see termios VMIN/VTIME */
+    uint8_t vtime;
+} smq_serial_config_t;
+
+void smq_serial_config_init(smq_serial_config_t* config);
+
 int smq_open_serial(const char* serial_port, unsigned speed, char blocking);
 
+int smq_open_serial_config(const char* serial_port, const smq_serial_config_t* config);
+
 int smq_close_serial(int fd);
 
 int smq_reset_serial(int fd);
 
 int smq_subscribe_serial(const char* serial_port, unsigned speed);
 
+int smq_subscribe_serial_config(const char* serial_port, const smq_serial_config_t* config);
+
 int smq_process_serial(int fd, uint8_t);
 
+/* Errors on a port: corrupted frames, sequence gaps and frames given up on. Windowed
+   boards resend unacked frames go-back-N, up to 3 times; the legacy handshake does not. */
+unsigned smq_serial_error_count(int fd);
+
 int smq_unsubscribe_serial(int fd);
 
 void smq_register_fd(int fd);
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "smq.h"
+#include "smq_private.h"
+
+#define SMQ_DISCD_PEER_TTL_MS 60000
+
+/* Per-host discovery daemon: owns the discovery sockets and answers for local processes */
+
+
+static smq_peer_list_t discd_peers;
+
+static int discd_is_local_guid(uuid_t guid)
+{
+    for (smq_peer_t* peer = discd_peers.first; peer != 0; peer = peer->next)
+    {
+        if (peer->fd != -1 && smq_guid_compare(peer->guid, guid))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Remote publishers are only known from their ADVs, forget them once those stop */
+static void discd_expire_peers()
+{
+    uint64_t now = smq_current_time();
+    smq_peer_t* peer = discd_peers.first;
+    while (peer != 0)
+    {
+        smq_peer_t* next = peer->next;
+        if (peer->fd == -1 && now - peer->seen_time > SMQ_DISCD_PEER_TTL_MS)
+        {
+            smq_peer_list_remove(&discd_peers, peer);
+        }
+        peer = next;
+    }
+}
+
+/* A publisher restarting on the same host comes back with a new GUID, drop its old endpoint */
+static void discd_remove_host_topic(const char* host, const char* topic, uuid_t guid)
+{
+    smq_peer_t* peer = discd_peers.first;
+    while (peer != 0)
+    {
+        smq_peer_t* next = peer->next;
+        if (peer->type == SMQ_OP_ADV && peer->fd == -1 && !smq_guid_compare(peer->guid, guid) &&
+            0 == strcmp(peer->host, host) && 0 == strcmp(peer->topic, topic))
+        {
+            smq_peer_list_remove(&discd_peers, peer);
+        }
+        peer = next;
+    }
+}
+
+static void discd_send_client(int fd, const uint8_t* buffer, size_t len)
+{
+    if (0 > send(fd, buffer, len, MSG_NOSIGNAL))
+    {
+        perror("Error sending to discovery client");
+    }
+}
+
+/* Forward an ADV to every local process subscribed to its topic */
+static void discd_notify_subscribers(int from_fd, const char* topic, const uint8_t* buffer, size_t len)
+{
+    for (smq_peer_t* peer = discd_peers.first; peer != 0; peer = peer->next)
+    {
+        if (peer->type == SMQ_OP_SUB && peer->fd != -1 && peer->fd != from_fd && 0 == strcmp(peer->topic, topic))
+        {
+            discd_send_client(peer->fd, buffer, len);
+        }
+    }
+}
+
+static void discd_handle_client(int fd, uint8_t* buffer, size_t len)
+{
+    smq_msg_header_t header;
+    size_t header_size = smq_deserialize_msg_header(&header, buffer, len);
+    if (header_size == 0)
+    {
+        fprintf(stderr, "Ignoring malformed message from discovery client %d\n", fd);
+        return;
+    }
+    if (header.type == SMQ_OP_ADV)
+    {
+        smq_adv_msg_t adv_msg;
+        if (0 == smq_deserialize_adv_msg(&adv_msg, buffer + header_size, len - header_size))
+        {
+            fprintf(stderr, "Ignoring malformed ADV from discovery client %d\n", fd);
+            return;
+        }
+        smq_peer_t* peer = smq_peer_in_list(&discd_peers, SMQ_OP_ADV, header.guid, header.topic);
+        if (peer == 0)
+        {
+            peer = smq_peer_list_append(&discd_peers, SMQ_OP_ADV, fd, header.guid, header.topic, adv_msg.addr);
+        }
+        else
+        {
+            snprintf(peer->addr, SMQ_MAX_ADDR_LENGTH, "%s", adv_msg.addr);
+        }
+        if (peer != 0)
+        {
+            snprintf(peer->ipc_addr, SMQ_MAX_ADDR_LENGTH, "%s", adv_msg.ipc_addr);
+        }
+        printf("Local ADV '%s' %s\n", header.topic, adv_msg.addr);
+        discd_notify_subscribers(fd, header.topic, buffer, len);
+        smq_sendto_bcast(buffer, len);
+    }
+    else if (header.type == SMQ_OP_SUB)
+    {
+        if (0 == smq_peer_in_list(&discd_peers, SMQ_OP_SUB, header.guid, header.topic))
+        {
+            smq_peer_list_append(&discd_peers, SMQ_OP_SUB, fd, header.guid, header.topic, "");
+        }
+        printf("Local SUB '%s'\n", header.topic);
+        discd_expire_peers();
+        /* Answer immediately with every endpoint we already know about */
+        for (smq_peer_t* peer = discd_peers.first; peer != 0; peer = peer->next)
+        {
+            if (peer->type == SMQ_OP_ADV && peer->fd != fd && 0 == strcmp(peer->topic, header.topic))
+            {
+                uint8_t adv_buffer[SMQ_UDP_MAX_SIZE];
+                size_t adv_len = smq_build_adv_msg(adv_buffer, peer->guid, peer->topic, peer->addr, peer->ipc_addr);
+                discd_send_client(fd, adv_buffer, adv_len);
+            }
+        }
+        /* Ask the network too, with replies directed at the daemon */
+        uint16_t reply_port = smq_network_reply_port();
+        memcpy(header.flags + SMQ_FLAG_REPLY_PORT, &reply_port, sizeof(reply_port));
+        size_t sub_len = smq_serialize_msg_header(buffer, &header);
+        smq_sendto_bcast(buffer, sub_len);
+    }
+}
+
+static void discd_handle_network(uint8_t* buffer, size_t len, const struct sockaddr_in* src_addr)
+{
+    smq_msg_header_t header;
+    size_t header_size = smq_deserialize_msg_header(&header, buffer, len);
+    if (header_size == 0 || discd_is_local_guid(header.guid))
+    {
+        /* Ignore our own broadcasts */
+        return;
+    }
+    if (header.type == SMQ_OP_ADV)
+    {
+        smq_adv_msg_t adv_msg;
+        if (0 == smq_deserialize_adv_msg(&adv_msg, buffer + header_size, len - header_size))
+        {
+            return;
+        }
+        discd_expire_peers();
+        /* The host id only comes with the ipc trailer, the endpoint address stands in without it */
+        char host[SMQ_MAX_ADDR_LENGTH];
+        snprintf(host, sizeof(host), "%s", adv_msg.host_id[0] != '\0' ? adv_msg.host_id : adv_msg.addr);
+        char* port_sep = strrchr(host, ':');
+        if (adv_msg.host_id[0] == '\0' && port_sep != NULL)
+        {
+            *port_sep = '\0';
+        }
+        discd_remove_host_topic(host, header.topic, header.guid);
+        smq_peer_t* peer = smq_peer_in_list(&discd_peers, SMQ_OP_ADV, header.guid, header.topic);
+        if (peer == 0)
+        {
+            peer = smq_peer_list_append(&discd_peers, SMQ_OP_ADV, -1, header.guid, header.topic, adv_msg.addr);
+        }
+        else
+        {
+            snprintf(peer->addr, SMQ_MAX_ADDR_LENGTH, "%s", adv_msg.addr);
+        }
+        if (peer != 0)
+        {
+            snprintf(peer->host, SMQ_MAX_ADDR_LENGTH, "%s", host);
+            peer->seen_time = smq_current_time();
+        }
+        discd_notify_subscribers(-1, header.topic, buffer, len);
+    }
+    else if (header.type == SMQ_OP_SUB)
+    {
+        /* Answer for every local publisher of the topic */
+        for (smq_peer_t* peer = discd_peers.first; peer != 0; peer = peer->next)
+        {
+            if (peer->type == SMQ_OP_ADV && peer->fd != -1 && 0 == strcmp(peer->topic, header.topic))
+            {
+                struct sockaddr_in reply_addr;
+                if (!smq_adv_reply_addr(&header, src_addr, peer->adv_replies, &reply_addr))
+                {
+                    continue;
+                }
+                uint8_t adv_buffer[SMQ_UDP_MAX_SIZE];
+                size_t adv_len = smq_build_adv_msg(adv_buffer, peer->guid, peer->topic, peer->addr, peer->ipc_addr);
+                if (0 >= sendto(smq_network_fd(SMQ_NETWORK_BCAST), adv_buffer, adv_len, 0, (struct sockaddr *) &reply_addr, sizeof(reply_addr)))
+                {
+                    fprintf(stderr, "Error sending ADV message to %s\n", inet_ntoa(reply_addr.sin_addr));
+                }
+            }
+        }
+    }
+}
+
+/* Broadcast every local publisher, used when the daemon gets a new address */
+static void discd_announce_local()
+{
+    for (smq_peer_t* peer = discd_peers.first; peer != 0; peer = peer->next)
+    {
+        if (peer->type == SMQ_OP_ADV && peer->fd != -1)
+        {
+            uint8_t adv_buffer[SMQ_UDP_MAX_SIZE];
+            size_t adv_len = smq_build_adv_msg(adv_buffer, peer->guid, peer->topic, peer->addr, peer->ipc_addr);
+            smq_sendto_bcast(adv_buffer, adv_len);
+        }
+    }
+}
+
+static void discd_remove_client(int fd)
+{
+    smq_peer_t* peer = discd_peers.first;
+    while (peer != 0)
+    {
+        smq_peer_t* next = peer->next;
+        if (peer->fd == fd)
+        {
+            smq_peer_list_remove(&discd_peers, peer);
+        }
+        peer = next;
+    }
+    close(fd);
+}
+
+static int smq_discoveryd(const char* socket_path)
+{
+    const char* path = (socket_path != NULL) ? socket_path : smq_discoveryd_path();
+    if (!smq_network_start())
+    {
+        printf("Waiting for IPv4 address.\n");
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (0 > listen_fd)
+    {
+        fprintf(stderr, "Error opening discovery daemon socket\n");
+        return 0;
+    }
+    unlink(path);
+    if (0 > bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || 0 > listen(listen_fd, 16))
+    {
+        fprintf(stderr, "Error binding discovery daemon socket '%s'\n", path);
+        close(listen_fd);
+        return 0;
+    }
+    chmod(path, 0666);
+    printf("Discovery daemon listening on %s\n", path);
+
+    struct pollfd fds[SMQ_MAX_POLL_ITEMS];
+    int clients[SMQ_MAX_POLL_ITEMS];
+    size_t clients_count = 0;
+    for (;;)
+    {
+        fds[0].fd = listen_fd;
+        fds[1].fd = smq_network_fd(SMQ_NETWORK_BCAST);
+        fds[2].fd = smq_network_fd(SMQ_NETWORK_UCAST);
+        fds[3].fd = smq_network_fd(SMQ_NETWORK_NETLINK);
+        for (size_t i = 0; i < clients_count; i++)
+        {
+            fds[4 + i].fd = clients[i];
+        }
+        for (size_t i = 0; i < 4 + clients_count; i++)
+        {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        int timeout = (!smq_network_ready() && fds[3].fd == -1) ? SMQ_ADDR_RETRY_MS : -1;
+        int rc = poll(fds, 4 + clients_count, timeout);
+        if (0 > rc)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error in poll on discovery daemon");
+            break;
+        }
+        if ((rc == 0 && !smq_network_ready()) || ((fds[3].revents & POLLIN) && smq_netlink_changed()))
+        {
+            if (smq_network_rebind())
+                discd_announce_local();
+            continue;
+        }
+        uint8_t buffer[SMQ_UDP_MAX_SIZE];
+        for (int i = 1; i <= 2; i++)
+        {
+            if (fds[i].revents & POLLIN)
+            {
+                struct sockaddr_in src_addr;
+                socklen_t len_src_addr = sizeof(src_addr);
+                int ret = recvfrom(fds[i].fd, buffer, SMQ_UDP_MAX_SIZE, 0, (struct sockaddr *) &src_addr, &len_src_addr);
+                if (ret > 0)
+                    discd_handle_network(buffer, ret, &src_addr);
+            }
+        }
+        for (size_t i = clients_count; i-- > 0;)
+        {
+            if (!(fds[4 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int ret = recv(clients[i], buffer, SMQ_UDP_MAX_SIZE, 0);
+            if (ret > 0)
+            {
+                discd_handle_client(clients[i], buffer, ret);
+            }
+            else
+            {
+                printf("Discovery client %d disconnected\n", clients[i]);
+                discd_remove_client(clients[i]);
+                clients[i] = clients[--clients_count];
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && clients_count >= SMQ_MAX_POLL_ITEMS - 4)
+            {
+                fprintf(stderr, "Too many discovery clients\n");
+                close(fd);
+            }
+            else if (fd >= 0)
+            {
+                clients[clients_count++] = fd;
+            }
+        }
+    }
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* path = (argc >= 2) ? argv[1] : NULL;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+    /* Run the per-host discovery daemon, only returns on error */
+    return smq_discoveryd(path) ? 0 : 1;
+}
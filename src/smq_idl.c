@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+ * Generates typed topics from a schema:
+ *
+ *   struct logic_effect
+ *   {
+ *       int32 state;
+ *   }
+ *   topic FLD logic_effect;
+ *   hash topic MARC marcduino;
+ *
+ * Field types are bool, int8, int16, int32, uint8, uint16, uint32, float,
+ * double, string[N] and buffer[N]. For each struct the output has a C
+ * struct <name>_t with TLV and JSON encoders and decoders, and for each
+ * topic smq_advertise_<topic>, smq_publish_<topic> (JSON, which every
+ * subscriber reads), smq_publish_<topic>_binary (TLV, opt-in) and
+ * smq_subscribe_<topic>.
+ *
+ * Keys are encoded once at generation time, so encoding a message is the
+ * key items copied as they are plus one typed value per field. Decoding
+ * switches on the 16-bit key hash.
+ *
+ * Runs on the build host, so it does not link libsmq: the key CRC is
+ * computed here and the key items are written for both byte orders.
+ */
+
+#define IDL_MAX_NAME    64
+#define IDL_MAX_FIELDS  64
+#define IDL_MAX_STRUCTS 64
+#define IDL_MAX_TOPICS  64
+
+enum
+{
+    IDL_BOOL,
+    IDL_INT8,
+    IDL_INT16,
+    IDL_INT32,
+    IDL_UINT8,
+    IDL_UINT16,
+    IDL_UINT32,
+    IDL_FLOAT,
+    IDL_DOUBLE,
+    IDL_STRING,
+    IDL_BUFFER
+};
+
+static const struct
+{
+    const char* name;
+    const char* ctype;
+    /* smsg_read_<suffix>/smsg_write_<suffix> */
+    const char* suffix;
+    /* Bytes of the value item, 0 for sized types */
+    size_t item_size;
+} idl_types[] =
+{
+    { "bool",   "char",     "boolean", 1 },
+    { "int8",   "int8_t",   "int8",    3 + 1 },
+    { "int16",  "int16_t",  "int16",   3 + 2 },
+    { "int32",  "int32_t",  "int32",   3 + 4 },
+    { "uint8",  "uint8_t",  "uint8",   3 + 1 },
+    { "uint16", "uint16_t", "uint16",  3 + 2 },
+    { "uint32", "uint32_t", "uint32",  3 + 4 },
+    { "float",  "float",    "float",   3 + 4 },
+    { "double", "double",   "double",  3 + 8 },
+    { "string", "char",     "string",  0 },
+    { "buffer", "uint8_t",  "buffer",  0 },
+};
+
+typedef struct
+{
+    char name[IDL_MAX_NAME];
+    int type;
+    /* Capacity of string and buffer fields */
+    unsigned count;
+    uint16_t hash;
+} idl_field_t;
+
+typedef struct
+{
+    char name[IDL_MAX_NAME];
+    idl_field_t fields[IDL_MAX_FIELDS];
+    unsigned field_count;
+} idl_struct_t;
+
+typedef struct
+{
+    char name[IDL_MAX_NAME];
+    char hashed;
+    idl_struct_t* type;
+} idl_topic_t;
+
+static idl_struct_t structs[IDL_MAX_STRUCTS];
+static unsigned struct_count;
+static idl_topic_t topics[IDL_MAX_TOPICS];
+static unsigned topic_count;
+
+/* smq_calc_crc, crc-16 poly 0x8005 bit reflected */
+static uint16_t idl_calc_crc(const void* buf, size_t len, uint16_t crc)
+{
+    const uint8_t* b = (const uint8_t*)buf;
+    while (len-- > 0)
+    {
+        crc ^= *b++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+    return crc;
+}
+
+/* smq_string_hash */
+static uint16_t idl_string_hash(const char* str)
+{
+    return ~idl_calc_crc(str, strlen(str), ~0);
+}
+
+// ----------------------------------------------
+// Schema
+
+static const char* idl_file;
+static const char* idl_pos;
+static int idl_line = 1;
+static char idl_token[IDL_MAX_NAME];
+
+static int idl_error(const char* msg, const char* arg)
+{
+    fprintf(stderr, "%s:%d: %s%s%s\n", idl_file, idl_line, msg, (arg != NULL) ? " " : "", (arg != NULL) ? arg : "");
+    return 0;
+}
+
+/* Next identifier, number or punctuation in idl_token, 0 at the end of the schema */
+static int idl_next()
+{
+    for (;;)
+    {
+        while (isspace((unsigned char)*idl_pos))
+        {
+            if (*idl_pos++ == '\n')
+                idl_line++;
+        }
+        if (idl_pos[0] == '/' && idl_pos[1] == '/')
+        {
+            while (*idl_pos != '\0' && *idl_pos != '\n')
+                idl_pos++;
+        }
+        else if (idl_pos[0] == '/' && idl_pos[1] == '*')
+        {
+            for (idl_pos += 2; *idl_pos != '\0' && !(idl_pos[0] == '*' && idl_pos[1] == '/'); idl_pos++)
+            {
+                if (*idl_pos == '\n')
+                    idl_line++;
+            }
+            if (*idl_pos != '\0')
+                idl_pos += 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+    size_t len = 0;
+    if (*idl_pos == '\0')
+    {
+        idl_token[0] = '\0';
+        return 0;
+    }
+    if (isalnum((unsigned char)*idl_pos) || *idl_pos == '_')
+    {
+        while (isalnum((unsigned char)*idl_pos) || *idl_pos == '_')
+        {
+            if (len + 1 < sizeof(idl_token))
+                idl_token[len++] = *idl_pos;
+            idl_pos++;
+        }
+    }
+    else
+    {
+        idl_token[len++] = *idl_pos++;
+    }
+    idl_token[len] = '\0';
+    return 1;
+}
+
+static int idl_expect(const char* token)
+{
+    if (!idl_next() || strcmp(idl_token, token) != 0)
+    {
+        fprintf(stderr, "%s:%d: expected '%s' before '%s'\n", idl_file, idl_line, token, idl_token);
+        return 0;
+    }
+    return 1;
+}
+
+static int idl_identifier(char* name)
+{
+    if (!idl_next() || !(isalpha((unsigned char)idl_token[0]) || idl_token[0] == '_'))
+        return idl_error("expected a name before", idl_token);
+    strcpy(name, idl_token);
+    return 1;
+}
+
+static idl_struct_t* idl_find_struct(const char* name)
+{
+    for (unsigned i = 0; i < struct_count; i++)
+    {
+        if (strcmp(structs[i].name, name) == 0)
+            return &structs[i];
+    }
+    return NULL;
+}
+
+static int idl_parse_field(idl_struct_t* s, const char* type_name)
+{
+    if (s->field_count == IDL_MAX_FIELDS)
+        return idl_error("too many fields in", s->name);
+    idl_field_t* field = &s->fields[s->field_count];
+    field->type = -1;
+    for (unsigned i = 0; i < sizeof(idl_types) / sizeof(idl_types[0]); i++)
+    {
+        if (strcmp(idl_types[i].name, type_name) == 0)
+            field->type = i;
+    }
+    if (field->type < 0)
+        return idl_error("unknown type", type_name);
+    if (!idl_identifier(field->name))
+        return 0;
+    field->count = 0;
+    if (field->type == IDL_STRING || field->type == IDL_BUFFER)
+    {
+        if (!idl_expect("["))
+            return 0;
+        idl_next();
+        field->count = strtoul(idl_token, NULL, 10);
+        if (field->count == 0 || field->count > 0xFFFF)
+            return idl_error("invalid size", idl_token);
+        if (!idl_expect("]"))
+            return 0;
+    }
+    if (!idl_expect(";"))
+        return 0;
+    field->hash = idl_string_hash(field->name);
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        const idl_field_t* other = &s->fields[i];
+        if (strcmp(other->name, field->name) == 0)
+            return idl_error("duplicate field", field->name);
+        /* The decoders tell keys apart by hash alone */
+        if (other->hash == field->hash)
+        {
+            fprintf(stderr, "%s:%d: keys '%s' and '%s' have the same hash 0x%04X\n",
+                idl_file, idl_line, other->name, field->name, field->hash);
+            return 0;
+        }
+    }
+    s->field_count++;
+    return 1;
+}
+
+static int idl_parse_struct()
+{
+    if (struct_count == IDL_MAX_STRUCTS)
+        return idl_error("too many structs", NULL);
+    idl_struct_t* s = &structs[struct_count];
+    if (!idl_identifier(s->name))
+        return 0;
+    if (idl_find_struct(s->name) != NULL)
+        return idl_error("duplicate struct", s->name);
+    if (!idl_expect("{"))
+        return 0;
+    s->field_count = 0;
+    for (;;)
+    {
+        if (!idl_next())
+            return idl_error("unterminated struct", s->name);
+        if (strcmp(idl_token, "}") == 0)
+            break;
+        char type_name[IDL_MAX_NAME];
+        strcpy(type_name, idl_token);
+        if (!idl_parse_field(s, type_name))
+            return 0;
+    }
+    /* Buffers come with a <name>_len member */
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        char len_name[IDL_MAX_NAME + 4];
+        if (s->fields[i].type != IDL_BUFFER)
+            continue;
+        snprintf(len_name, sizeof(len_name), "%s_len", s->fields[i].name);
+        for (unsigned j = 0; j < s->field_count; j++)
+        {
+            if (strcmp(s->fields[j].name, len_name) == 0)
+                return idl_error("field clashes with the length of buffer", s->fields[i].name);
+        }
+    }
+    struct_count++;
+    return 1;
+}
+
+static int idl_parse_topic(char hashed)
+{
+    if (topic_count == IDL_MAX_TOPICS)
+        return idl_error("too many topics", NULL);
+    idl_topic_t* topic = &topics[topic_count];
+    char type_name[IDL_MAX_NAME];
+    topic->hashed = hashed;
+    if (!idl_identifier(topic->name) || !idl_identifier(type_name))
+        return 0;
+    for (unsigned i = 0; i < topic_count; i++)
+    {
+        if (strcmp(topics[i].name, topic->name) == 0)
+            return idl_error("duplicate topic", topic->name);
+    }
+    if ((topic->type = idl_find_struct(type_name)) == NULL)
+        return idl_error("unknown struct", type_name);
+    if (!idl_expect(";"))
+        return 0;
+    topic_count++;
+    return 1;
+}
+
+static int idl_parse(const char* text)
+{
+    idl_pos = text;
+    while (idl_next())
+    {
+        if (strcmp(idl_token, "struct") == 0)
+        {
+            if (!idl_parse_struct())
+                return 0;
+        }
+        else if (strcmp(idl_token, "topic") == 0)
+        {
+            if (!idl_parse_topic(0))
+                return 0;
+        }
+        else if (strcmp(idl_token, "hash") == 0)
+        {
+            if (!idl_expect("topic") || !idl_parse_topic(1))
+                return 0;
+        }
+        else
+        {
+            return idl_error("unexpected", idl_token);
+        }
+    }
+    return 1;
+}
+
+// ----------------------------------------------
+// Output
+
+/* 16-bit value in the target byte order */
+static void idl_put16(uint8_t* p, uint16_t val, char big_endian)
+{
+    p[big_endian ? 1 : 0] = val & 0xFF;
+    p[big_endian ? 0 : 1] = val >> 8;
+}
+
+/* String item of a key, as smsg_write_string encodes it */
+static size_t idl_key_item(const idl_field_t* field, uint8_t* item, char big_endian)
+{
+    uint16_t len = strlen(field->name);
+    uint8_t len_bytes[2];
+    item[0] = 0x00;
+    idl_put16(len_bytes, len, big_endian);
+    idl_put16(item + 1, idl_calc_crc(len_bytes, sizeof(len_bytes), 0), big_endian);
+    memcpy(item + 3, len_bytes, sizeof(len_bytes));
+    idl_put16(item + 5, idl_calc_crc(field->name, len, 0), big_endian);
+    memcpy(item + 7, field->name, len);
+    return 7 + len;
+}
+
+static size_t idl_value_size(const idl_field_t* field)
+{
+    if (field->type == IDL_STRING)
+        return 7 + field->count - 1;
+    if (field->type == IDL_BUFFER)
+        return 7 + field->count;
+    return idl_types[field->type].item_size;
+}
+
+/* Largest network payload of a struct, string keys */
+static size_t idl_max_size(const idl_struct_t* s)
+{
+    size_t size = 0;
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        size += 7 + strlen(s->fields[i].name) + idl_value_size(&s->fields[i]);
+    }
+    return size;
+}
+
+/* Largest text of a JSON value */
+static size_t idl_json_value_size(const idl_field_t* field)
+{
+    switch (field->type)
+    {
+        case IDL_BOOL:   return 5;
+        case IDL_INT8:   return 4;
+        case IDL_INT16:  return 6;
+        case IDL_INT32:  return 11;
+        case IDL_UINT8:  return 3;
+        case IDL_UINT16: return 5;
+        case IDL_UINT32: return 10;
+        case IDL_FLOAT:  return 15;     /* %.9g */
+        case IDL_DOUBLE: return 24;     /* %.17g */
+        /* Control characters are written as \u00XX */
+        case IDL_STRING: return 2 + 6 * (field->count - 1);
+        /* Array of byte values */
+        default:         return 2 + 4 * field->count;
+    }
+}
+
+/* Largest JSON text of a struct, terminator included */
+static size_t idl_max_json_size(const idl_struct_t* s)
+{
+    size_t size = 2 + 1;
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        size += 4 + strlen(s->fields[i].name) + idl_json_value_size(&s->fields[i]);
+    }
+    return size;
+}
+
+static void idl_write_header(FILE* out, const char* guard)
+{
+    fprintf(out, "#ifndef %s\n#define %s\n", guard, guard);
+    fprintf(out, "#include \"smq.h\"\n\n");
+    fprintf(out, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n");
+    for (unsigned i = 0; i < struct_count; i++)
+    {
+        const idl_struct_t* s = &structs[i];
+        fprintf(out, "\ntypedef struct\n{\n");
+        for (unsigned j = 0; j < s->field_count; j++)
+        {
+            const idl_field_t* field = &s->fields[j];
+            if (field->type == IDL_STRING || field->type == IDL_BUFFER)
+                fprintf(out, "    %s %s[%u];\n", idl_types[field->type].ctype, field->name, field->count);
+            else
+                fprintf(out, "    %s %s;\n", idl_types[field->type].ctype, field->name);
+            if (field->type == IDL_BUFFER)
+                fprintf(out, "    uint16_t %s_len;\n", field->name);
+        }
+        fprintf(out, "} %s_t;\n\n", s->name);
+        fprintf(out, "typedef void (%s_callback_t)(const %s_t* msg, void* arg);\n\n", s->name, s->name);
+        fprintf(out, "/* SMQ_ENCODING_TLV payload with string keys, 0 if it does not fit */\n");
+        fprintf(out, "size_t %s_encode(const %s_t* msg, uint8_t* buf, size_t size);\n\n", s->name, s->name);
+        fprintf(out, "/* Serial frame items with hashed keys, 0 if it does not fit */\n");
+        fprintf(out, "size_t %s_encode_serial(const %s_t* msg, uint8_t* buf, size_t size);\n\n", s->name, s->name);
+        fprintf(out, "/* SMQ_ENCODING_JSON object, terminated, 0 if it does not fit */\n");
+        fprintf(out, "size_t %s_encode_json(const %s_t* msg, char* buf, size_t size);\n\n", s->name, s->name);
+        fprintf(out, "/* Either key form, missing fields are left zero */\n");
+        fprintf(out, "int %s_decode(%s_t* msg, const uint8_t* data, size_t len);\n\n", s->name, s->name);
+        fprintf(out, "int %s_decode_json(%s_t* msg, const uint8_t* data, size_t len);\n", s->name, s->name);
+    }
+    if (topic_count != 0)
+        fprintf(out, "\n// ----------------------------------------\n");
+    for (unsigned i = 0; i < topic_count; i++)
+    {
+        const idl_topic_t* topic = &topics[i];
+        fprintf(out, "\nint smq_advertise_%s();\n\n", topic->name);
+        fprintf(out, "/* JSON, read by every subscriber */\n");
+        fprintf(out, "int smq_publish_%s(const %s_t* msg);\n\n", topic->name, topic->type->name);
+        fprintf(out, "/* TLV, smaller and cheaper to decode, for subscribers that take SMQ_ENCODING_TLV */\n");
+        fprintf(out, "int smq_publish_%s_binary(const %s_t* msg);\n\n", topic->name, topic->type->name);
+        fprintf(out, "/* Takes both JSON and TLV publishers */\n");
+        fprintf(out, "int smq_subscribe_%s(%s_callback_t* callback, void* arg);\n", topic->name, topic->type->name);
+    }
+    fprintf(out, "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+}
+
+static void idl_write_bytes(FILE* out, const uint8_t* bytes, size_t len, const char* comment)
+{
+    fprintf(out, "   ");
+    for (size_t i = 0; i < len; i++)
+    {
+        fprintf(out, " 0x%02X,", bytes[i]);
+    }
+    fprintf(out, " /* %s */\n", comment);
+}
+
+static void idl_write_encoder(FILE* out, const idl_struct_t* s, char serial)
+{
+    const char* keys = serial ? "hash_keys" : "keys";
+    fprintf(out, "\nsize_t %s_encode%s(const %s_t* msg, uint8_t* buf, size_t size)\n{\n",
+        s->name, serial ? "_serial" : "", s->name);
+    fprintf(out, "    smsg_writer_t writer;\n");
+    fprintf(out, "    smsg_writer_init(&writer, buf, size);\n");
+    fprintf(out, "    if (setjmp(writer.jmp) != 0)\n        return 0;\n");
+    size_t offset = 0;
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        const idl_field_t* field = &s->fields[i];
+        size_t key_len = serial ? 3 : 7 + strlen(field->name);
+        fprintf(out, "    smsg_write_raw(&writer, %s_%s + %u, %u);\n", s->name, keys, (unsigned)offset, (unsigned)key_len);
+        offset += key_len;
+        if (field->type == IDL_BUFFER)
+        {
+            fprintf(out, "    smsg_write_buffer(&writer, msg->%s, (msg->%s_len < %u) ? msg->%s_len : %u);\n",
+                field->name, field->name, field->count, field->name, field->count);
+        }
+        else if (field->type == IDL_STRING)
+        {
+            /* Bounded, the array may not be terminated */
+            fprintf(out, "    smsg_write_string_len(&writer, msg->%s, strnlen(msg->%s, %u));\n",
+                field->name, field->name, field->count);
+        }
+        else
+        {
+            fprintf(out, "    smsg_write_%s(&writer, msg->%s);\n", idl_types[field->type].suffix, field->name);
+        }
+    }
+    if (serial)
+        fprintf(out, "    smsg_write_end(&writer);\n");
+    fprintf(out, "    return smsg_writer_len(&writer);\n}\n");
+}
+
+static void idl_write_json_encoder(FILE* out, const idl_struct_t* s)
+{
+    fprintf(out, "\nsize_t %s_encode_json(const %s_t* msg, char* buf, size_t size)\n{\n", s->name, s->name);
+    fprintf(out, "    char* p = buf;\n");
+    fprintf(out, "    char* end = buf + size;\n");
+    if (s->field_count == 0)
+        fprintf(out, "    p = smq_idl_printf(p, end, \"{\");\n");
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        const idl_field_t* field = &s->fields[i];
+        const char* sep = (i == 0) ? "{" : ",";
+        switch (field->type)
+        {
+            case IDL_BOOL:
+                fprintf(out, "    p = smq_idl_printf(p, end, \"%s\\\"%s\\\":%%s\", msg->%s ? \"true\" : \"false\");\n",
+                    sep, field->name, field->name);
+                break;
+            case IDL_INT8:
+            case IDL_INT16:
+            case IDL_INT32:
+                fprintf(out, "    p = smq_idl_printf(p, end, \"%s\\\"%s\\\":%%ld\", (long)msg->%s);\n",
+                    sep, field->name, field->name);
+                break;
+            case IDL_UINT8:
+            case IDL_UINT16:
+            case IDL_UINT32:
+                fprintf(out, "    p = smq_idl_printf(p, end, \"%s\\\"%s\\\":%%lu\", (unsigned long)msg->%s);\n",
+                    sep, field->name, field->name);
+                break;
+            case IDL_FLOAT:
+            case IDL_DOUBLE:
+                /* JSON has no NaN or infinity */
+                fprintf(out, "    p = smq_idl_printf(p, end, isfinite(msg->%s) ? \"%s\\\"%s\\\":%%.%dg\" : \"%s\\\"%s\\\":null\", (double)msg->%s);\n",
+                    field->name, sep, field->name, (field->type == IDL_FLOAT) ? 9 : 17, sep, field->name, field->name);
+                break;
+            case IDL_STRING:
+                fprintf(out, "    p = smq_idl_printf(p, end, \"%s\\\"%s\\\":\");\n", sep, field->name);
+                fprintf(out, "    p = smq_idl_string(p, end, msg->%s, strnlen(msg->%s, %u));\n",
+                    field->name, field->name, field->count);
+                break;
+            case IDL_BUFFER:
+                /* As smq_tlv_to_json writes buffers */
+                fprintf(out, "    p = smq_idl_printf(p, end, \"%s\\\"%s\\\":[\");\n", sep, field->name);
+                fprintf(out, "    for (size_t i = 0; i < msg->%s_len && i < %u; i++)\n", field->name, field->count);
+                fprintf(out, "        p = smq_idl_printf(p, end, (i == 0) ? \"%%u\" : \",%%u\", msg->%s[i]);\n", field->name);
+                fprintf(out, "    p = smq_idl_printf(p, end, \"]\");\n");
+                break;
+        }
+    }
+    fprintf(out, "    p = smq_idl_printf(p, end, \"}\");\n");
+    fprintf(out, "    return (p != NULL) ? (size_t)(p - buf) : 0;\n}\n");
+}
+
+static void idl_write_struct(FILE* out, const idl_struct_t* s)
+{
+    uint8_t item[7 + IDL_MAX_NAME];
+    fprintf(out, "\n// ----------------------------------------------\n// %s\n", s->name);
+    fprintf(out, "\nstatic const uint8_t %s_keys[] =\n{\n", s->name);
+    for (int big_endian = 1; big_endian >= 0; big_endian--)
+    {
+        fprintf(out, big_endian ? "#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n" : "#else\n");
+        for (unsigned i = 0; i < s->field_count; i++)
+        {
+            idl_write_bytes(out, item, idl_key_item(&s->fields[i], item, big_endian), s->fields[i].name);
+        }
+    }
+    fprintf(out, "#endif\n};\n");
+    fprintf(out, "\nstatic const uint8_t %s_hash_keys[] =\n{\n", s->name);
+    for (int big_endian = 1; big_endian >= 0; big_endian--)
+    {
+        fprintf(out, big_endian ? "#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n" : "#else\n");
+        for (unsigned i = 0; i < s->field_count; i++)
+        {
+            item[0] = 0x01;
+            idl_put16(item + 1, s->fields[i].hash, big_endian);
+            idl_write_bytes(out, item, 3, s->fields[i].name);
+        }
+    }
+    fprintf(out, "#endif\n};\n");
+    idl_write_encoder(out, s, 0);
+    idl_write_encoder(out, s, 1);
+    idl_write_json_encoder(out, s);
+
+    fprintf(out, "\nint %s_decode(%s_t* msg, const uint8_t* data, size_t len)\n{\n", s->name, s->name);
+    fprintf(out, "    smsg_t smsg;\n");
+    fprintf(out, "    memset(msg, 0, sizeof(*msg));\n");
+    fprintf(out, "    smsg_init(&smsg, data, len);\n");
+    fprintf(out, "    if (setjmp(smsg.jmp) != 0)\n        return 0;\n");
+    fprintf(out, "    while (smsg_peek_type(&smsg) == 0x00 || smsg_peek_type(&smsg) == 0x01)\n    {\n");
+    fprintf(out, "        switch (smsg_read_hash(&smsg))\n        {\n");
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        const idl_field_t* field = &s->fields[i];
+        fprintf(out, "            case 0x%04X: /* %s */\n", field->hash, field->name);
+        if (field->type == IDL_STRING || field->type == IDL_BUFFER)
+        {
+            fprintf(out, "            {\n");
+            fprintf(out, "                size_t n;\n");
+            if (field->type == IDL_STRING)
+            {
+                fprintf(out, "                const char* str = smsg_read_string(&smsg, &n);\n");
+                fprintf(out, "                if (n >= sizeof(msg->%s))\n", field->name);
+                fprintf(out, "                    n = sizeof(msg->%s) - 1;\n", field->name);
+                fprintf(out, "                memcpy(msg->%s, str, n);\n", field->name);
+                fprintf(out, "                msg->%s[n] = '\\0';\n", field->name);
+            }
+            else
+            {
+                fprintf(out, "                const uint8_t* buf = smsg_read_buffer(&smsg, &n);\n");
+                fprintf(out, "                if (n > sizeof(msg->%s))\n", field->name);
+                fprintf(out, "                    n = sizeof(msg->%s);\n", field->name);
+                fprintf(out, "                memcpy(msg->%s, buf, n);\n", field->name);
+                fprintf(out, "                msg->%s_len = n;\n", field->name);
+            }
+            fprintf(out, "                break;\n");
+            fprintf(out, "            }\n");
+        }
+        else
+        {
+            fprintf(out, "                msg->%s = smsg_read_%s(&smsg);\n", field->name, idl_types[field->type].suffix);
+            fprintf(out, "                break;\n");
+        }
+    }
+    fprintf(out, "            default:\n");
+    fprintf(out, "                smsg_skip(&smsg);\n");
+    fprintf(out, "                break;\n");
+    fprintf(out, "        }\n    }\n");
+    fprintf(out, "    return 1;\n}\n");
+
+    fprintf(out, "\nint %s_decode_json(%s_t* msg, const uint8_t* data, size_t len)\n{\n", s->name, s->name);
+    fprintf(out, "    smq_json_t json;\n");
+    fprintf(out, "    smq_json_field_t field;\n");
+    fprintf(out, "    memset(msg, 0, sizeof(*msg));\n");
+    fprintf(out, "    smq_json_init(&json, data, len);\n");
+    fprintf(out, "    while (smq_json_next(&json, &field))\n    {\n");
+    fprintf(out, "        switch (smq_json_key_hash(&field))\n        {\n");
+    for (unsigned i = 0; i < s->field_count; i++)
+    {
+        const idl_field_t* field = &s->fields[i];
+        fprintf(out, "            case 0x%04X:\n", field->hash);
+        fprintf(out, "                if (!smq_json_key_is(&field, \"%s\"))\n", field->name);
+        fprintf(out, "                    break;\n");
+        switch (field->type)
+        {
+            case IDL_BOOL:
+                fprintf(out, "                msg->%s = smq_json_boolean(&field);\n", field->name);
+                break;
+            case IDL_FLOAT:
+            case IDL_DOUBLE:
+                fprintf(out, "                msg->%s = smq_json_double(&field);\n", field->name);
+                break;
+            case IDL_STRING:
+                fprintf(out, "                if (field.type == SMQ_JSON_STRING)\n");
+                fprintf(out, "                    smq_json_unescape(field.value, field.value_len, msg->%s, sizeof(msg->%s));\n",
+                    field->name, field->name);
+                break;
+            case IDL_BUFFER:
+                /* Written by smq_tlv_to_json as an array of byte values */
+                fprintf(out, "                if (field.type == SMQ_JSON_ARRAY)\n");
+                fprintf(out, "                {\n");
+                fprintf(out, "                    const char* p = field.value + 1;\n");
+                fprintf(out, "                    const char* end = field.value + field.value_len;\n");
+                fprintf(out, "                    while (p < end && msg->%s_len < sizeof(msg->%s))\n", field->name, field->name);
+                fprintf(out, "                    {\n");
+                fprintf(out, "                        char* next;\n");
+                fprintf(out, "                        long val = strtol(p, &next, 10);\n");
+                fprintf(out, "                        if (next == p)\n");
+                fprintf(out, "                            break;\n");
+                fprintf(out, "                        msg->%s[msg->%s_len++] = (uint8_t)val;\n", field->name, field->name);
+                fprintf(out, "                        for (p = next; p < end && (*p == ',' || *p == ' ' || *p == '\\t' || *p == '\\r' || *p == '\\n'); p++) {}\n");
+                fprintf(out, "                    }\n");
+                fprintf(out, "                }\n");
+                break;
+            default:
+                fprintf(out, "                msg->%s = (%s)smq_json_int(&field);\n", field->name, idl_types[field->type].ctype);
+                break;
+        }
+        fprintf(out, "                break;\n");
+    }
+    fprintf(out, "        }\n    }\n");
+    fprintf(out, "    return !smq_json_failed(&json);\n}\n");
+}
+
+static void idl_write_topic(FILE* out, const idl_topic_t* topic)
+{
+    const char* name = topic->name;
+    const char* type = topic->type->name;
+    fprintf(out, "\n// ----------------------------------------------\n// %s%s\n", topic->hashed ? "hash topic " : "topic ", name);
+    fprintf(out, "\nstatic %s_callback_t* %s_callback;\n", type, name);
+    fprintf(out, "\nstatic void %s_receive(const char* topic_name, const uint8_t* data, size_t len, void* arg)\n{\n", name);
+    fprintf(out, "    %s_t msg;\n", type);
+    fprintf(out, "    int valid = (smq_message_encoding() == SMQ_ENCODING_TLV) ?\n");
+    fprintf(out, "        %s_decode(&msg, data, len) : %s_decode_json(&msg, data, len);\n", type, type);
+    fprintf(out, "    if (!valid)\n    {\n");
+    fprintf(out, "        fprintf(stderr, \"Invalid message on topic '%%s'\\n\", topic_name);\n");
+    fprintf(out, "        return;\n    }\n");
+    fprintf(out, "    %s_callback(&msg, arg);\n}\n", name);
+
+    fprintf(out, "\nint smq_advertise_%s()\n{\n", name);
+    fprintf(out, "    return smq_advertise%s(\"%s\");\n}\n", topic->hashed ? "_hash" : "", name);
+
+    fprintf(out, "\nint smq_publish_%s(const %s_t* msg)\n{\n", name, type);
+    fprintf(out, "    char buf[%u];\n", (unsigned)idl_max_json_size(topic->type));
+    fprintf(out, "    size_t len = %s_encode_json(msg, buf, sizeof(buf));\n", type);
+    fprintf(out, "    if (len == 0)\n        return 0;\n");
+    fprintf(out, "    return smq_publish%s(\"%s\", (const uint8_t*)buf, len);\n}\n", topic->hashed ? "_hash" : "", name);
+
+    fprintf(out, "\nint smq_publish_%s_binary(const %s_t* msg)\n{\n", name, type);
+    fprintf(out, "    uint8_t buf[%u];\n", (unsigned)idl_max_size(topic->type));
+    fprintf(out, "    size_t len = %s_encode(msg, buf, sizeof(buf));\n", type);
+    fprintf(out, "    if (len == 0)\n        return 0;\n");
+    fprintf(out, "    return smq_publish%s_binary(\"%s\", buf, len);\n}\n", topic->hashed ? "_hash" : "", name);
+
+    fprintf(out, "\nint smq_subscribe_%s(%s_callback_t* callback, void* arg)\n{\n", name, type);
+    fprintf(out, "    %s_callback = callback;\n", name);
+    fprintf(out, "    return smq_subscribe%s_binary(\"%s\", %s_receive, arg);\n}\n", topic->hashed ? "_hash" : "", name, name);
+}
+
+static int idl_has_type(int type)
+{
+    for (unsigned i = 0; i < struct_count; i++)
+    {
+        for (unsigned j = 0; j < structs[i].field_count; j++)
+        {
+            if (structs[i].fields[j].type == type)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void idl_write_source(FILE* out, const char* header)
+{
+    fprintf(out, "#include <stdio.h>\n#include <stdlib.h>\n#include <stdarg.h>\n#include <string.h>\n#include <math.h>\n");
+    fprintf(out, "#include <setjmp.h>\n#include \"%s\"\n", header);
+    if (struct_count != 0)
+    {
+        fprintf(out, "\n/* Appends to a JSON text, NULL once it does not fit */\n");
+        fprintf(out, "static char* smq_idl_printf(char* p, char* end, const char* fmt, ...)\n{\n");
+        fprintf(out, "    va_list args;\n");
+        fprintf(out, "    int n;\n");
+        fprintf(out, "    if (p == NULL)\n        return NULL;\n");
+        fprintf(out, "    va_start(args, fmt);\n");
+        fprintf(out, "    n = vsnprintf(p, end - p, fmt, args);\n");
+        fprintf(out, "    va_end(args);\n");
+        fprintf(out, "    return (n >= 0 && n < end - p) ? p + n : NULL;\n}\n");
+    }
+    if (idl_has_type(IDL_STRING))
+    {
+        fprintf(out, "\nstatic char* smq_idl_string(char* p, char* end, const char* str, size_t len)\n{\n");
+        fprintf(out, "    p = smq_idl_printf(p, end, \"\\\"\");\n");
+        fprintf(out, "    for (size_t i = 0; i < len && p != NULL; i++)\n    {\n");
+        fprintf(out, "        unsigned char c = str[i];\n");
+        fprintf(out, "        if (c == '\"' || c == '\\\\')\n");
+        fprintf(out, "            p = smq_idl_printf(p, end, \"\\\\%%c\", c);\n");
+        fprintf(out, "        else if (c < 0x20)\n");
+        fprintf(out, "            p = smq_idl_printf(p, end, \"\\\\u%%04X\", c);\n");
+        fprintf(out, "        else if (p + 1 < end)\n");
+        fprintf(out, "            *p++ = c;\n");
+        fprintf(out, "        else\n");
+        fprintf(out, "            p = NULL;\n");
+        fprintf(out, "    }\n");
+        fprintf(out, "    return smq_idl_printf(p, end, \"\\\"\");\n}\n");
+    }
+    for (unsigned i = 0; i < struct_count; i++)
+    {
+        idl_write_struct(out, &structs[i]);
+    }
+    for (unsigned i = 0; i < topic_count; i++)
+    {
+        idl_write_topic(out, &topics[i]);
+    }
+}
+
+static char* idl_read_file(const char* path)
+{
+    FILE* in = fopen(path, "r");
+    if (in == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+    size_t len = 0;
+    size_t size = 4096;
+    char* text = (char*)malloc(size);
+    size_t n;
+    while (text != NULL && (n = fread(text + len, 1, size - len - 1, in)) > 0)
+    {
+        len += n;
+        if (len + 1 == size)
+            text = (char*)realloc(text, size *= 2);
+    }
+    fclose(in);
+    if (text == NULL)
+    {
+        fprintf(stderr, "Error allocating buffer\n");
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+int main(int argc, const char* argv[])
+{
+    const char* progname = argv[0];
+    if (argc != 3)
+    {
+        fprintf(stderr, "%s: <schema.idl> <output>\n", progname);
+        fprintf(stderr, "    writes <output>.h and <output>.c\n");
+        return 1;
+    }
+    idl_file = argv[1];
+    char* text = idl_read_file(idl_file);
+    if (text == NULL || !idl_parse(text))
+        return 1;
+    free(text);
+
+    const char* output = argv[2];
+    const char* base = strrchr(output, '/');
+    base = (base != NULL) ? base + 1 : output;
+    size_t len = strlen(output);
+    char* path = (char*)malloc(len + 3);
+    char* guard = (char*)malloc(strlen(base) + 3);
+    size_t i;
+    for (i = 0; base[i] != '\0'; i++)
+    {
+        guard[i] = isalnum((unsigned char)base[i]) ? toupper((unsigned char)base[i]) : '_';
+    }
+    strcpy(guard + i, "_H");
+
+    sprintf(path, "%s.h", output);
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "/* Generated by smq_idl from %s, do not edit */\n", idl_file);
+    idl_write_header(out, guard);
+    fclose(out);
+
+    sprintf(path, "%s.c", output);
+    out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+    fprintf(out, "/* Generated by smq_idl from %s, do not edit */\n", idl_file);
+    sprintf(path, "%s.h", base);
+    idl_write_source(out, path);
+    fclose(out);
+    free(path);
+    free(guard);
+    return 0;
+}
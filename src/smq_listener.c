@@ -1,42 +1,124 @@
 #include <stdlib.h>
-#include <json-c/json.h>
 #include "smq.h"
 
-static void message_callback(const char* topic_name, const uint8_t* msg, size_t len, void* arg)
+static void print_text(const char* text, size_t len, char escaped)
 {
-    json_tokener* tok = json_tokener_new();
-    json_object* jobj = json_tokener_parse_ex(tok, (const char*)msg, len);
-    if (jobj != NULL)
+    char buf[1024];
+    if (escaped && len < sizeof(buf))
     {
-        json_object_object_foreach(jobj, key, val)
+        len = smq_json_unescape(text, len, buf, sizeof(buf));
+        text = buf;
+    }
+    fwrite(text, 1, len, stdout);
+}
+
+/* SMQ_ENCODING_TLV payloads are printed as they are, buffers in hex */
+static void print_tlv(const uint8_t* msg, size_t len)
+{
+    smsg_t smsg;
+    smsg_init(&smsg, msg, len);
+    if (setjmp(smsg.jmp) != 0)
+    {
+        printf("(truncated)\n");
+        return;
+    }
+    while (smsg_peek_type(&smsg) == 0x00 || smsg_peek_type(&smsg) == 0x01)
+    {
+        const char* str;
+        size_t n;
+        if (smsg_peek_type(&smsg) == 0x00)
         {
-            int val_type = json_object_get_type(val);
-            switch (val_type)
+            str = smsg_read_string(&smsg, &n);
+            printf("%.*s", (int)n, str);
+        }
+        else
+        {
+            printf("$crc%04X", smsg_read_hash(&smsg));
+        }
+        switch (smsg_peek_type(&smsg))
+        {
+            case 0x00:
+                str = smsg_read_string(&smsg, &n);
+                printf(":\"%.*s\"\n", (int)n, str);
+                break;
+            case 0x01:
+                printf(":$crc%04X\n", smsg_read_hash(&smsg));
+                break;
+            case 0x02:
+            case 0x03:
+            case 0x04:
+                printf(":%d\n", smsg_read_int32(&smsg));
+                break;
+            case 0x05:
+            case 0x06:
+            case 0x07:
+                printf(":%u\n", smsg_read_uint32(&smsg));
+                break;
+            case 0x08:
+            case 0x09:
+                printf(":%g\n", smsg_read_double(&smsg));
+                break;
+            case 0x0A:
+            case 0x0B:
+                printf(":%s\n", smsg_read_boolean(&smsg) ? "true": "false");
+                break;
+            case 0x0C:
+                smsg_skip(&smsg);
+                printf(":NULL\n");
+                break;
+            case 0x0D:
             {
-                case json_type_null:
-                    printf("%s:NULL\n", key);
-                    break;
-                case json_type_boolean:
-                    printf("%s:%s\n", key, json_object_get_boolean(val) ? "true": "false");
-                    break;
-                case json_type_double:
-                    printf("%s:%g\n", key, json_object_get_double(val));
-                    break;
-                case json_type_int:
-                    printf("%s:%d\n", key, json_object_get_int(val));
-                    break;
-                case json_type_string:
-                    printf("%s:\"%s\"\n", key, json_object_get_string(val));
-                    break;
-                case json_type_object:
-                    break;
-                case json_type_array:
-                    // Support int array as byte-buffer
+                const uint8_t* buf = smsg_read_buffer(&smsg, &n);
+                printf(":<");
+                for (size_t i = 0; i < n; i++)
+                {
+                    printf("%02x", buf[i]);
+                }
+                printf(">\n");
                 break;
             }
+            default:
+                smsg_failed(&smsg);
+        }
+    }
+}
+
+static void message_callback(const char* topic_name, const uint8_t* msg, size_t len, void* arg)
+{
+    if (smq_message_encoding() == SMQ_ENCODING_TLV)
+    {
+        print_tlv(msg, len);
+        return;
+    }
+    smq_json_t json;
+    smq_json_field_t field;
+    smq_json_init(&json, msg, len);
+    while (smq_json_next(&json, &field))
+    {
+        if (field.type == SMQ_JSON_OBJECT || field.type == SMQ_JSON_ARRAY)
+            continue;
+        print_text(field.key, field.key_len, field.key_escaped);
+        switch (field.type)
+        {
+            case SMQ_JSON_NULL:
+                printf(":NULL\n");
+                break;
+            case SMQ_JSON_BOOLEAN:
+                printf(":%s\n", smq_json_boolean(&field) ? "true": "false");
+                break;
+            case SMQ_JSON_DOUBLE:
+                printf(":%g\n", smq_json_double(&field));
+                break;
+            case SMQ_JSON_INT:
+                printf(":%lld\n", (long long)smq_json_int(&field));
+                break;
+            case SMQ_JSON_STRING:
+                printf(":\"");
+                print_text(field.value, field.value_len, field.value_escaped);
+                printf("\"\n");
+                break;
         }
     }
-    json_tokener_free(tok);
 }
 
 int main(int argc, const char* argv[])
@@ -56,8 +138,8 @@ int main(int argc, const char* argv[])
     /* Subscribe */
     if (!smq_advertise(topic)) return 1;
     if (!smq_advertise_hash(topic)) return 1;
-    if (!smq_subscribe(topic, message_callback, NULL)) printf("failed to subscribe to %s\n", topic);
-    if (!smq_subscribe_hash(topic, message_callback, NULL)) printf("failed to subscribe to %s\n", topic);
+    /* Also receives the $crc form of the topic */
+    if (!smq_subscribe_binary(topic, message_callback, NULL)) printf("failed to subscribe to %s\n", topic);
 
     /* Spin */
     if(!smq_wait()) return 1;
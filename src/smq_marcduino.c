@@ -15,7 +15,7 @@ int main(int argc, const char* argv[])
 
     // /* Advertise the topic */
     if (!smq_advertise_hash("MARC")) return 1;
-    smq_wait_for(1000);
+    smq_wait_for_subscribers_hash("MARC", 1, 1000);
 
     int sock;
     /* Create a best-effort datagram socket using UDP */
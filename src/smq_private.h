@@ -0,0 +1,120 @@
+#ifndef SMQ_PRIVATE_H
+#define SMQ_PRIVATE_H
+
+/* Internals of libsmq shared with smq_discoveryd, not part of the API */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <uuid/uuid.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Constants */
+#define SMQ_OP_ADV 0x01
+#define SMQ_OP_SUB 0x02
+#define SMQ_OP_PUB 0x03
+
+#define SMQ_DISCOVERYD_PATH "/tmp/smq_discoveryd.sock"
+#define SMQ_UDP_MAX_SIZE 512
+#define SMQ_MAX_TOPIC_LENGTH 193 + 1
+#define SMQ_MAX_ADDR_LENGTH 267 + 1
+#define SMQ_HOST_ID_LENGTH 64 + 1
+#define SMQ_FLAGS_LENGTH 16
+#define SMQ_MAX_POLL_ITEMS 1024
+#define SMQ_ADV_REPLY_SLOTS 8
+#define SMQ_ADDR_RETRY_MS 1000
+
+#define GUID_LEN sizeof(uuid_t)
+
+/* Header flag offsets */
+#define SMQ_FLAG_REPLY_PORT 0       /* uint16 (network order) unicast port for ADV replies */
+#define SMQ_FLAG_ENCODING 2         /* uint8 payload encoding of PUB messages */
+#define SMQ_FLAG_TOPIC_ID_SIZE 3    /* uint8 bytes used by SMQ_FLAG_TOPIC_ID, 0 if absent */
+#define SMQ_FLAG_TOPIC_ID 4         /* uint32 hash of the topic, lets PUB dispatch skip the name */
+#define SMQ_FLAG_COMPRESSION 8      /* uint8 SMQ_COMPRESSION_* of the PUB payload */
+#define SMQ_FLAG_RAW_LENGTH 9       /* uint32 payload length before compression */
+#define SMQ_FLAG_DELTA 13           /* uint8 SMQ_DELTA_* of the PUB payload */
+#define SMQ_FLAG_DELTA_SEQ 14       /* uint16 message number of a delta topic, per publisher */
+
+/* Discovery sockets, see smq_network_fd */
+#define SMQ_NETWORK_BCAST 0
+#define SMQ_NETWORK_UCAST 1
+#define SMQ_NETWORK_NETLINK 2
+
+typedef struct
+{
+    uint16_t version;
+    uuid_t guid;
+    char topic[SMQ_MAX_TOPIC_LENGTH];
+    uint8_t type;
+    uint8_t flags[SMQ_FLAGS_LENGTH];
+} smq_msg_header_t;
+
+typedef struct
+{
+    smq_msg_header_t header;
+    char addr[SMQ_MAX_ADDR_LENGTH];
+    /* Optional trailer: same-host peers connect to ipc_addr instead */
+    char host_id[SMQ_HOST_ID_LENGTH];
+    char ipc_addr[SMQ_MAX_ADDR_LENGTH];
+} smq_adv_msg_t;
+
+/* Recent ADV reply destination, see smq_adv_reply_addr */
+typedef struct
+{
+    uint64_t time;
+    struct sockaddr_in addr;
+} smq_adv_reply_t;
+
+typedef struct smq_peer_t
+{
+    uint8_t type;
+    int fd;
+    uuid_t guid;
+    char topic[SMQ_MAX_TOPIC_LENGTH];
+    char addr[SMQ_MAX_ADDR_LENGTH];
+    char ipc_addr[SMQ_MAX_ADDR_LENGTH];
+    char host[SMQ_MAX_ADDR_LENGTH];
+    uint64_t seen_time;
+    smq_adv_reply_t adv_replies[SMQ_ADV_REPLY_SLOTS];
+    struct smq_peer_t* next;
+    struct smq_peer_t* prev;
+} smq_peer_t;
+
+typedef struct
+{
+    struct smq_peer_t* first;
+    struct smq_peer_t* last;
+} smq_peer_list_t;
+
+int smq_guid_compare(uuid_t guid, uuid_t other);
+smq_peer_t* smq_peer_list_append(smq_peer_list_t* list, uint8_t type, int fd, uuid_t guid, const char* topic, const char* addr);
+void smq_peer_list_remove(smq_peer_list_t* list, smq_peer_t* peer);
+smq_peer_t* smq_peer_in_list(smq_peer_list_t* list, uint8_t type, uuid_t guid, const char* topic);
+
+/* Wire format, the deserializers return 0 if the buffer is too short or malformed */
+size_t smq_serialize_msg_header(uint8_t* buffer, const smq_msg_header_t* header);
+size_t smq_deserialize_msg_header(smq_msg_header_t* header, uint8_t* buffer, size_t len);
+size_t smq_deserialize_adv_msg(smq_adv_msg_t* adv_msg, uint8_t* buffer, size_t len);
+size_t smq_build_adv_msg(uint8_t* buffer, uuid_t guid, const char* topic_name, const char* addr, const char* ipc_addr);
+int smq_adv_reply_addr(smq_msg_header_t* header, const struct sockaddr_in* src_addr,
+    smq_adv_reply_t* replies, struct sockaddr_in* reply_addr);
+
+/* Discovery sockets without the zmq side, for the discovery daemon */
+const char* smq_discoveryd_path();
+int smq_network_start();
+int smq_network_rebind();
+int smq_network_ready();
+int smq_network_fd(int which);
+uint16_t smq_network_reply_port();
+int smq_netlink_changed();
+int smq_sendto_bcast(unsigned char* buffer, size_t buffer_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
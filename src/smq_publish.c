@@ -24,9 +24,9 @@ int main(int argc, const char* argv[])
     }
     json_object_put(jobj);
 
-    // /* Advertise the topic - can take up to 10 seconds for topic to be subscribed to*/
+    // /* Advertise the topic - wait up to 10 seconds for the topic to be subscribed to*/
     if (!smq_advertise_hash(topic)) return 1;
-    smq_wait_for(10000);
+    smq_wait_for_subscribers_hash(topic, 1, 10000);
 
     smq_publish_hash(topic, (const uint8_t*)msg, strlen(msg));
     smq_wait_for(10);
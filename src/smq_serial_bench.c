@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include "smq.h"
+
+/*
+ * Serial link benchmark. A simulated board on the master side of a
+ * pseudo-terminal speaks the typed serial protocol to a real host
+ * (smq_subscribe_serial on the slave side):
+ *
+ *   inbound:  board -> host -> smq_publish, latency is frame sent to ACK
+ *   outbound: publisher -> host -> smsg_callback -> board, latency is
+ *             publish time to frame fully received by the board
+ *
+ * Wire time is simulated by pacing the board at the configured baud rate.
+ */
+
+#define BENCH_TOPIC_IN  "BENCHIN"
+#define BENCH_TOPIC_OUT "BENCHOUT"
+#define BENCH_IDLE_MS   5000
+
+#define SERIAL_HELLO     0xC0
+#define SERIAL_HELLO_ACK 0xC1
+#define SERIAL_SEQ       0xC2
+#define SERIAL_ACK       0xC3
+
+static unsigned bench_frames = 1000;
+static unsigned bench_baud = 115200;
+static unsigned bench_window = 0;
+static unsigned bench_payload = 32;
+static int bench_inbound = 1;
+static int bench_outbound = 1;
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ----------------------------------------------
+// Simulated board
+
+static int board_fd;
+static uint8_t board_rx[4096];
+static size_t board_rx_pos;
+static size_t board_rx_len;
+static uint64_t board_rx_bytes;
+static unsigned board_window;
+static uint8_t board_tx_seq;
+
+/* Hold the line for as long as len bytes take at the configured rate */
+static void board_pace(size_t len)
+{
+    useconds_t us = (useconds_t)((uint64_t)len * 10 * 1000000 / bench_baud);
+    if (us > 0)
+        usleep(us);
+}
+
+static void board_write(const void* buf, size_t len)
+{
+    const uint8_t* b = (const uint8_t*)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(board_fd, b, len);
+        if (n < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("board write");
+            exit(1);
+        }
+        board_pace(n);
+        b += n;
+        len -= n;
+    }
+}
+
+/* Next byte from the host, -1 after timeout_ms without data */
+static int board_getc(int timeout_ms)
+{
+    if (board_rx_pos == board_rx_len)
+    {
+        struct pollfd pfd = { board_fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, timeout_ms);
+        if (rc <= 0)
+            return -1;
+        ssize_t n = read(board_fd, board_rx, sizeof(board_rx));
+        if (n <= 0)
+            return -1;
+        board_pace(n);
+        board_rx_pos = 0;
+        board_rx_len = n;
+    }
+    board_rx_bytes++;
+    return board_rx[board_rx_pos++];
+}
+
+static int board_read(void* buf, size_t len)
+{
+    uint8_t* b = (uint8_t*)buf;
+    for (size_t i = 0; i < len; i++)
+    {
+        int c = board_getc(BENCH_IDLE_MS);
+        if (c < 0)
+            return 0;
+        b[i] = c;
+    }
+    return 1;
+}
+
+static size_t put_data(uint8_t* p, uint8_t type, const void* data, uint16_t len)
+{
+    uint16_t crc;
+    p[0] = type;
+    crc = smq_calc_crc(&len, sizeof(len), 0);
+    memcpy(p + 1, &crc, sizeof(crc));
+    memcpy(p + 3, &len, sizeof(len));
+    crc = smq_calc_crc(data, len, 0);
+    memcpy(p + 5, &crc, sizeof(crc));
+    memcpy(p + 7, data, len);
+    return 7 + len;
+}
+
+static size_t put_string(uint8_t* p, const char* str)
+{
+    return put_data(p, 0x00, str, strlen(str));
+}
+
+static size_t put_int32(uint8_t* p, int32_t val)
+{
+    uint16_t crc = smq_calc_crc(&val, sizeof(val), 0);
+    p[0] = 0x04;
+    memcpy(p + 1, &crc, sizeof(crc));
+    memcpy(p + 3, &val, sizeof(val));
+    return 3 + sizeof(val);
+}
+
+static size_t board_frame_start(uint8_t* p)
+{
+    if (board_window == 0)
+        return 0;
+    p[0] = SERIAL_SEQ;
+    p[1] = board_tx_seq++;
+    return 2;
+}
+
+/* Wait for the host's 'A' and answer its window offer */
+static int board_handshake()
+{
+    int c;
+    while ((c = board_getc(BENCH_IDLE_MS)) != 'A')
+    {
+        if (c < 0)
+            return 0;
+    }
+    if ((c = board_getc(500)) == SERIAL_HELLO)
+    {
+        int offer = board_getc(500);
+        if (offer < 0)
+            return 0;
+        unsigned window = ((unsigned)offer < bench_window) ? (unsigned)offer : bench_window;
+        uint8_t reply[2] = { SERIAL_HELLO_ACK, (uint8_t)window };
+        board_write(reply, sizeof(reply));
+        board_window = window;
+    }
+    return 1;
+}
+
+/* Block until the host acknowledges, returns the number of frames acked */
+static int board_wait_ack(uint8_t* acked_seq)
+{
+    for (;;)
+    {
+        int c = board_getc(BENCH_IDLE_MS);
+        if (c < 0)
+            return -1;
+        if (board_window == 0 && c == 'A')
+            return 1;
+        if (board_window != 0 && c == SERIAL_ACK)
+        {
+            int seq = board_getc(BENCH_IDLE_MS);
+            if (seq < 0)
+                return -1;
+            *acked_seq = seq;
+            return 1;
+        }
+    }
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+static void report(const char* name, unsigned count, unsigned expected, uint64_t bytes, uint64_t elapsed_us, uint64_t* latency)
+{
+    double secs = elapsed_us / 1e6;
+    printf("%-8s %u/%u frames in %.3f s: %.0f frames/s, %.0f bytes/s\n",
+        name, count, expected, secs, (secs > 0) ? count / secs : 0, (secs > 0) ? bytes / secs : 0);
+    if (count == 0)
+        return;
+    qsort(latency, count, sizeof(latency[0]), cmp_u64);
+    printf("%-8s latency us: p50 %llu  p90 %llu  p99 %llu  max %llu\n", name,
+        (unsigned long long)latency[count * 50 / 100],
+        (unsigned long long)latency[count * 90 / 100],
+        (unsigned long long)latency[count * 99 / 100],
+        (unsigned long long)latency[count - 1]);
+}
+
+static void board_inbound()
+{
+    uint8_t frame[512 + 64];
+    char payload[512];
+    uint64_t* sent = (uint64_t*)calloc(bench_frames, sizeof(uint64_t));
+    uint64_t* latency = (uint64_t*)calloc(bench_frames, sizeof(uint64_t));
+    unsigned in_flight_max = (board_window != 0) ? board_window : 1;
+    unsigned next = 0, acked = 0;
+    uint8_t first_seq = board_tx_seq;
+    uint64_t bytes = 0;
+
+    memset(payload, 'x', bench_payload);
+    payload[bench_payload] = '\0';
+    uint64_t start = now_us();
+    while (acked < bench_frames)
+    {
+        while (next < bench_frames && next - acked < in_flight_max)
+        {
+            size_t len = board_frame_start(frame);
+            len += put_string(frame + len, BENCH_TOPIC_IN);
+            len += put_string(frame + len, "seq");
+            len += put_int32(frame + len, next);
+            len += put_string(frame + len, "data");
+            len += put_string(frame + len, payload);
+            frame[len++] = 0xFF;
+            sent[next++] = now_us();
+            board_write(frame, len);
+            bytes += len;
+        }
+        uint8_t seq = 0;
+        if (board_wait_ack(&seq) < 0)
+            break;
+        /* 'A' acks one frame, a windowed ack everything up to seq */
+        uint64_t t = now_us();
+        while (acked < next)
+        {
+            uint8_t frame_seq = first_seq + acked;
+            latency[acked] = t - sent[acked];
+            acked++;
+            if (board_window == 0 || frame_seq == seq)
+                break;
+        }
+    }
+    report("inbound", acked, bench_frames, bytes, now_us() - start, latency);
+    free(sent);
+    free(latency);
+}
+
+/* Skip one item, reporting the string value of the "t" key */
+static int board_read_item(int* is_key, uint16_t t_hash, int* t_next, uint64_t* t_value)
+{
+    int type = board_getc(BENCH_IDLE_MS);
+    uint8_t buf[65536];
+    uint16_t crc, len;
+    if (type < 0)
+        return -1;
+    if (type == 0xFF)
+        return 0;
+    switch (type)
+    {
+        case 0x00:
+        case 0x0D:
+            if (!board_read(&crc, 2) || !board_read(&len, 2) || !board_read(&crc, 2) || !board_read(buf, len))
+                return -1;
+            if (!*is_key && *t_next && type == 0x00)
+            {
+                buf[len] = '\0';
+                *t_value = strtoull((const char*)buf, NULL, 10);
+            }
+            break;
+        case 0x01:
+            if (!board_read(&crc, 2))
+                return -1;
+            if (*is_key)
+                *t_next = (crc == t_hash);
+            break;
+        case 0x02: case 0x05:
+            if (!board_read(buf, 3)) return -1;
+            break;
+        case 0x03: case 0x06:
+            if (!board_read(buf, 4)) return -1;
+            break;
+        case 0x04: case 0x07: case 0x08:
+            if (!board_read(buf, 6)) return -1;
+            break;
+        case 0x09:
+            if (!board_read(buf, 10)) return -1;
+            break;
+    }
+    *is_key = !*is_key;
+    return 1;
+}
+
+static void board_outbound(int start_fd)
+{
+    uint64_t* latency = (uint64_t*)calloc(bench_frames, sizeof(uint64_t));
+    uint16_t t_hash = smq_string_hash("t");
+    unsigned count = 0;
+    uint64_t bytes = 0;
+    uint64_t start = 0;
+
+    /* Tell the publisher the board is listening */
+    if (write(start_fd, "G", 1) != 1)
+        perror("start");
+    while (count < bench_frames)
+    {
+        int c = board_getc(BENCH_IDLE_MS);
+        int seq = -1;
+        if (c < 0)
+            break;
+        if (board_window == 0 && c == 'D')
+        {
+            char ready = 'R';
+            board_write(&ready, 1);
+        }
+        else if (board_window != 0 && c == SERIAL_SEQ)
+        {
+            if ((seq = board_getc(BENCH_IDLE_MS)) < 0)
+                break;
+        }
+        else
+        {
+            /* Host's trailing 'A' and anything else between frames */
+            continue;
+        }
+        /* Frame: topic crc then key/value items up to 0xFF */
+        uint16_t crc;
+        uint64_t rx_bytes = board_rx_bytes;
+        if (!board_read(&crc, 2))
+            break;
+        int is_key = 1, t_next = 0, rc;
+        uint64_t t_value = 0;
+        while ((rc = board_read_item(&is_key, t_hash, &t_next, &t_value)) > 0) {}
+        if (rc < 0)
+            break;
+        uint64_t t = now_us();
+        if (start == 0)
+            start = t_value;
+        latency[count++] = (t_value != 0 && t > t_value) ? t - t_value : 0;
+        bytes += board_rx_bytes - rx_bytes;
+        if (seq >= 0)
+        {
+            uint8_t ack[2] = { SERIAL_ACK, (uint8_t)seq };
+            board_write(ack, sizeof(ack));
+        }
+    }
+    report("outbound", count, bench_frames, bytes, (start != 0) ? now_us() - start : 0, latency);
+    free(latency);
+}
+
+static int run_board(int fd, int start_fd)
+{
+    uint8_t frame[64];
+    board_fd = fd;
+    if (!board_handshake())
+    {
+        fprintf(stderr, "board: no handshake from host\n");
+        return 1;
+    }
+    printf("board: %u baud, window %u\n", bench_baud, board_window);
+    /* The ack of the first frame (the subscriber list, or an empty frame)
+       shows the host is processing, timing starts after it */
+    uint8_t seq;
+    size_t len = board_frame_start(frame);
+    if (bench_outbound)
+    {
+        uint16_t subscribers = smq_string_hash("subscribers");
+        uint16_t count = 1;
+        uint16_t topic = smq_string_hash(BENCH_TOPIC_OUT);
+        frame[len++] = 0x01;
+        memcpy(frame + len, &subscribers, 2); len += 2;
+        memcpy(frame + len, &count, 2); len += 2;
+        memcpy(frame + len, &topic, 2); len += 2;
+    }
+    frame[len++] = 0xFF;
+    board_write(frame, len);
+    if (board_wait_ack(&seq) < 0)
+    {
+        fprintf(stderr, "board: first frame not acknowledged\n");
+        return 1;
+    }
+    if (bench_inbound)
+        board_inbound();
+    if (bench_outbound)
+        board_outbound(start_fd);
+    return 0;
+}
+
+// ----------------------------------------------
+// Outbound publisher
+
+static int run_publisher(int start_fd)
+{
+    char msg[1024];
+    char payload[512];
+    char go;
+    if (!smq_init()) return 1;
+    if (!smq_advertise_hash(BENCH_TOPIC_OUT)) return 1;
+    smq_wait_for_subscribers_hash(BENCH_TOPIC_OUT, 1, 10000);
+    if (read(start_fd, &go, 1) != 1)
+        return 1;
+    memset(payload, 'x', bench_payload);
+    payload[bench_payload] = '\0';
+    for (unsigned i = 0; i < bench_frames; i++)
+    {
+        snprintf(msg, sizeof(msg), "{\"seq\": %u, \"t\": \"%llu\", \"data\": \"%s\"}",
+            i, (unsigned long long)now_us(), payload);
+        smq_publish_hash(BENCH_TOPIC_OUT, (const uint8_t*)msg, strlen(msg));
+        smq_spin_once(0);
+    }
+    smq_wait_for(BENCH_IDLE_MS);
+    return 0;
+}
+
+// ----------------------------------------------
+
+static void usage(const char* progname)
+{
+    fprintf(stderr, "%s: [-n frames] [-b baud] [-w window] [-s payload] [inbound|outbound|both]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:w:s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': bench_frames = atoi(optarg); break;
+            case 'b': bench_baud = atoi(optarg); break;
+            case 'w': bench_window = atoi(optarg); break;
+            case 's': bench_payload = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind < argc)
+    {
+        bench_inbound = (strcmp(argv[optind], "outbound") != 0);
+        bench_outbound = (strcmp(argv[optind], "inbound") != 0);
+    }
+    if (bench_frames == 0 || bench_baud == 0 || bench_payload > 480 || bench_window > 127)
+        usage(argv[0]);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        perror("posix_openpt");
+        return 1;
+    }
+    char slave[256];
+    snprintf(slave, sizeof(slave), "%s", ptsname(master));
+    struct termios tio;
+    if (tcgetattr(master, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(master, TCSANOW, &tio);
+    }
+
+    int start_pipe[2];
+    if (pipe(start_pipe) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+    pid_t board = fork();
+    if (board == 0)
+    {
+        close(start_pipe[0]);
+        exit(run_board(master, start_pipe[1]));
+    }
+    close(start_pipe[1]);
+
+    /* The library logs every message, keep that out of the results */
+    int devnull = open("/dev/null", O_WRONLY);
+    pid_t publisher = -1;
+    if (bench_outbound)
+    {
+        publisher = fork();
+        if (publisher == 0)
+        {
+            dup2(devnull, STDOUT_FILENO);
+            exit(run_publisher(start_pipe[0]));
+        }
+    }
+    close(start_pipe[0]);
+
+    /* Host: same setup as smq_agent */
+    char window[16];
+    snprintf(window, sizeof(window), "%u", bench_window);
+    setenv("SMQ_SERIAL_WINDOW", window, 1);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(devnull, STDOUT_FILENO);
+    int status = 1;
+    if (smq_init())
+    {
+        int fd = smq_subscribe_serial(slave, bench_baud);
+        if (fd != -1)
+        {
+            while (waitpid(board, &status, WNOHANG) == 0)
+            {
+                smq_wait_for(100);
+            }
+            smq_close_serial(fd);
+        }
+    }
+    dup2(saved_stdout, STDOUT_FILENO);
+    if (publisher > 0)
+    {
+        kill(publisher, SIGTERM);
+        waitpid(publisher, NULL, 0);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
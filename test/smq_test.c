@@ -0,0 +1,408 @@
+// Unit tests for the parsers and encoders of libsmq, run with 'make check'.
+//
+// smq.c is included so the static helpers (crc variants, delta streams) can be
+// reached; nothing here needs a network or a zmq context.
+
+#include "../src/smq.c"
+
+static int failures;
+
+#define CHECK(cond) \
+    do \
+    { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// ----------------------------------------
+// smq_json
+
+static int json_count(const char* text, smq_json_field_t* fields, int max)
+{
+    smq_json_t json;
+    int count = 0;
+    smq_json_init(&json, (const uint8_t*)text, strlen(text));
+    while (count < max && smq_json_next(&json, &fields[count]))
+        count++;
+    return smq_json_failed(&json) ? -1 : count;
+}
+
+static void test_json_scan()
+{
+    smq_json_field_t fields[16];
+    const char* msg = "{ \"a\": 12, \"b\": \"x\\\"y\", \"c\": [1, {\"d\": 2}], \"e\": {\"f\": [true]},"
+                      " \"g\": null, \"h\": -2.5e3, \"i\": false }";
+    CHECK(json_count(msg, fields, 16) == 7);
+    CHECK(smq_json_key_is(&fields[0], "a") && fields[0].type == SMQ_JSON_INT && smq_json_int(&fields[0]) == 12);
+    CHECK(fields[1].type == SMQ_JSON_STRING && fields[1].value_escaped);
+    CHECK(fields[1].value_len == 4 && 0 == memcmp(fields[1].value, "x\\\"y", 4));
+    CHECK(fields[2].type == SMQ_JSON_ARRAY && fields[2].value_len == strlen("[1, {\"d\": 2}]"));
+    CHECK(fields[3].type == SMQ_JSON_OBJECT && 0 == memcmp(fields[3].value, "{\"f\": [true]}", fields[3].value_len));
+    CHECK(fields[4].type == SMQ_JSON_NULL);
+    CHECK(fields[5].type == SMQ_JSON_DOUBLE && smq_json_double(&fields[5]) == -2500.0);
+    CHECK(fields[6].type == SMQ_JSON_BOOLEAN && !smq_json_boolean(&fields[6]));
+    CHECK(smq_json_key_hash(&fields[0]) == smq_string_hash("a"));
+
+    CHECK(json_count("{}", fields, 16) == 0);
+    CHECK(json_count("  {\"s\":\"\"}  ", fields, 16) == 1 && fields[0].value_len == 0);
+    CHECK(smq_json_string_is(&fields[0], ""));
+}
+
+static void test_json_malformed()
+{
+    smq_json_field_t fields[16];
+    const char* bad[] =
+    {
+        "",
+        "[1, 2]",
+        "{\"a\":1,",
+        "{\"a\"}",
+        "{\"a\":tru}",
+        "{\"a\":\"abc",
+        "{\"a\":[1,2}",
+        "{\"a\":{\"b\":1}",
+        "{\"a\" 1}",
+        "{a:1}",
+        "{\"a\":1 \"b\":2}",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        if (json_count(bad[i], fields, 16) != -1)
+        {
+            fprintf(stderr, "accepted malformed JSON '%s'\n", bad[i]);
+            failures++;
+        }
+    }
+    // Every prefix of a valid message is truncated input
+    const char* msg = "{\"k\":\"v\\u00e9\",\"n\":[1,{\"x\":null}],\"d\":1.5}";
+    for (size_t len = 0; len < strlen(msg); len++)
+    {
+        smq_json_t json;
+        smq_json_init(&json, (const uint8_t*)msg, len);
+        while (smq_json_next(&json, &fields[0]))
+            ;
+        if (!smq_json_failed(&json))
+        {
+            fprintf(stderr, "accepted JSON truncated to %zu bytes\n", len);
+            failures++;
+        }
+    }
+}
+
+static void test_json_unescape()
+{
+    char buf[64];
+    size_t n;
+    const char* text = "a\\nb\\t\\\"c\\\\";
+    n = smq_json_unescape(text, strlen(text), buf, sizeof(buf));
+    CHECK(n == 7 && 0 == strcmp(buf, "a\nb\t\"c\\"));
+    n = smq_json_unescape("\\u00e9", 6, buf, sizeof(buf));
+    CHECK(n == 2 && 0 == strcmp(buf, "\xC3\xA9"));
+    n = smq_json_unescape("\\u20AC", 6, buf, sizeof(buf));
+    CHECK(n == 3 && 0 == strcmp(buf, "\xE2\x82\xAC"));
+    n = smq_json_unescape("\\ud83d\\ude00", 12, buf, sizeof(buf));
+    CHECK(n == 4 && 0 == strcmp(buf, "\xF0\x9F\x98\x80"));
+    // Output is always terminated and never overruns
+    n = smq_json_unescape("abcdef", 6, buf, 4);
+    CHECK(n == 3 && 0 == strcmp(buf, "abc"));
+    CHECK(smq_json_unescape("abc", 3, buf, 0) == 0);
+    // Broken escapes do not read past the input
+    n = smq_json_unescape("ab\\", 3, buf, sizeof(buf));
+    CHECK(n <= 3 && buf[n] == '\0');
+    n = smq_json_unescape("\\u12", 4, buf, sizeof(buf));
+    CHECK(n <= 4 && buf[n] == '\0');
+}
+
+// ----------------------------------------
+// smsg
+
+static void test_smsg_round_trip()
+{
+    uint8_t buf[256];
+    const uint8_t blob[] = { 0x00, 0xFF, 0x7E, 0x7D };
+    smsg_writer_t writer;
+    smsg_writer_init(&writer, buf, sizeof(buf));
+    if (setjmp(writer.jmp) != 0)
+    {
+        CHECK(!"writer overflow");
+        return;
+    }
+    smsg_write_hash(&writer, "speed");
+    smsg_write_int8(&writer, -5);
+    smsg_write_int16(&writer, -3000);
+    smsg_write_int32(&writer, -70000);
+    smsg_write_uint8(&writer, 200);
+    smsg_write_uint16(&writer, 60000);
+    smsg_write_uint32(&writer, 4000000000u);
+    smsg_write_float(&writer, 1.5f);
+    smsg_write_double(&writer, -0.25);
+    smsg_write_boolean(&writer, 1);
+    smsg_write_null(&writer);
+    smsg_write_string(&writer, "hello");
+    smsg_write_buffer(&writer, blob, sizeof(blob));
+    size_t len = smsg_writer_len(&writer);
+
+    smsg_t smsg;
+    smsg_init(&smsg, buf, len);
+    if (setjmp(smsg.jmp) != 0)
+    {
+        CHECK(!"reader failed on a valid message");
+        return;
+    }
+    size_t slen;
+    CHECK(smsg_read_hash(&smsg) == smq_string_hash("speed"));
+    CHECK(smsg_read_int8(&smsg) == -5);
+    CHECK(smsg_read_int16(&smsg) == -3000);
+    CHECK(smsg_read_int32(&smsg) == -70000);
+    CHECK(smsg_read_uint8(&smsg) == 200);
+    CHECK(smsg_read_uint16(&smsg) == 60000);
+    CHECK(smsg_read_uint32(&smsg) == 4000000000u);
+    CHECK(smsg_read_float(&smsg) == 1.5f);
+    CHECK(smsg_read_double(&smsg) == -0.25);
+    CHECK(smsg_read_boolean(&smsg) == 1);
+    CHECK(smsg_peek_type(&smsg) == 0x0C);
+    smsg_skip(&smsg);
+    const char* str = smsg_read_string(&smsg, &slen);
+    CHECK(slen == 5 && 0 == memcmp(str, "hello", 5));
+    const uint8_t* data = smsg_read_buffer(&smsg, &slen);
+    CHECK(slen == sizeof(blob) && 0 == memcmp(data, blob, sizeof(blob)));
+    smsg_complete(&smsg);
+}
+
+/* Reads every item of a message, returns 0 if the reader rejected it */
+static int smsg_read_all(const uint8_t* msg, size_t len)
+{
+    smsg_t smsg;
+    smsg_init(&smsg, msg, len);
+    if (setjmp(smsg.jmp) != 0)
+        return 0;
+    while (smsg_peek_type(&smsg) >= 0)
+        smsg_skip(&smsg);
+    smsg_complete(&smsg);
+    return 1;
+}
+
+static void test_smsg_malformed()
+{
+    uint8_t buf[64];
+    smsg_writer_t writer;
+    smsg_writer_init(&writer, buf, sizeof(buf));
+    if (setjmp(writer.jmp) != 0)
+    {
+        CHECK(!"writer overflow");
+        return;
+    }
+    smsg_write_int32(&writer, 1234);
+    smsg_write_string(&writer, "abc");
+    size_t len = smsg_writer_len(&writer);
+    CHECK(smsg_read_all(buf, len));
+    for (size_t cut = 1; cut < len; cut++)
+    {
+        if (cut != 7 && smsg_read_all(buf, cut))
+        {
+            fprintf(stderr, "accepted smsg truncated to %zu bytes\n", cut);
+            failures++;
+        }
+    }
+    // Item crcs are checked by the serial link, the reader only has to stay inside the message
+    uint8_t copy[64];
+    for (size_t i = 0; i < len; i++)
+    {
+        memcpy(copy, buf, len);
+        copy[i] ^= 0x5A;
+        smsg_read_all(copy, len);
+    }
+    memcpy(copy, buf, len);
+    copy[7] = 0x0E;
+    CHECK(!smsg_read_all(copy, len));
+    memcpy(copy, buf, len);
+    copy[7 + 4] = 0xFF;
+    CHECK(!smsg_read_all(copy, len));
+    // Reading the wrong type fails too
+    smsg_t smsg;
+    smsg_init(&smsg, buf, len);
+    volatile int failed = 0;
+    if (setjmp(smsg.jmp) == 0)
+        smsg_read_string(&smsg, NULL);
+    else
+        failed = 1;
+    CHECK(failed);
+
+    // Writers stop at the end of their buffer
+    uint8_t small[8];
+    smsg_writer_init(&writer, small, sizeof(small));
+    failed = 0;
+    if (setjmp(writer.jmp) == 0)
+        smsg_write_string(&writer, "too long for eight bytes");
+    else
+        failed = 1;
+    CHECK(failed);
+}
+
+// ----------------------------------------
+// crc
+
+static uint16_t crc_bytewise(const uint8_t* b, size_t len, uint16_t crc)
+{
+    while (len-- > 0)
+        crc = update_crc(crc, *b++);
+    return crc;
+}
+
+static void test_crc()
+{
+    static uint8_t data[4096 + 16];
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    CHECK(smq_calc_crc("123456789", 9, 0) == 0xBB3D);
+    if (!crc16_slice_ready)
+        crc16_slice_init();
+    for (size_t len = 0; len <= 4096; len += (len < 300) ? 1 : 61)
+    {
+        for (size_t offset = 0; offset < 16; offset += 5)
+        {
+            uint16_t crc = (uint16_t)(len * 31 + offset);
+            uint16_t expect = crc_bytewise(data + offset, len, crc);
+            if (smq_calc_crc_slice8(data + offset, len, crc) != expect)
+            {
+                fprintf(stderr, "slice-by-8 crc differs at len %zu offset %zu\n", len, offset);
+                failures++;
+            }
+            if (smq_calc_crc(data + offset, len, crc) != expect)
+            {
+                fprintf(stderr, "smq_calc_crc differs at len %zu offset %zu\n", len, offset);
+                failures++;
+            }
+#ifdef SMQ_CRC_CLMUL
+            __builtin_cpu_init();
+            if (len >= 64 && len % 16 == 0 && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1") &&
+                smq_calc_crc_clmul(data + offset, len, crc) != expect)
+            {
+                fprintf(stderr, "pclmul crc differs at len %zu offset %zu\n", len, offset);
+                failures++;
+            }
+#endif
+        }
+    }
+}
+
+// ----------------------------------------
+// delta
+
+static smq_topic_list_t test_topics;
+
+static smq_topic_t* delta_topic(const char* name, unsigned keyframe_interval)
+{
+    if (!smq_topic_list_append(&test_topics, name, NULL, NULL))
+        return NULL;
+    smq_topic_t* topic = test_topics.last;
+    if (keyframe_interval != 0)
+    {
+        topic->delta = (smq_delta_t*)calloc(1, sizeof(smq_delta_t));
+        topic->delta->keyframe_pending = 1;
+        topic->delta->keyframe_interval = keyframe_interval;
+    }
+    return topic;
+}
+
+/* Encode on the publisher, decode on the subscriber, NULL if the subscriber cannot rebuild it */
+static const char* delta_send(smq_topic_t* pub, smq_topic_t* sub, const char* msg, uint8_t* kind, int lose)
+{
+    static char out[512];
+    smq_msg_header_t header;
+    memset(&header, 0, sizeof(header));
+    memset(header.guid, 0x42, GUID_LEN);
+    size_t len = strlen(msg);
+    const uint8_t* payload = smq_delta_encode(pub, &header, (const uint8_t*)msg, &len);
+    *kind = header.flags[SMQ_FLAG_DELTA];
+    if (lose)
+        return NULL;
+    uint8_t wire[512];
+    memcpy(wire, payload, len);
+    uint8_t* whole = smq_delta_decode(sub, &header, wire, &len);
+    if (whole == NULL)
+        return NULL;
+    memcpy(out, whole, len);
+    out[len] = '\0';
+    return out;
+}
+
+static void test_delta()
+{
+    smq_topic_t* pub = delta_topic("pose", 4);
+    smq_topic_t* sub = delta_topic("pose", 0);
+    uint8_t kind;
+    const char* got;
+    got = delta_send(pub, sub, "{\"x\":1,\"y\":2,\"name\":\"r2\"}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_KEYFRAME && got != NULL && 0 == strcmp(got, "{\"x\":1,\"y\":2,\"name\":\"r2\"}"));
+    got = delta_send(pub, sub, "{\"x\":5,\"y\":2,\"name\":\"r2\"}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_UPDATE && got != NULL && 0 == strcmp(got, "{\"x\":5,\"y\":2,\"name\":\"r2\"}"));
+    got = delta_send(pub, sub, "{\"x\":5,\"y\":3,\"name\":\"d2\"}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_UPDATE && got != NULL && 0 == strcmp(got, "{\"x\":5,\"y\":3,\"name\":\"d2\"}"));
+    got = delta_send(pub, sub, "{\"x\":6,\"y\":3,\"name\":\"d2\"}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_UPDATE && got != NULL && 0 == strcmp(got, "{\"x\":6,\"y\":3,\"name\":\"d2\"}"));
+    // Every fourth message is a keyframe
+    got = delta_send(pub, sub, "{\"x\":6,\"y\":3,\"name\":\"d2\"}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_KEYFRAME && got != NULL && 0 == strcmp(got, "{\"x\":6,\"y\":3,\"name\":\"d2\"}"));
+    // Other keys are a keyframe as well
+    got = delta_send(pub, sub, "{\"x\":6,\"z\":3}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_KEYFRAME && got != NULL && 0 == strcmp(got, "{\"x\":6,\"z\":3}"));
+
+    // A lost update leaves the subscriber without a message until the next keyframe
+    delta_send(pub, sub, "{\"x\":7,\"z\":3}", &kind, 1);
+    CHECK(kind == SMQ_DELTA_UPDATE);
+    got = delta_send(pub, sub, "{\"x\":7,\"z\":4}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_UPDATE && got == NULL);
+    got = delta_send(pub, sub, "{\"x\":8,\"z\":4}", &kind, 0);
+    CHECK(got == NULL);
+    got = delta_send(pub, sub, "{\"x\":8,\"z\":5}", &kind, 0);
+    CHECK(kind == SMQ_DELTA_KEYFRAME && got != NULL && 0 == strcmp(got, "{\"x\":8,\"z\":5}"));
+
+    // Not an object: sent as it is, the stream starts over
+    size_t len = 5;
+    smq_msg_header_t header;
+    memset(&header, 0, sizeof(header));
+    CHECK(smq_delta_encode(pub, &header, (const uint8_t*)"[1,2]", &len) == (const uint8_t*)"[1,2]" || len == 5);
+    CHECK(header.flags[SMQ_FLAG_DELTA] == 0 && pub->delta->keyframe_pending);
+
+    // Updates naming unknown keys or not parsing are dropped
+    memset(&header, 0, sizeof(header));
+    memset(header.guid, 0x42, GUID_LEN);
+    uint16_t seq = sub->delta->seq + 1;
+    header.flags[SMQ_FLAG_DELTA] = SMQ_DELTA_UPDATE;
+    memcpy(header.flags + SMQ_FLAG_DELTA_SEQ, &seq, sizeof(seq));
+    uint8_t update[] = "{\"q\":1}";
+    len = strlen((char*)update);
+    CHECK(smq_delta_decode(sub, &header, update, &len) == NULL);
+    uint8_t truncated[] = "{\"x\":";
+    len = strlen((char*)truncated);
+    CHECK(smq_delta_decode(sub, &header, truncated, &len) == NULL);
+
+    smq_topic_list_destroy(&test_topics);
+    smq_delta_shutdown();
+}
+
+int main()
+{
+    test_json_scan();
+    test_json_malformed();
+    test_json_unescape();
+    test_smsg_round_trip();
+    test_smsg_malformed();
+    test_crc();
+    test_delta();
+    if (failures != 0)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}